@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
@@ -22,6 +23,7 @@
 #define NCYLS   203                     //!< Number of cylinders
 #define NHEADS  2                       //!< Number of heads
 #define NSECS   12                      //!< Number of sectors per track
+#define CYLPAGES (NHEADS*NSECS)         //!< Number of pages on one cylinder
 #define NPAGES  (NCYLS*NHEADS*NSECS)    //!< Number of pages on one disk image
 #define PAGESZ  (256*2)                 //!< Number of bytes in one page (data is actually words)
 #define FNLEN   40                      //!< Maximum length of a file name
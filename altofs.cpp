@@ -11,13 +11,18 @@
 
 #define FIX_FREE_PAGE_BITS   0 //!< Set to 1 to fix pages marked as free in the bit_table
 #define SWAP_GETPUT_WORD     msb()
+#define JOURNAL_GROUP_COMMIT 8 //!< Number of transactions to batch before the journal is synced
 
 AltoFS::AltoFS() :
     m_little(),
     m_kdh(),
     m_bit_count(0),
     m_bit_table(),
+    m_cyl_free(),
+    m_cyl_map(),
     m_disk_descriptor_dirty(false),
+    m_dd_leader(-1),
+    m_nfree_pages(0),
     m_sysdir(),
     m_sysdir_dirty(false),
     m_files(),
@@ -26,7 +31,35 @@ AltoFS::AltoFS() :
     m_dp0name(),
     m_dp1name(),
     m_verbose(0),
-    m_root_dir(0)
+    m_readonly(false),
+    m_use_overlay(false),
+    m_committed(false),
+    m_use_journal(false),
+    m_journal(),
+    m_shadow(),
+    m_layout(),
+    m_txn_depth(0),
+    m_txn_pages(),
+    m_journaled(),
+    m_rejournal(),
+    m_change_fn(0),
+    m_change_arg(0),
+    m_changes(),
+    m_root_dir(0),
+    m_inos(),
+    m_epoch(),
+    m_lock(),
+    m_page_mutex(),
+    m_flush_mutex(),
+    m_flush_cond(),
+    m_flush_thread(),
+    m_flush_running(false),
+    m_flush_quit(false),
+    m_flush_due(false),
+    m_flush_interval(0),
+    m_flush_threshold(0),
+    m_noexit(false),
+    m_error(0)
 {
     /**
      * The union's little.e is initialized to 1
@@ -34,14 +67,19 @@ AltoFS::AltoFS() :
      * a byte swap on little endian machines.
      */
     m_little.e = 1;
+    init_locks();
 }
 
-AltoFS::AltoFS(const char* filename, int verbosity) :
+AltoFS::AltoFS(const char* filename, int verbosity, int flags) :
     m_little(),
     m_kdh(),
     m_bit_count(0),
     m_bit_table(),
+    m_cyl_free(),
+    m_cyl_map(),
     m_disk_descriptor_dirty(false),
+    m_dd_leader(-1),
+    m_nfree_pages(0),
     m_sysdir(),
     m_sysdir_dirty(false),
     m_files(),
@@ -50,7 +88,35 @@ AltoFS::AltoFS(const char* filename, int verbosity) :
     m_dp0name(),
     m_dp1name(),
     m_verbose(verbosity),
-    m_root_dir(0)
+    m_readonly(0 != (flags & AFS_READONLY)),
+    m_use_overlay(0 != (flags & AFS_OVERLAY)),
+    m_committed(false),
+    m_use_journal(0 != (flags & AFS_JOURNAL)),
+    m_journal(),
+    m_shadow(),
+    m_layout(),
+    m_txn_depth(0),
+    m_txn_pages(),
+    m_journaled(),
+    m_rejournal(),
+    m_change_fn(0),
+    m_change_arg(0),
+    m_changes(),
+    m_root_dir(0),
+    m_inos(),
+    m_epoch(),
+    m_lock(),
+    m_page_mutex(),
+    m_flush_mutex(),
+    m_flush_cond(),
+    m_flush_thread(),
+    m_flush_running(false),
+    m_flush_quit(false),
+    m_flush_due(false),
+    m_flush_interval(0),
+    m_flush_threshold(0),
+    m_noexit(0 != (flags & AFS_NOEXIT)),
+    m_error(0)
 {
     /**
      * The union's little.e is initialized to 1
@@ -58,31 +124,433 @@ AltoFS::AltoFS(const char* filename, int verbosity) :
      * a byte swap on little endian machines.
      */
     m_little.e = 1;
-    read_disk_file(filename);
-    // verify_headers();
-    if (!validate_disk_descriptor())
-        fix_disk_descriptor();
-    make_fileinfo();
-    read_sysdir();
+    init_locks();
+    // Without AFS_NOEXIT, the fatal errors below exit instead
+    if (read_disk_file(filename) < 0) {
+        m_error = -EIO;
+        return;
+    }
+    if (flags & AFS_SHADOW) {
+        int res = m_shadow.open(m_doubledisk ? NPAGES * 2 : NPAGES);
+        my_assert(res == 0, "%s: Could not create the shadow pages (%s)\n",
+            __func__, strerror(-res));
+    }
+    int replayed = 0;
+    if (m_use_journal)
+        replayed = open_journal();
+    // A replayed journal changed the pages the index was made from
+    if (0 != replayed || !load_index()) {
+        // verify_headers();
+        make_fileinfo();
+        if (m_error < 0)
+            return;
+        if (validate_disk_descriptor())
+            read_sysdir();
+        else if (m_error == 0)
+            fix_disk_descriptor();
+        if (m_error < 0)
+            return;
+    }
+    // The index is stale as soon as the file system is modified
+    if (!m_readonly)
+        unlink(index_name().c_str());
+    if (m_root_dir)
+        m_root_dir->publish(&m_epoch);
+    // Once loaded, fatal errors exit as before
+    m_noexit = false;
 }
 
 AltoFS::~AltoFS()
 {
+    stop_flush_thread();
+    // Never write back what could not be loaded
+    if (0 == m_error) {
+        flush();
+        save_index();
+    }
+    delete m_root_dir;
+    m_root_dir = 0;
+    pthread_cond_destroy(&m_flush_cond);
+    pthread_mutex_destroy(&m_flush_mutex);
+    pthread_mutex_destroy(&m_page_mutex);
+}
+
+/**
+ * @brief Initialize the recursive page mutex and the flush thread mutex and condition
+ *
+ * Operations lock the file system lock m_lock shared or exclusive first,
+ * then the lock of a file, then the page mutex. Reads, writes and
+ * lookups of files lock it shared, so that they run in parallel, with
+ * writes to the same file serialized by the file's lock. Changes of
+ * SysDir, the file info tree and metadata transactions lock it exclusive.
+ */
+void AltoFS::init_locks()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_page_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&m_flush_mutex, NULL);
+    pthread_cond_init(&m_flush_cond, NULL);
+}
+
+/**
+ * @brief Save the DiskDescriptor and SysDir, if they were modified, and write back dirty pages
+ * @param sync if false, the changes are only stored in the disk image pages
+ * @return 0 on success, or -EIO on error
+ */
+int AltoFS::flush(bool sync)
+{
+    afs_fslocker lock(&m_lock, true);
+    if (m_readonly)
+        return 0;
+
+    if (m_journal.is_open()) {
+        // Journal the DiskDescriptor, SysDir and the pages which changed since they were journaled
+        afs_txn txn(this);
+        m_txn_pages.insert(m_rejournal.begin(), m_rejournal.end());
+    }
+
+    int res = 0;
     if (m_disk_descriptor_dirty) {
-        int res = save_disk_descriptor();
-        my_assert(res >= 0,
-            "%s: Could not save the SysDir array.\n",
-            __func__);
+        int err = save_disk_descriptor();
+        if (!my_assert(err >= 0,
+            "%s: Could not save the DiskDescriptor.\n",
+            __func__))
+            res = err;
     }
     if (m_sysdir_dirty) {
-        int res = save_sysdir();
-        my_assert(res >= 0,
+        int err = save_sysdir();
+        if (!my_assert(err >= 0,
             "%s: Could not save the SysDir array.\n",
-            __func__);
+            __func__))
+            res = err;
     }
-    save_disk_file();
-    delete m_root_dir;
-    m_root_dir = 0;
+    if (!sync)
+        return res;
+
+    if (m_journal.is_open()) {
+        int err = m_journal.sync();
+        if (!my_assert(err >= 0, "%s: Could not write the journal %s (%s)\n",
+            __func__, m_journal.name().c_str(), strerror(-err)))
+            return err;
+    }
+    if (!save_disk_file())
+        return -EIO;
+    if (m_journal.is_open()) {
+        m_journal.checkpoint();
+        m_journaled.clear();
+    }
+    return res;
+}
+
+/**
+ * @brief Merge the overlay files into new disk images
+ *
+ * Pending changes are written to the overlay(s) first. Each image with
+ * its overlay applied is then written to a new image named like the
+ * image with the .Z or .gz removed and a '~' appended, and the overlay file is
+ * removed. The file system is read-only afterwards.
+ *
+ * The index is removed, and not saved again, as its key would describe
+ * the original image(s) while its contents describe the committed ones.
+ *
+ * @return 0 on success, or -errno on error
+ */
+int AltoFS::commit_overlay()
+{
+    afs_fslocker lock(&m_lock, true);
+    if (!m_use_overlay || m_readonly)
+        return -EINVAL;
+
+    int res = flush(true);
+    if (res < 0)
+        return res;
+    for (int i = 0; i < (m_doubledisk ? 2 : 1); i++) {
+        std::string name;
+        res = m_disk[i].commit(&name);
+        if (!my_assert(res == 0, "%s: Could not commit %s (%s)\n",
+            __func__, m_disk[i].name().c_str(), strerror(-res)))
+            break;
+        log(0,"%s: Committed %s to %s\n", __func__, m_disk[i].name().c_str(), name.c_str());
+    }
+    // The images are closed now
+    m_readonly = true;
+    m_committed = true;
+    unlink(index_name().c_str());
+    return res;
+}
+
+/**
+ * @brief Open the journal next to the first disk image and replay it
+ *
+ * Committed transactions are applied to the disk image(s), incomplete
+ * transactions are discarded. Unless the file system is read-only, the
+ * result is written back and the journal is truncated.
+ *
+ * @return number of transactions replayed, or -errno on error
+ */
+int AltoFS::open_journal()
+{
+    if (m_disk[0].compressed() && !m_use_overlay) {
+        log(0,"%s: Can't journal the compressed image %s\n", __func__, m_dp0name.c_str());
+        return -EINVAL;
+    }
+
+    std::string name = m_dp0name + ".journal";
+    int res = m_journal.open(name, m_readonly);
+    if (!my_assert(res == 0, "%s: Could not open the journal %s (%s)\n",
+        __func__, name.c_str(), strerror(-res)))
+        return res;
+
+    std::vector<afs_journal_page_t> pages;
+    int count = m_journal.replay(pages);
+    if (!my_assert(count >= 0, "%s: Could not read the journal %s (%s)\n",
+        __func__, name.c_str(), strerror(-count)))
+        return count;
+    if (0 == count)
+        return 0;
+
+    const page_t last = m_doubledisk ? NPAGES * 2 : NPAGES;
+    for (size_t i = 0; i < pages.size(); i++) {
+        const afs_journal_page_t& jp = pages[i];
+        if (!my_assert(jp.vda >= 0 && jp.vda < last,
+            "%s: Page %ld in the journal is out of bounds\n", __func__, jp.vda))
+            continue;
+        memcpy(disk_page(jp.vda), &jp.page, sizeof(jp.page));
+        mark_dirty(jp.vda);
+    }
+    log(0,"%s: Replayed %d transactions (%lu pages) from %s\n", __func__,
+        count, pages.size(), name.c_str());
+
+    if (m_readonly)
+        return count;
+    if (!save_disk_file())
+        return -EIO;
+    res = m_journal.checkpoint();
+    return res < 0 ? res : count;
+}
+
+/**
+ * @brief Begin a metadata transaction; transactions may be nested
+ */
+void AltoFS::begin_txn()
+{
+    m_txn_depth++;
+}
+
+/**
+ * @brief Commit the outermost metadata transaction to the journal
+ *
+ * The DiskDescriptor and SysDir are saved to their pages first, so that
+ * they are part of the transaction. The journal is synced whenever
+ * JOURNAL_GROUP_COMMIT transactions were committed.
+ */
+void AltoFS::commit_txn()
+{
+    if (m_txn_depth > 1) {
+        m_txn_depth--;
+        return;
+    }
+    if (m_journal.is_open() && !m_readonly) {
+        if (m_disk_descriptor_dirty)
+            save_disk_descriptor();
+        if (m_sysdir_dirty)
+            save_sysdir();
+    }
+    m_txn_depth = 0;
+    // The metadata operation is complete, so lookups may see its changes
+    if (m_root_dir)
+        m_root_dir->publish(&m_epoch);
+    // ... and they can be reported now
+    if (!m_changes.empty()) {
+        std::vector<afs_change_t> changes;
+        changes.swap(m_changes);
+        for (size_t i = 0; i < changes.size(); i++)
+            m_change_fn(m_change_arg, changes[i]);
+    }
+    if (!m_journal.is_open() || m_readonly || m_txn_pages.empty()) {
+        m_txn_pages.clear();
+        return;
+    }
+
+    m_journal.begin();
+    std::set<page_t>::const_iterator it;
+    for (it = m_txn_pages.begin(); it != m_txn_pages.end(); it++) {
+        m_journal.add(*it, disk_page(*it));
+        m_journaled.insert(*it);
+        m_rejournal.erase(*it);
+    }
+    m_journal.commit();
+    m_txn_pages.clear();
+
+    if (m_journal.pending() >= JOURNAL_GROUP_COMMIT) {
+        int res = m_journal.sync();
+        my_assert(res >= 0, "%s: Could not write the journal %s (%s)\n",
+            __func__, m_journal.name().c_str(), strerror(-res));
+    }
+}
+
+/**
+ * @brief Report a change to the change callback
+ *
+ * Changes made inside a transaction are reported when it is committed,
+ * i.e. when lookups see them, so that a reader which is told about a
+ * change doesn't find the old state.
+ *
+ * @param change the change
+ */
+void AltoFS::report(const afs_change_t& change)
+{
+    if (!m_change_fn)
+        return;
+    if (m_txn_depth > 0)
+        m_changes.push_back(change);
+    else
+        m_change_fn(m_change_arg, change);
+}
+
+/**
+ * @brief Report that the status of a file changed
+ * @param info pointer to the file info node
+ */
+void AltoFS::report_attr(afs_fileinfo* info)
+{
+    afs_change_t change;
+    change.kind = AFS_CHANGE_ATTR;
+    change.ino = info->statIno();
+    change.offset = 0;
+    change.length = 0;
+    report(change);
+}
+
+/**
+ * @brief Report that the data of a file changed
+ * @param info pointer to the file info node
+ * @param offset start of the changed data
+ * @param length number of bytes changed, or 0 for up to the end
+ */
+void AltoFS::report_data(afs_fileinfo* info, off_t offset, off_t length)
+{
+    afs_change_t change;
+    change.kind = AFS_CHANGE_DATA;
+    change.ino = info->statIno();
+    change.offset = offset;
+    change.length = length;
+    report(change);
+}
+
+/**
+ * @brief Report that a name in the root directory changed
+ * @param name file name
+ */
+void AltoFS::report_entry(const std::string& name)
+{
+    afs_change_t change;
+    change.kind = AFS_CHANGE_ENTRY;
+    change.ino = 0;
+    change.name = name;
+    change.offset = 0;
+    change.length = 0;
+    report(change);
+}
+
+/**
+ * @brief Start the background thread which writes back modified pages
+ * @param interval seconds between flushes if anything was modified (0 = never)
+ * @param threshold number of dirty pages which trigger a flush (0 = never)
+ * @return 0 on success, or -errno on error
+ */
+int AltoFS::start_flush_thread(int interval, size_t threshold)
+{
+    if (m_readonly || m_flush_running)
+        return 0;
+    if (interval <= 0 && 0 == threshold)
+        return 0;
+
+    m_flush_interval = interval > 0 ? interval : 0;
+    m_flush_threshold = threshold;
+    m_flush_quit = false;
+    int res = pthread_create(&m_flush_thread, NULL, flush_thread, this);
+    if (!my_assert(0 == res, "%s: pthread_create() failed (%s)\n", __func__, strerror(res)))
+        return -res;
+    m_flush_running = true;
+    log(1,"%s: flushing every %d seconds or %lu dirty pages\n", __func__,
+        m_flush_interval, m_flush_threshold);
+    return 0;
+}
+
+/**
+ * @brief Stop the background flush thread and wait for it to finish
+ */
+void AltoFS::stop_flush_thread()
+{
+    if (!m_flush_running)
+        return;
+    pthread_mutex_lock(&m_flush_mutex);
+    m_flush_quit = true;
+    pthread_cond_signal(&m_flush_cond);
+    pthread_mutex_unlock(&m_flush_mutex);
+    pthread_join(m_flush_thread, NULL);
+    m_flush_running = false;
+}
+
+void* AltoFS::flush_thread(void* arg)
+{
+    AltoFS* afs = reinterpret_cast<AltoFS*>(arg);
+    afs->flush_loop();
+    return NULL;
+}
+
+/**
+ * @brief Wait for the flush interval to expire, or for the dirty page threshold to be reached,
+ * then flush everything that was modified.
+ *
+ * The flush mutex is released while flushing, as flush() locks the
+ * file system exclusive. Writers set m_flush_due and signal the condition
+ * with the flush mutex locked, so the wakeup can't be missed.
+ */
+void AltoFS::flush_loop()
+{
+    pthread_mutex_lock(&m_flush_mutex);
+    while (!m_flush_quit) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += m_flush_interval > 0 ? m_flush_interval : 3600;
+        while (!m_flush_quit) {
+            if (m_flush_due)
+                break;
+            if (ETIMEDOUT == pthread_cond_timedwait(&m_flush_cond, &m_flush_mutex, &deadline)) {
+                if (m_flush_interval > 0)
+                    break;
+                deadline.tv_sec += 3600;
+            }
+        }
+        if (m_flush_quit)
+            break;
+        m_flush_due = false;
+        pthread_mutex_unlock(&m_flush_mutex);
+        {
+            afs_fslocker lock(&m_lock, true);
+            if (m_disk_descriptor_dirty || m_sysdir_dirty || dirty_pages() > 0) {
+                log(2,"%s: flushing %lu dirty pages\n", __func__, dirty_pages());
+                flush();
+            }
+        }
+        pthread_mutex_lock(&m_flush_mutex);
+    }
+    pthread_mutex_unlock(&m_flush_mutex);
+}
+
+/**
+ * @brief Return the number of pages modified since they were last written back
+ * @return number of dirty pages
+ */
+size_t AltoFS::dirty_pages() const
+{
+    afs_locker lock(&m_page_mutex);
+    return m_disk[0].dirty() + m_disk[1].dirty();
 }
 
 void AltoFS::log(int verbosity, const char* format, ...)
@@ -114,6 +582,59 @@ void AltoFS::setVerbosity(int verbosity)
     m_verbose = verbosity;
 }
 
+/**
+ * @brief Return true, if the disk images are mapped read-only
+ * @return true if read-only
+ */
+bool AltoFS::readonly() const
+{
+    return m_readonly;
+}
+
+/**
+ * @brief Return the error which stopped loading the image(s)
+ * This is only ever set with AFS_NOEXIT; otherwise the program exits.
+ * @return 0 if the image(s) were loaded, or -errno on error
+ */
+int AltoFS::error() const
+{
+    return m_error;
+}
+
+/**
+ * @brief Return a pointer to the afs_page_t for page vda.
+ * Pages of dp1 follow the NPAGES pages of dp0.
+ * @param vda page number
+ * @return pointer to afs_page_t
+ */
+afs_page_t* AltoFS::disk_page(page_t vda)
+{
+    return m_disk[vda / NPAGES].page(vda % NPAGES);
+}
+
+/**
+ * @brief Mark the page vda as modified, so that it is written back
+ * @param vda page number
+ */
+void AltoFS::mark_dirty(page_t vda)
+{
+    afs_locker lock(&m_page_mutex);
+    m_disk[vda / NPAGES].mark_dirty(vda % NPAGES);
+    m_shadow.invalidate(vda);
+    if (m_journal.is_open()) {
+        if (m_txn_depth > 0)
+            m_txn_pages.insert(vda);
+        else if (m_journaled.count(vda))
+            m_rejournal.insert(vda);
+    }
+    if (m_flush_threshold > 0 && !m_flush_due && dirty_pages() >= m_flush_threshold) {
+        pthread_mutex_lock(&m_flush_mutex);
+        m_flush_due = true;
+        pthread_cond_signal(&m_flush_cond);
+        pthread_mutex_unlock(&m_flush_mutex);
+    }
+}
+
 /**
  * @brief Return a pointer to the afs_leader_t for page vda.
  * @param vda page number
@@ -121,7 +642,7 @@ void AltoFS::setVerbosity(int verbosity)
  */
 afs_leader_t* AltoFS::page_leader(page_t vda)
 {
-    afs_leader_t* lp = (afs_leader_t *)&m_disk[vda].data[0];
+    afs_leader_t* lp = (afs_leader_t *)&disk_page(vda)->data[0];
 
 #if defined(DEBUG)
     if (m_verbose > 3 && lp->proplength > 0) {
@@ -159,7 +680,119 @@ afs_leader_t* AltoFS::page_leader(page_t vda)
  */
 afs_label_t* AltoFS::page_label(page_t vda)
 {
-    return (afs_label_t *)&m_disk[vda].label[0];
+    return (afs_label_t *)&disk_page(vda)->label[0];
+}
+
+/**
+ * @brief Return the file name of the startup index
+ * @return file name
+ */
+std::string AltoFS::index_name() const
+{
+    return m_dp0name + ".index";
+}
+
+/**
+ * @brief Make the keys of the disk image file(s) for the startup index
+ * @param keys vector to receive the keys
+ * @return true on success, or false on error
+ */
+bool AltoFS::index_keys(std::vector<afs_index_key_t>& keys) const
+{
+    keys.resize(m_doubledisk ? 2 : 1);
+    for (size_t i = 0; i < keys.size(); i++) {
+        const std::string name = m_disk[i].name();
+        const std::string overlay = m_use_overlay ? afs_diskimage::overlay_name(name) : std::string();
+        if (afs_index::make_key(name, overlay, &keys[i]) < 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Load the DiskDescriptor, the SysDir and the files from the startup index
+ *
+ * If the index matches the disk image file(s), the scans of the disk
+ * image(s) at startup are skipped.
+ *
+ * @return true on success, or false if the index is missing or stale
+ */
+bool AltoFS::load_index()
+{
+    std::vector<afs_index_key_t> keys;
+    if (!index_keys(keys))
+        return false;
+    afs_index index;
+    int res = index.load(index_name(), keys);
+    if (res < 0) {
+        log(1,"%s: No valid index %s (%s)\n", __func__, index_name().c_str(), strerror(-res));
+        return false;
+    }
+
+    m_kdh = index.kdh();
+    m_bit_count = index.bit_table().size() * 16;
+    load_bit_table(index.bit_table());
+    m_disk_descriptor_dirty = false;
+
+    if (make_root_dir() < 0)
+        return false;
+    const std::vector<afs_index_file_t>& files = index.files();
+    for (size_t i = 0; i < files.size(); i++) {
+        const afs_index_file_t& f = files[i];
+        if (make_fileinfo_file(m_root_dir, f.leader_vda, f.size, f.npages) < 0)
+            return false;
+        m_root_dir->child(i)->setDeleted(0 != f.deleted);
+    }
+
+    afs_fileinfo* dd = lookup("DiskDescriptor");
+    if (dd)
+        m_dd_leader = dd->leader_page_vda();
+
+    m_sysdir = index.sysdir();
+    m_sysdir_dirty = false;
+    const std::vector<afs_dv_t>& dirents = index.dirents();
+    m_files.assign(dirents.begin(), dirents.end());
+    log(1,"%s: Loaded %lu files from %s\n", __func__, files.size(), index_name().c_str());
+    return true;
+}
+
+/**
+ * @brief Save the startup index, if the disk image file(s) are up to date
+ *
+ * Nothing is saved if the pages differ from the image file(s), e.g. when
+ * a read-only file system was repaired in memory, or a compressed image
+ * was written back to another file, or the overlays were committed.
+ */
+void AltoFS::save_index()
+{
+    if (!m_root_dir || m_committed)
+        return;
+    for (int i = 0; i < (m_doubledisk ? 2 : 1); i++)
+        if (m_disk[i].modified())
+            return;
+
+    std::vector<afs_index_key_t> keys;
+    if (!index_keys(keys))
+        return;
+    afs_index index;
+    index.kdh() = m_kdh;
+    for (page_t i = 0; i < m_bit_count / 16; i++)
+        index.bit_table().push_back(bit_table_word(i));
+    index.sysdir() = m_sysdir;
+    for (size_t i = 0; i < m_files.size(); i++)
+        index.dirents().push_back(m_files[i].data);
+    for (int i = 0; i < m_root_dir->size(); i++) {
+        const afs_fileinfo* info = m_root_dir->child(i);
+        afs_index_file_t f;
+        f.leader_vda = info->leader_page_vda();
+        f.size = info->statSize();
+        f.npages = info->statBlocks();
+        f.deleted = info->deleted();
+        index.files().push_back(f);
+    }
+    int res = index.save(index_name(), keys);
+    my_assert(res == 0, "%s: Could not save the index %s (%s)\n",
+        __func__, index_name().c_str(), strerror(-res));
 }
 
 /**
@@ -180,117 +813,86 @@ int AltoFS::read_disk_file(std::string name)
         m_doubledisk = false;
     }
 
-    m_disk.resize(2*NPAGES);
-    my_assert_or_die(m_disk.data() != NULL,
-        "%s: disk resize(%d) failed",
-        __func__, 2*NPAGES);
+    if (!m_doubledisk)
+        return read_single_disk(m_dp0name, &m_disk[0]) ? 0 : -ENOENT;
 
+    // Map (or decompress) dp1 in a second thread while mapping dp0
+    afs_read_disk_t dp1 = { this, m_dp1name, &m_disk[1], false };
+    pthread_t thread;
+    bool threaded = 0 == pthread_create(&thread, NULL, read_disk_thread, &dp1);
+    if (!threaded)
+        read_disk_thread(&dp1);
     int ok = read_single_disk(m_dp0name, &m_disk[0]);
-    if (ok && m_doubledisk) {
-        ok = read_single_disk(m_dp1name, &m_disk[NPAGES]);
-    }
-    return ok ? 0 : -ENOENT;
+    if (threaded)
+        pthread_join(thread, NULL);
+    return ok && dp1.ok ? 0 : -ENOENT;
 }
 
 /**
- * @brief Read a single file to the in-memory disk space
+ * @brief Thread function to map a single disk image
+ * @param arg pointer to a afs_read_disk_t
+ * @return NULL
+ */
+void* AltoFS::read_disk_thread(void* arg)
+{
+    afs_read_disk_t* rd = reinterpret_cast<afs_read_disk_t *>(arg);
+    rd->ok = rd->afs->read_single_disk(rd->name, rd->disk);
+    return NULL;
+}
+
+/**
+ * @brief Map a single disk image file
  * @param name file name
- * @param diskp pointer to the starting disk page
+ * @param disk pointer to the afs_diskimage to map it to
  * @return true on success, or false on error
  */
-bool AltoFS::read_single_disk(std::string name, afs_page_t* diskp)
+bool AltoFS::read_single_disk(std::string name, afs_diskimage* disk)
 {
-    FILE *infile;
-    bool ok = true;
-    bool use_pclose = false;
-
-    log(1,"%s: Reading disk image '%s'\n", __func__, name.c_str());
-    // We conclude the disk image is compressed if the name ends with .Z
-    int pos = name.find(".Z");
-    if (pos > 0) {
-        char* cmd = new char[name.size() + 10];
-        sprintf(cmd, "zcat %s", name.c_str());
-        infile = popen(cmd, "r");
-        my_assert_or_die(infile != NULL, "%s: popen failed on %s\n", __func__, cmd);
-        delete[] cmd;
-        use_pclose = true;
-    } else {
-        infile = fopen (name.c_str(), "rb");
-        my_assert_or_die(infile != NULL, "%s: fopen failed on %s\n", __func__, name.c_str());
-    }
-
-    char *dp = reinterpret_cast<char *>(diskp);
-    size_t total = NPAGES * PAGESZ;
-    size_t totalbytes = 0;
-    while (totalbytes < total) {
-        size_t bytes = fread(dp, sizeof (char), total - totalbytes, infile);
-        dp += bytes;
-        totalbytes += bytes;
-        ok = my_assert(!ferror(infile) && !feof(infile),
-            "%s: Disk read failed: %d bytes read instead of %d\n",
-            __func__, totalbytes, total);
-        if (!ok)
-            break;
-    }
-    if (use_pclose)
-        pclose(infile);
-    else
-        fclose(infile);
-    return ok;
+    log(1,"%s: Mapping disk image '%s'%s\n", __func__, name.c_str(),
+        m_readonly ? " read-only" : "");
+    afs_map_mode_t mode = AFS_MAP_SHARED;
+    if (m_use_overlay)
+        // Read-only overlays are applied, but never written to
+        mode = AFS_MAP_OVERLAY;
+    else if (m_readonly)
+        mode = AFS_MAP_READONLY;
+    else if (m_use_journal)
+        // Pages must not reach the file before they are journaled
+        mode = AFS_MAP_PRIVATE;
+    int res = disk->open(name, mode, m_readonly);
+    my_assert_or_die(res == 0, "%s: Could not open %s (%s)\n",
+        __func__, name.c_str(), strerror(-res));
+    return res == 0;
 }
 
 /**
- * @brief Save the in-memory disk image(s) to a file (or two files)
- * @return 0 on success,
+ * @brief Write back the disk image(s)
+ * @return true on success, or false on error
  */
 int AltoFS::save_disk_file()
 {
-    bool res = save_single_disk(m_dp0name, &m_disk[0]);
+    bool res = save_single_disk(&m_disk[0]);
     if (res && m_doubledisk)
-        res = save_single_disk(m_dp1name, &m_disk[NPAGES]);
+        res = save_single_disk(&m_disk[1]);
     return res;
 }
 
 /**
- * @brief Save a single disk image to a file
- * @param name
- * @param diskp
+ * @brief Write back a single disk image
+ *
+ * Mapped images are synced to their file. Compressed images are
+ * written uncompressed to a file without the .Z or .gz and with a '~' appended.
+ *
+ * @param disk pointer to the afs_diskimage
  * @return true on success, or false on error
  */
-bool AltoFS::save_single_disk(std::string name, afs_page_t* diskp)
-{
-    FILE *outfile;
-    bool ok = true;
-
-    // We conclude the disk image is compressed if the name ends with .Z
-    int pos = name.find(".Z");
-    if (pos > 0)
-        // Remove the .Z~ or .Z extension, as we will save uncompressed
-        name.erase(pos);
-    // For now always write backup files
-    name += "~";
-    log(1,"%s: Writing disk image '%s'\n", __func__, name.c_str());
-
-    outfile = fopen (name.c_str(), "wb");
-    my_assert_or_die(outfile != NULL,
-        "%s: fopen failed on Alto disk image file %s\n",
-        __func__, name.c_str());
-
-    char *dp = reinterpret_cast<char *>(diskp);
-    size_t total = NPAGES * PAGESZ;
-    size_t totalbytes = 0;
-    while (totalbytes < total) {
-        size_t bytes = fwrite(dp, sizeof (char), total - totalbytes, outfile);
-        dp += bytes;
-        totalbytes += bytes;
-        ok = my_assert(!ferror(outfile),
-            "%s: Disk write failed: %d bytes written instead of %d\n",
-            __func__, totalbytes, total);
-        if (!ok)
-            break;
-    }
-    fclose(outfile);
-    return ok;
+bool AltoFS::save_single_disk(afs_diskimage* disk)
+{
+    log(1,"%s: Writing disk image '%s'\n", __func__, disk->name().c_str());
+    int res = disk->sync();
+    return my_assert(res == 0,
+        "%s: Disk write failed for %s (%s)\n",
+        __func__, disk->name().c_str(), strerror(-res));
 }
 
 /**
@@ -424,40 +1026,32 @@ word AltoFS::vda_to_rda(page_t vda)
 /**
  * @brief Allocate a new page from the free pages.
  *
- * Scan for pages near the given page, always alternatingly looking
- * at a page after and a page before the given page.
+ * Take the page the layout places after the given page, if it is
+ * free, or else the free page nearest to the given page, so that the
+ * pages of a file stay close together.
  *
  * @param filepage previous page VDA where this page is chained to
  * @return new page VDA, or 0 if no free page is found
  */
 page_t AltoFS::alloc_page(page_t page)
 {
+    afs_locker lock(&m_page_mutex);
     // Won't find a free page anyway
     if (0 == m_kdh.free_pages) {
         log(0,"%s: KDH free pages is 0 - no free page found\n", __func__);
         return 0;
     }
 
-    const page_t maxpage = m_bit_count;
-    const page_t prev_vda = page;
-
-    afs_label_t* lprev = page ? page_label(page) : NULL;
-
-    // Search a free page close to the current filepage
-    page_t dist = 1;
-    while (dist < maxpage) {
-        if (page + dist < maxpage && !getBT(page + dist)) {
-            page += dist;
-            break;
-        }
-        if (page - dist > 1 && !getBT(page - dist)) {
-            page -= dist;
-            break;
-        }
-        dist++;
+    // Take the page the layout places after the current filepage, if it is free
+    if (page > 1 && !m_layout.linear()) {
+        const page_t next = m_layout.next(page);
+        if (next > 1 && next < m_bit_count && !getBT(next))
+            return claim_page(page, next);
     }
 
-    if (getBT(page)) {
+    // Search the free page closest to the current filepage
+    const page_t found = nearest_free_page(page);
+    if (found < 0) {
         // No free page found
 #if defined(DEBUG)
         log(0,"%s: no free page found\n", __func__);
@@ -465,6 +1059,50 @@ page_t AltoFS::alloc_page(page_t page)
         return 0;
     }
 
+    return claim_page(page, found);
+}
+
+/**
+ * @brief Allocate count pages, preferably a run of consecutive pages
+ *
+ * The pages are chained after the page prev and appended to pages.
+ * If there is no run of count free pages, or the layout uses a skew,
+ * the pages are allocated one by one with alloc_page().
+ *
+ * @param prev previous page VDA where the first page is chained to
+ * @param count number of pages to allocate
+ * @param pages vector to append the new page numbers to
+ * @return 0 on success, or -ENOSPC if not all pages could be allocated
+ */
+int AltoFS::alloc_pages(page_t prev, size_t count, std::vector<page_t>& pages)
+{
+    afs_locker lock(&m_page_mutex);
+    const page_t first = count > 1 && m_layout.linear() ? find_free_run(prev + 1, count) : -1;
+    for (size_t i = 0; i < count; i++) {
+        const page_t page = first > 1 ? claim_page(prev, first + i) : alloc_page(prev);
+        if (0 == page)
+            return -ENOSPC;
+        pages.push_back(page);
+        prev = page;
+    }
+    return 0;
+}
+
+/**
+ * @brief Mark a free page as used and chain it after the page prev_vda
+ *
+ * Without a previous page (prev_vda is 0) the page becomes the leader
+ * page of a new file.
+ *
+ * @param prev_vda previous page VDA, or 0 for a leader page
+ * @param page free page VDA
+ * @return page
+ */
+page_t AltoFS::claim_page(page_t prev_vda, page_t page)
+{
+    afs_locker lock(&m_page_mutex);
+    afs_label_t* lprev = prev_vda ? page_label(prev_vda) : NULL;
+
     m_kdh.free_pages -= 1;
     m_disk_descriptor_dirty = true;
     setBT(page, 1);
@@ -472,9 +1110,12 @@ page_t AltoFS::alloc_page(page_t page)
 
     afs_label_t* lthis = page_label(page);
     memset(lthis, 0, sizeof(*lthis));
+    mark_dirty(page);
     // link pages
-    if (lprev)
+    if (lprev) {
         lprev->next_rda = vda_to_rda(page);
+        mark_dirty(prev_vda);
+    }
     lthis->prev_rda = vda_to_rda(prev_vda);
     lthis->nbytes = 0;
 
@@ -563,7 +1204,7 @@ int AltoFS::read_sysdir()
         save_sysdir();
 
     m_files.clear();
-    afs_fileinfo* info = find_fileinfo("SysDir");
+    afs_fileinfo* info = lookup("SysDir");
     my_assert_or_die(info != NULL, "%s: The file SysDir was not found!", __func__);
     if (info == NULL)
         return -ENOENT;
@@ -572,7 +1213,7 @@ int AltoFS::read_sysdir()
     // Allocate sysdir with slack for one extra afs_dv_t
     m_sysdir.resize(sdsize + sizeof(afs_dv_t));
 
-    read_file(info->leader_page_vda(), m_sysdir.data(), sdsize, false);
+    read_file(info, m_sysdir.data(), sdsize);
     if (lsb())
         swabit((char *)m_sysdir.data(), sdsize);
 
@@ -615,7 +1256,7 @@ int AltoFS::read_sysdir()
         }
         m_files.resize(count+1);
         m_files[count++] = dv;
-        afs_fileinfo* info = find_fileinfo(fn);
+        afs_fileinfo* info = lookup(fn);
         if (4 == type) {
             if (info)
                 info->setDeleted(false);
@@ -646,7 +1287,7 @@ int AltoFS::read_sysdir()
  */
 int AltoFS::save_sysdir()
 {
-    afs_fileinfo* info = find_fileinfo("SysDir");
+    afs_fileinfo* info = lookup("SysDir");
     my_assert_or_die(info != NULL, "%s: The file SysDir was not found!", __func__);
     if (info == NULL)
         return -ENOENT;
@@ -655,43 +1296,30 @@ int AltoFS::save_sysdir()
 
     size_t sdsize = info->statSize();
 
-    const afs_dv_t* end = (afs_dv_t *)(m_sysdir.data() + sdsize);
-    afs_dv_t* pdv = (afs_dv_t *)m_sysdir.data();
-    size_t idx = 0;
-    while (idx < m_files.size() && pdv < end) {
-        const afs_dv* dv = &m_files[idx];
-        byte fnlen = dv->data.filename[lsb()];
+    // Make room for all entries
+    size_t eod = 0;
+    for (size_t idx = 0; idx < m_files.size(); idx++) {
+        byte fnlen = m_files[idx].data.filename[lsb()];
         // length is always word aligned
         size_t nsize = (fnlen | 1) + 1;
-        size_t esize = sizeof(*pdv) - sizeof(pdv->filename) + nsize;
-        memcpy(pdv, &dv->data, esize);
-        pdv = (afs_dv_t*)((char *)pdv + esize);
-        idx++;
+        eod += sizeof(afs_dv_t) - sizeof(m_files[idx].data.filename) + nsize;
     }
+    if (eod + 1 > m_sysdir.size())
+        m_sysdir.resize(eod + 1);
 
-    if (idx < m_files.size()) {
-        // We need to increase sdsize and write the last entry
+    afs_dv_t* pdv = (afs_dv_t *)m_sysdir.data();
+    for (size_t idx = 0; idx < m_files.size(); idx++) {
         const afs_dv* dv = &m_files[idx];
         byte fnlen = dv->data.filename[lsb()];
-        // length is always word aligned
         size_t nsize = (fnlen | 1) + 1;
         size_t esize = sizeof(*pdv) - sizeof(pdv->filename) + nsize;
-        size_t offs = (size_t)((char*)pdv - m_sysdir.data());
-        if (offs + esize >= m_sysdir.size()) {
-            // Resize m_sysdir
-            m_sysdir.resize(offs + esize + 1);
-            info->setStatSize(offs + esize + 1);
-            m_sysdir[offs + esize] = '\0';
-        }
         memcpy(pdv, &dv->data, esize);
         pdv = (afs_dv_t*)((char *)pdv + esize);
     }
 
-    size_t eod = (size_t)((char *)pdv - m_sysdir.data());
     log(1,"%s: SysDir usage is %lu/%lu bytes\n", __func__, eod, sdsize);
     if (eod > sdsize) {
         sdsize = eod;
-        m_sysdir.resize(sdsize+1);
         m_sysdir[sdsize] = '\0';
         info->setStatSize(sdsize);
     }
@@ -703,15 +1331,16 @@ int AltoFS::save_sysdir()
     if (lsb()) {
         std::vector<char> sysdir(m_sysdir);
         swabit(sysdir.data(), sdsize);
-        size_t written = write_file(info->leader_page_vda(), sysdir.data(), eod, false);
-        if (written != eod)
+        ssize_t written = write_file(info, sysdir.data(), eod);
+        if (written != (ssize_t)eod)
             res = -ENOSPC;
     } else {
-        size_t written = write_file(info->leader_page_vda(), m_sysdir.data(), eod, false);
-        if (written != eod)
+        ssize_t written = write_file(info, m_sysdir.data(), eod);
+        if (written != (ssize_t)eod)
             res = -ENOSPC;
     }
-    m_sysdir_dirty = 0 == res;
+    report_data(info, 0, 0);
+    m_sysdir_dirty = 0 != res;
     return res;
 }
 
@@ -722,20 +1351,27 @@ int AltoFS::save_disk_descriptor()
     afs_fa_t fa;
 
     // Locate DiskDescriptor and copy it into the global data structure
-    ddlp = find_file("DiskDescriptor");
+    ddlp = m_dd_leader >= 0 ? m_dd_leader : find_file("DiskDescriptor");
     my_assert_or_die(ddlp != -1, "%s: Can't find DiskDescriptor\n", __func__);
+    if (ddlp == -1)
+        return -ENOENT;
+    m_dd_leader = ddlp;
 
     l = page_label(ddlp);
 
     fa.vda = rda_to_vda(l->next_rda);
-    memcpy(&m_disk[fa.vda].data[0], &m_kdh, sizeof(m_kdh));
+    memcpy(&disk_page(fa.vda)->data[0], &m_kdh, sizeof(m_kdh));
+    mark_dirty(fa.vda);
 
     // Now copy the bit table from m_bit_table onto the disk
     fa.filepage = 1;
     fa.char_pos = sizeof(m_kdh);
     for (word i = 0; i < m_kdh.disk_bt_size; i++)
-        putword(&fa, m_bit_table[i]);
+        putword(&fa, bit_table_word(i));
 
+    afs_fileinfo* info = lookup("DiskDescriptor");
+    if (info)
+        report_data(info, 0, 0);
     m_disk_descriptor_dirty = false;
     return 0;
 }
@@ -812,11 +1448,15 @@ int AltoFS::rename_sysdir_entry(std::string name, std::string newname)
  */
 int AltoFS::unlink_file(std::string path)
 {
+    afs_fslocker lock(&m_lock, true);
     log(1,"%s: path=%s\n", __func__, path.c_str());
+    if (m_readonly)
+        return -EROFS;
+    afs_txn txn(this);
     // Skip leading directory (we have only root)
     if (path[0] == '/')
         path.erase(0, 1);
-    afs_fileinfo* info = find_fileinfo(path);
+    afs_fileinfo* info = lookup(path);
     if (!info)
         return -ENOENT;
 
@@ -830,6 +1470,7 @@ int AltoFS::unlink_file(std::string path)
     // FIXME: What needs to be zapped?
     memset(lp->filename, 0, sizeof(lp->filename));
     memset(&lp->last_page_hint, 0, sizeof(lp->last_page_hint));
+    mark_dirty(info->leader_page_vda());
 
     page_t page = info->leader_page_vda();
     afs_label_t* l = page_label(page);
@@ -845,7 +1486,10 @@ int AltoFS::unlink_file(std::string path)
     }
 
     // Remove this node from the file info hiearchy
+    // The node itself stays valid for handles which still refer to it
     afs_fileinfo* parent = info->parent();
+    info->setRemoved(true);
+    info->pages().clear();
     if (!parent->remove(info)) {
         log(0, "%s: Could not remove child (%p) from parent (%p).\n",
             __func__, (void*)info, (void*)parent);
@@ -860,6 +1504,7 @@ int AltoFS::unlink_file(std::string path)
     l->fid_file = 0xffff;
     l->fid_dir = 0xffff;
     l->fid_id = 0xffff;
+    report_entry(path);
 
     return remove_sysdir_entry(fn);
 }
@@ -872,11 +1517,15 @@ int AltoFS::unlink_file(std::string path)
  */
 int AltoFS::rename_file(std::string path, std::string newname)
 {
+    afs_fslocker lock(&m_lock, true);
     log(1,"%s: path=%s\n", __func__, path.c_str());
+    if (m_readonly)
+        return -EROFS;
+    afs_txn txn(this);
     // Skip leading directory (we have only root)
     if (path[0] == '/')
         path.erase(0, 1);
-    afs_fileinfo* info = find_fileinfo(path);
+    afs_fileinfo* info = lookup(path);
     if (!info)
         return -ENOENT;
 
@@ -893,9 +1542,12 @@ int AltoFS::rename_file(std::string path, std::string newname)
         return -EINVAL;
 
     info->rename(newname);
+    report_entry(path);
+    report_entry(newname);
 
     // Set new name in the leader page
     string_to_filename(lp->filename, newname);
+    mark_dirty(info->leader_page_vda());
 
     return rename_sysdir_entry(fn, newname);
 }
@@ -908,94 +1560,47 @@ int AltoFS::rename_file(std::string path, std::string newname)
  */
 int AltoFS::truncate_file(std::string path, off_t offset)
 {
+    afs_fslocker lock(&m_lock, true);
     log(1,"%s: path=%s\n", __func__, path.c_str());
+    if (m_readonly)
+        return -EROFS;
+    afs_txn txn(this);
     // Skip leading directory (we have only root)
     if (path[0] == '/')
         path.erase(0, 1);
-    afs_fileinfo* info = find_fileinfo(path);
+    afs_fileinfo* info = lookup(path);
     if (!info)
         return -ENOENT;
 
-    afs_leader_t* lp = page_leader(info->leader_page_vda());
-    afs_label_t* l = page_label(info->leader_page_vda());
-    const word id = l->fid_id;
-
-    size_t size = info->statSize() - offset;
-    page_t page = rda_to_vda(l->next_rda);
-    page_t last_page = -1;
-    word char_pos = 0;
-
-    off_t offs = 0;
-    while (page && size > 0) {
-        l = page_label(page);
-        if (offs >= offset) {
-
-            // free this page
-#if defined(DEBUG)
-            log(3,"%s: offs=0x%06lx page=%-5ld (free page)\n",
-                __func__, offs, page);
-#endif
-            free_page(page, id);
-            size -= l->nbytes;
-            offs += PAGESZ;
-            if (-1 == last_page) {
-                last_page = page;
-                char_pos = 0;
-            }
-
-        } else if (offs + PAGESZ > offset) {
-
-            // shrink this page to the remaining bytes
-            l->nbytes = offset - offs;
-#if defined(DEBUG)
-            log(3,"%s: offs=0x%06lx page=%-5ld (shrink to 0x%03x bytes)\n",
-                __func__, offs, page, l->nbytes);
-#endif
-            size -= l->nbytes;
-            offs += l->nbytes;
-            last_page = page;
-            char_pos = l->nbytes;
-            break;  // we're done
+    report_data(info, offset, 0);
+    if ((size_t)offset >= info->statSize()) {
+        int res = extend_file(info, offset);
+        update_file(info);
+        return res;
+    }
 
-        } else if (0 == l->next_rda) {
+    const word id = page_label(info->leader_page_vda())->fid_id;
+    std::vector<page_t>& pages = file_pages(info);
+    const size_t idx = offset / PAGESZ;
+    if (idx >= pages.size())
+        return -EIO;
 
-            // allocate a new page
-            page = alloc_page(page);
-            if (0 == page) {
-                // No free page found
-                info->setStatSize(static_cast<size_t>(offs));
-                return -ENOSPC;
-            }
+    // Shrink the page at offset and cut the chain after it
+    afs_label_t* l = page_label(pages[idx]);
+    l->nbytes = offset % PAGESZ;
+    l->next_rda = 0;
+    mark_dirty(pages[idx]);
 #if defined(DEBUG)
-            log(3,"%s: offs=0x%06lx page=%-5ld (allocated new page)\n",
-                __func__, offs, page);
+    log(3,"%s: page=%-5ld (shrink to 0x%03x bytes)\n", __func__, pages[idx], l->nbytes);
 #endif
-            if (offs + PAGESZ < offset) {
-                l->nbytes = PAGESZ;
-            } else {
-                l->nbytes = (offset - offs) % PAGESZ;
-            }
-            last_page = page;
-            char_pos = l->nbytes;
-            // FIXME: should we fill it with zeroes?
-
-            if (l->nbytes < PAGESZ)
-                break;
-
-        } else {
+    for (size_t i = idx + 1; i < pages.size(); i++) {
 #if defined(DEBUG)
-            log(4,"%s: offs=0x%06lx page=%-5ld (seeking to 0x%06lx)\n",
-                __func__, offs, page, offset);
+        log(3,"%s: page=%-5ld (free page)\n", __func__, pages[i]);
 #endif
-            size -= PAGESZ;
-            offs += PAGESZ;
-        }
-        page = rda_to_vda(l->next_rda);
+        free_page(pages[i], id);
     }
-    lp->last_page_hint.vda = last_page;
-    lp->last_page_hint.filepage = l->filepage;
-    lp->last_page_hint.char_pos = char_pos;
-    info->setStatSize(offs);
+    pages.resize(idx + 1);
+    update_file(info);
 
     return 0;
 }
@@ -1007,11 +1612,15 @@ int AltoFS::truncate_file(std::string path, off_t offset)
  */
 int AltoFS::create_file(std::string path)
 {
+    afs_fslocker lock(&m_lock, true);
     log(1,"%s: path=%s\n", __func__, path.c_str());
+    if (m_readonly)
+        return -EROFS;
+    afs_txn txn(this);
     // Skip leading directory (we have only root)
     if (path[0] == '/')
         path.erase(0, 1);
-    afs_fileinfo* info = find_fileinfo(path);
+    afs_fileinfo* info = lookup(path);
     if (info)
         return -EEXIST;
 
@@ -1042,6 +1651,7 @@ int AltoFS::create_file(std::string path)
     lp->dir_fp_hint.leader_vda = 1; // FIXME: m_sysdir_vda?
     lp->propbegin = offsetof(afs_leader_t, leader_props) / sizeof(word);
     lp->proplength = static_cast<byte>(sizeof(lp->leader_props) / sizeof(word));
+    mark_dirty(page);
 
     page_t page0 = alloc_page(page);
     my_assert(page0 != 0,
@@ -1074,18 +1684,17 @@ int AltoFS::create_file(std::string path)
         idx++;
     }
 
-    afs_dv* dv = &m_files[idx];
     if (!match) {
-        if (it == m_files.end()) {
+        if (it != m_files.end()) {
             // Not the last entry, so make room
             log(2,"%s: insert entry at pos=%d/%ld in SysDir\n", __func__, idx, m_files.size());
-            // Insert a new entry at idx
-            m_files.insert(it, *dv);
         } else {
             log(2,"%s: insert entry at pos=%ld at the end of SysDir\n", __func__, m_files.size());
-            m_files[idx] = *dv;
         }
+        // Insert a new entry at idx
+        m_files.insert(it, afs_dv());
     }
+    afs_dv* dv = &m_files[idx];
 
     dv->data.typelength[0] = path.length();                     // whatever "length" this is
     dv->data.typelength[1] = 4;                                 // this is an existing file
@@ -1097,16 +1706,25 @@ int AltoFS::create_file(std::string path)
     string_to_filename(dv->data.filename, path);
     m_sysdir_dirty = true;
 
-    return make_fileinfo_file(m_root_dir, page);
+    int res = make_fileinfo_file(m_root_dir, page);
+    if (res < 0)
+        return res;
+    // The new file is in SysDir, so it is not deleted
+    m_root_dir->child(m_root_dir->size() - 1)->setDeleted(false);
+    report_entry(path);
+    return 0;
 }
 
 int AltoFS::set_times(std::string path, const struct timespec tv[])
 {
+    afs_fslocker lock(&m_lock, true);
     log(1,"%s: path=%s\n", __func__, path.c_str());
+    if (m_readonly)
+        return -EROFS;
     // Skip leading directory (we have only root)
     if (path[0] == '/')
         path.erase(0, 1);
-    afs_fileinfo* info = find_fileinfo(path);
+    afs_fileinfo* info = lookup(path);
     if (!info)
         return -ENOENT;
 
@@ -1116,15 +1734,23 @@ int AltoFS::set_times(std::string path, const struct timespec tv[])
     // tv[0] == last access, tv[1] == last modification
     time_to_altotime(tv[1].tv_sec, &lp->written);
     time_to_altotime(tv[0].tv_sec, &lp->read);
+    mark_dirty(info->leader_page_vda());
+    report_attr(info);
     return 0;
 }
 
-int AltoFS::make_fileinfo()
+/**
+ * @brief Create an empty root directory
+ * @return 0 on success, or -ENOMEM on error
+ */
+int AltoFS::make_root_dir()
 {
     if (m_root_dir) {
         delete m_root_dir;
         m_root_dir = 0;
     }
+    // Nothing was handed out while loading
+    m_inos.clear();
 
     struct stat st;
     memset(&st, 0, sizeof(st));
@@ -1136,39 +1762,96 @@ int AltoFS::make_fileinfo()
     my_assert(m_root_dir != 0, "%s: Allocating new root_dir failed\n", __func__);
     if (!m_root_dir)
         return -ENOMEM;
+    return 0;
+}
 
-    const int last = m_doubledisk ? NPAGES * 2 : NPAGES;
+/**
+ * @brief Make the fileinfo for all files in one pass over the page labels
+ *
+ * The pass collects the links and byte counts of all pages, the leader
+ * pages, the DiskDescriptor leader and the number of free pages. The file
+ * sizes are then summed by following the collected links, so no page is
+ * visited twice. The reverse page map (owner) is used to catch pages which
+ * are linked into more than one file.
+ *
+ * @return 0 on success, or -ENOMEM on error
+ */
+int AltoFS::make_fileinfo()
+{
+    int res = make_root_dir();
+    if (res < 0)
+        return res;
+
+    const page_t last = m_doubledisk ? NPAGES * 2 : NPAGES;
+    std::vector<page_t> next(last, 0);
+    std::vector<word> nbytes(last, 0);
+    std::vector<page_t> leaders;
+    m_dd_leader = -1;
+    m_nfree_pages = 0;
     for (page_t page = 0; page < last; page++) {
-        afs_label_t* l = page_label(page);
-        // First page of a file?
-        if (l->filepage != 0)
-            continue;
-        // Marked as a regular file?
-        if (l->fid_file != 1)
+        const afs_label_t* l = page_label(page);
+        nbytes[page] = l->nbytes;
+        if (l->next_rda != 0) {
+            const page_t vda = rda_to_vda(l->next_rda);
+            if (my_assert(vda < last, "%s: page %ld links to invalid page %ld\n", __func__, page, vda))
+                next[page] = vda;
+        }
+        m_nfree_pages += is_page_free(page);
+        // First page of a file and marked as a regular file?
+        if (l->filepage != 0 || l->fid_file != 1)
             continue;
+        if (m_dd_leader < 0 && 0 == filename_to_string(page_leader(page)->filename).compare("DiskDescriptor"))
+            m_dd_leader = page;
         // Previous RDA is 0?
         if (l->prev_rda != 0)
             continue;
-        const int res = make_fileinfo_file(m_root_dir, page);
+        leaders.push_back(page);
+    }
+
+    std::vector<page_t> owner(last, -1);
+    for (size_t i = 0; i < leaders.size(); i++) {
+        const page_t leader = leaders[i];
+        size_t size = 0;
+        size_t npages = 0;
+        owner[leader] = leader;
+        for (page_t page = next[leader]; page != 0; page = next[page]) {
+            if (!my_assert(owner[page] < 0, "%s: page %ld of file at %ld is also in file at %ld\n",
+                __func__, page, leader, owner[page]))
+                break;
+            owner[page] = leader;
+            size += nbytes[page];
+            npages++;
+        }
+        res = make_fileinfo_file(m_root_dir, leader, size, npages);
         if (res < 0) {
-            log(0, "%s: make_fileinfo_file() for page %ld failed\n", __func__, page);
+            log(0, "%s: make_fileinfo_file() for page %ld failed\n", __func__, leader);
             return res;
         }
     }
     return 0;
 }
 
-int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda)
+/**
+ * @brief Make the fileinfo for the file at leader_page_vda and append it to parent
+ * @param parent pointer to the parent directory
+ * @param leader_page_vda leader page of the file
+ * @param size file size, or -1 to count it by following the page chain
+ * @param npages number of data pages, if size is given
+ * @return 0 on success, or -ENOMEM on error
+ */
+int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda, ssize_t size, size_t npages)
 {
     afs_label_t* l = page_label(leader_page_vda);
     afs_leader_t* lp = page_leader(leader_page_vda);
 
     my_assert_or_die(l->filepage == 0, "%s: Page %d is not a leader page!\n", __func__, leader_page_vda);
+    if (l->filepage != 0)
+        return -EIO;
 
     std::string fn = filename_to_string(lp->filename);
     struct stat st;
     memset(&st, 0, sizeof(st));
-    st.st_ino = leader_page_vda;    // Use the leader page as inode
+    st.st_ino = unique_ino(leader_page_vda);    // Use the leader page as inode, if it is unused
     if (l->fid_dir == 0x8000) {
         // A directory (SysDir) is a file which can't be modified
         st.st_mode = S_IFREG | 0400;
@@ -1191,14 +1874,16 @@ int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda)
     if (!info)
         return -ENOMEM;
 
-    // Count the file size and pages
-    size_t npages = 0;
-    size_t size = 0;
-    while (l->next_rda != 0) {
-        const page_t filepage = rda_to_vda(l->next_rda);
-        l = page_label(filepage);
-        size += l->nbytes;
-        npages++;
+    if (size < 0) {
+        // Count the file size and pages
+        npages = 0;
+        size = 0;
+        while (l->next_rda != 0) {
+            const page_t filepage = rda_to_vda(l->next_rda);
+            l = page_label(filepage);
+            size += l->nbytes;
+            npages++;
+        }
     }
     info->setStatSize(size);
     info->setStatBlocks(npages);
@@ -1222,10 +1907,82 @@ int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda)
 
 /**
  * @brief Get a fileinfo entry for the given path
+ *
+ * The lookup takes no locks. It reads the published snapshot of the
+ * root directory, so it sees the state after the last completed
+ * metadata operation. The node stays valid, even if the file is
+ * removed later.
+ *
  * @param path file name with leading path (i.e. "/" prepended)
  * @return pointer to afs_fileinfo_t for the entry, or NULL on error
  */
 afs_fileinfo* AltoFS::find_fileinfo(std::string path) const
+{
+    if (!m_root_dir)
+        return NULL;
+
+    if (path == "/")
+        return m_root_dir;
+
+    if (path[0] == '/')
+        path.erase(0,1);
+
+    afs_epoch_guard guard(&m_epoch);
+    const afs_dirsnap* snap = m_root_dir->snapshot();
+    return snap ? snap->find(path) : NULL;
+}
+
+/**
+ * @brief Get a fileinfo entry for the given inode number
+ *
+ * The inode number of a file is its leader page VDA at mount or creation
+ * time, that of the root directory is 0. Like find_fileinfo(), this reads the published snapshot.
+ *
+ * @param ino inode number
+ * @return pointer to afs_fileinfo_t for the entry, or NULL if not found
+ */
+afs_fileinfo* AltoFS::find_inode(ino_t ino) const
+{
+    if (!m_root_dir)
+        return NULL;
+
+    if (0 == ino)
+        return m_root_dir;
+
+    afs_epoch_guard guard(&m_epoch);
+    const afs_dirsnap* snap = m_root_dir->snapshot();
+    return snap ? snap->find_inode(ino) : NULL;
+}
+
+/**
+ * @brief Hand out an inode number for a file, which was never used since mounting
+ *
+ * Files keep their inode number when they are moved, and the leader page
+ * of a removed file is reused by the next file created. The kernel, or an
+ * NFS client, may still know the old file by its number, so a number past
+ * the highest one handed out is returned then.
+ *
+ * @param ino inode number wanted, i.e. the leader page VDA
+ * @return ino if it was not handed out yet, or a new inode number
+ */
+ino_t AltoFS::unique_ino(ino_t ino)
+{
+    if (m_inos.count(ino))
+        ino = *m_inos.rbegin() + 1;
+    m_inos.insert(ino);
+    return ino;
+}
+
+/**
+ * @brief Get a fileinfo entry for the given path from the current children
+ *
+ * Metadata operations use this while they hold the file system lock
+ * exclusive, so that they see their own changes before they are published.
+ *
+ * @param path file name with leading path (i.e. "/" prepended)
+ * @return pointer to afs_fileinfo_t for the entry, or NULL on error
+ */
+afs_fileinfo* AltoFS::lookup(std::string path) const
 {
     if (!m_root_dir)
         return NULL;
@@ -1239,101 +1996,389 @@ afs_fileinfo* AltoFS::find_fileinfo(std::string path) const
     return m_root_dir->find(path);
 }
 
+/**
+ * @brief Copy the status of a file or directory
+ * @param path file name with leading path (i.e. "/" prepended)
+ * @param st pointer to a struct stat to receive it
+ * @return 0 on success, or -ENOENT if not found
+ */
+int AltoFS::stat_file(std::string path, struct stat* st) const
+{
+    afs_fileinfo* info = find_fileinfo(path);
+    if (!info)
+        return -ENOENT;
+    info->copyStat(st);
+    return 0;
+}
+
+/**
+ * @brief Copy the names and status of the entries of a directory
+ *
+ * The first entry is the directory itself, named ".". Deleted files
+ * are left out. Like find_fileinfo(), this reads the published snapshot
+ * and takes no locks.
+ *
+ * @param path directory name with leading path (i.e. "/" prepended)
+ * @param entries vector to receive the entries
+ * @return 0 on success, -ENOENT if not found, or -ENOTDIR if path is a file
+ */
+int AltoFS::read_dir(std::string path, std::vector<afs_dirent_t>& entries) const
+{
+    afs_fileinfo* info = find_fileinfo(path);
+    if (!info)
+        return -ENOENT;
+    if (info != m_root_dir)
+        return -ENOTDIR;
+
+    afs_epoch_guard guard(&m_epoch);
+    const afs_dirsnap* snap = info->snapshot();
+    if (!snap)
+        return -ENOENT;
+    entries.reserve(entries.size() + snap->size() + 1);
+    afs_dirent_t dot;
+    dot.name = ".";
+    info->copyStat(&dot.st);
+    entries.push_back(dot);
+    for (size_t i = 0; i < snap->size(); i++) {
+        const afs_dirsnap_entry_t& de = snap->entry(i);
+        if (de.deleted)
+            continue;
+        afs_dirent_t ent;
+        ent.name = de.name;
+        de.info->copyStat(&ent.st);
+        entries.push_back(ent);
+    }
+    return 0;
+}
+
 /**
  * @brief Read the page filepage into the buffer at data
  * @param filepage page number
- * @param data buffer of PAGESZ bytes
+ * @param data buffer of size bytes
+ * @param size number of bytes to read
+ * @param offs offset into the page to read from
+ */
+void AltoFS::read_page(page_t filepage, char* data, size_t size, size_t offs)
+{
+    const char *src = (char *)&disk_page(filepage)->data;
+    if (lsb())
+        afs_swab::copy_at(data, src, size, offs);
+    else
+        memcpy(data, src + offs, size);
+}
+
+/**
+ * @brief Write the page filepage to the disk image
+ * @param filepage page number
+ * @param data buffer of size bytes
+ * @param size number of bytes to write
+ * @param offs offset into the page to write to
+ */
+void AltoFS::write_page(page_t filepage, const char* data, size_t size, size_t offs)
+{
+    char *dst = (char *)&disk_page(filepage)->data;
+    if (lsb())
+        afs_swab::copy_to(dst, data, size, offs);
+    else
+        memcpy(dst + offs, data, size);
+    mark_dirty(filepage);
+}
+
+/**
+ * @brief Zero the page filepage in the disk image
+ * @param filepage page number
+ */
+void AltoFS::zero_page(page_t filepage)
+{
+    char *dst = (char *)&disk_page(filepage)->data;
+    memset(dst, 0, PAGESZ);
+    mark_dirty(filepage);
+}
+
+/**
+ * @brief Return the index of the data pages of a file
+ *
+ * Element i is the VDA of file page i+1, i.e. the leader page is not
+ * included. The index is built from the page chain on first use, and
+ * kept up to date by write_file(), truncate_file() and unlink_file().
+ *
+ * @param info pointer to the file info node
+ * @return reference to the vector of page numbers
+ */
+std::vector<page_t>& AltoFS::file_pages(afs_fileinfo* info)
+{
+    std::vector<page_t>& pages = info->pages();
+    if (!pages.empty())
+        return pages;
+
+    const page_t last = m_doubledisk ? NPAGES * 2 : NPAGES;
+    afs_label_t* l = page_label(info->leader_page_vda());
+    while (l->next_rda != 0) {
+        const page_t page = rda_to_vda(l->next_rda);
+        if (!my_assert(page < last && pages.size() < (size_t)last,
+            "%s: bad page chain in file %s at page %ld\n",
+            __func__, info->name().c_str(), page))
+            break;
+        pages.push_back(page);
+        l = page_label(page);
+    }
+    return pages;
+}
+
+/**
+ * @brief Build the index of the data pages of a file for readers
+ *
+ * Readers hold the file's lock shared, so the index is built under
+ * the exclusive lock before they take it, if it is not built yet.
+ *
+ * @param info pointer to the file info node
+ */
+void AltoFS::index_pages(afs_fileinfo* info)
+{
+    {
+        afs_rwlocker lock(info->lock());
+        if (!info->pages().empty())
+            return;
+    }
+    afs_rwlocker lock(info->lock(), true);
+    file_pages(info);
+}
+
+/**
+ * @brief Update the file size, page count and last page hint from the page index
+ *
+ * A file always ends with a page which is not full. If the last page
+ * is full, an empty page is appended, if there is one left.
+ *
+ * @param info pointer to the file info node
+ */
+void AltoFS::update_file(afs_fileinfo* info)
+{
+    std::vector<page_t>& pages = file_pages(info);
+    if (pages.empty())
+        return;
+    afs_label_t* l = page_label(pages.back());
+    if (l->nbytes == PAGESZ) {
+        const page_t page = alloc_page(pages.back());
+        if (0 != page) {
+            pages.push_back(page);
+            l = page_label(page);
+        }
+    }
+
+    // The file is consecutive if its pages follow the leader page
+    const page_t leader = info->leader_page_vda();
+    size_t idx = 0;
+    while (idx < pages.size() && pages[idx] == leader + 1 + (page_t)idx)
+        idx++;
+
+    afs_leader_t* lp = page_leader(leader);
+    lp->consecutive = idx == pages.size() ? 1 : 0;
+    lp->last_page_hint.vda = pages.back();
+    lp->last_page_hint.filepage = pages.size();
+    lp->last_page_hint.char_pos = l->nbytes;
+    mark_dirty(leader);
+
+    info->setStatSize((pages.size() - 1) * PAGESZ + l->nbytes);
+    info->setStatBlocks(pages.size());
+}
+
+/**
+ * @brief Grow a file with zero bytes up to length
+ *
+ * The pages needed are allocated at once, as a run of consecutive
+ * pages if possible. If there are not enough free pages, nothing
+ * is allocated and the file is left unchanged.
+ *
+ * @param info pointer to the file info node
+ * @param length new file size in bytes
+ * @return 0 on success, or -ENOSPC if the disk is full
+ */
+int AltoFS::extend_file(afs_fileinfo* info, size_t length)
+{
+    static const char zeroes[PAGESZ] = {0,};
+    std::vector<page_t>& pages = file_pages(info);
+    if (pages.empty())
+        return -EIO;
+    size_t size = (pages.size() - 1) * PAGESZ + page_label(pages.back())->nbytes;
+    if (size >= length)
+        return 0;
+
+    int res = 0;
+    const size_t npages = (length + PAGESZ - 1) / PAGESZ;
+    if (npages > pages.size()) {
+        // Hold the page mutex, so no one else takes the free pages counted
+        afs_locker lock(&m_page_mutex);
+        if (m_kdh.free_pages < npages - pages.size())
+            return -ENOSPC;
+        res = alloc_pages(pages.back(), npages - pages.size(), pages);
+    }
+
+    size_t idx = size / PAGESZ;
+    while (size < length && idx < pages.size()) {
+        const page_t page = pages[idx];
+        afs_label_t* l = page_label(page);
+        const size_t nbytes = std::min<size_t>(PAGESZ - l->nbytes, length - size);
+        write_page(page, zeroes, nbytes, l->nbytes);
+        l->nbytes += nbytes;
+        size += nbytes;
+        idx++;
+    }
+    return res;
+}
+
+/**
+ * @brief Allocate the pages of an open file up to length
+ *
+ * The pages of an Alto file are full but for the last one, so space
+ * can't be reserved beyond the end of a file. The file is extended
+ * with zero bytes instead, or left unchanged if the disk is too full.
+ *
+ * @param info pointer to the file info node, as returned by find_fileinfo()
+ * @param length new minimum size of the file in bytes
+ * @return 0 on success, -ENOENT if the file was removed, or -ENOSPC if the disk is full
+ */
+int AltoFS::allocate_file(afs_fileinfo* info, off_t length)
+{
+    afs_fslocker lock(&m_lock, true);
+    log(1,"%s: name=%s length=%ld\n", __func__, info->name().c_str(), length);
+    if (m_readonly)
+        return -EROFS;
+    if (info->removed())
+        return -ENOENT;
+    afs_txn txn(this);
+    if ((size_t)length <= info->statSize())
+        return 0;
+
+    const int res = extend_file(info, length);
+    update_file(info);
+    if (res < 0)
+        return res;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    info->setStatMtime(tv.tv_sec);
+    report_attr(info);
+    return 0;
+}
+
+/**
+ * @brief Fill the shadow of page vda, if it is not up to date
+ * @param vda page number
  */
-void AltoFS::read_page(page_t filepage, char* data, size_t size)
+void AltoFS::shadow_page(page_t vda)
 {
-    const char *src = (char *)&m_disk[filepage].data;
-    for (size_t i = 0; i < size; i++)
-        data[i] = src[i ^ lsb()];
+    afs_locker lock(&m_page_mutex);
+    if (m_shadow.valid(vda))
+        return;
+    read_page(vda, m_shadow.page(vda));
+    m_shadow.validate(vda);
 }
 
 /**
- * @brief Write the page filepage to the disk image
- * @param filepage page number
- * @param data buffer of PAGESZ bytes
+ * @brief Return the file descriptor of the shadow memory file
+ * @return file descriptor, or -1 if the shadow is not enabled
  */
-void AltoFS::write_page(page_t filepage, const char* data, size_t size)
+int AltoFS::shadow_fd() const
 {
-    char *dst = (char *)&m_disk[filepage].data;
-    for (size_t i = 0; i < size; i++)
-        dst[i ^ lsb()] = data[i];
+    return m_shadow.fd();
 }
 
 /**
- * @brief Zero the page filepage in the disk image
- * @param filepage page number
+ * @brief Read an open file by returning the ranges of its data in the shadow
+ *
+ * No data is copied, except for filling shadow pages which are not up to
+ * date. The ranges are valid until the pages are modified.
+ *
+ * @param info pointer to the file info node, as returned by find_fileinfo()
+ * @param extents vector to receive the ranges in the shadow memory file
+ * @param size number of bytes to read
+ * @param offs start offset to read from
+ * @return number of bytes actually read, -ENOENT if the file was removed,
+ *         or -ENOTSUP if the shadow is not enabled
  */
-void AltoFS::zero_page(page_t filepage)
+ssize_t AltoFS::read_file_shadow(afs_fileinfo* info, std::vector<afs_extent_t>& extents,
+    size_t size, off_t offset, bool update)
 {
-    char *dst = (char *)&m_disk[filepage].data;
-    memset(dst, 0, PAGESZ);
+    afs_fslocker lock(&m_lock);
+    if (!m_shadow.is_open())
+        return -ENOTSUP;
+    if (info->removed())
+        return -ENOENT;
+
+    index_pages(info);
+    afs_rwlocker flock(info->lock());
+    const std::vector<page_t>& pages = info->pages();
+    size_t idx = offset / PAGESZ;
+    size_t from = offset % PAGESZ;
+    size_t done = 0;
+    while (size > 0 && idx < pages.size()) {
+        const page_t page = pages[idx];
+        const afs_label_t* l = page_label(page);
+        if (from >= l->nbytes)
+            break;
+        const size_t nbytes = std::min<size_t>(l->nbytes - from, size);
+        shadow_page(page);
+        afs_extent_t ext;
+        ext.pos = m_shadow.pos(page) + from;
+        ext.size = nbytes;
+        extents.push_back(ext);
+        done += nbytes;
+        size -= nbytes;
+        if (l->nbytes < PAGESZ)
+            break;
+        from = 0;
+        idx++;
+    }
+
+    if (update) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        info->setStatAtime(tv.tv_sec);
+    }
+
+    return done;
 }
 
 /**
- * @brief Read a file starting ad leader_page_vda into the buffer at data
- * @param leader_page_vda page number of leader VDA
+ * @brief Read an open file into the buffer at data
+ * @param info pointer to the file info node, as returned by find_fileinfo()
  * @param data buffer of size bytes
  * @param size number of bytes to read
  * @param offs start offset to read from
- * @return number of bytes actually read
+ * @return number of bytes actually read, or -ENOENT if the file was removed
  */
-size_t AltoFS::read_file(page_t leader_page_vda, char* data, size_t size, off_t offset, bool update)
+ssize_t AltoFS::read_file(afs_fileinfo* info, char* data, size_t size, off_t offset, bool update)
 {
-    afs_leader_t* lp = page_leader(leader_page_vda);
-    afs_label_t* l = page_label(leader_page_vda);
-    std::string fn = filename_to_string(lp->filename);
-    afs_fileinfo* info = find_fileinfo(fn);
-    my_assert_or_die(info != NULL, "%s: Could not find file info for %s\n", __func__, fn.c_str());
-    if (info == NULL)
-        return -1;
+    afs_fslocker lock(&m_lock);
+    if (info->removed())
+        return -ENOENT;
 
-    page_t page = rda_to_vda(l->next_rda);
+    // All pages but the last one are full, so the offset gives the page
+    index_pages(info);
+    afs_rwlocker flock(info->lock());
+    const std::vector<page_t>& pages = info->pages();
+    size_t idx = offset / PAGESZ;
+    size_t from = offset % PAGESZ;
     size_t done = 0;
-    off_t offs = 0;
-    while (page && size > 0) {
-        l = page_label(page);
-        size_t nbytes = size < l->nbytes ? size : l->nbytes;
-        if (offs >= offset) {
-            // aligned page read
-#if defined(DEBUG)
-            log(3,"%s: offs=0x%06lx page=%-5ld nbytes=0x%03lx\n",
-                __func__, offs, page, nbytes);
-#endif
-            read_page(page, data, nbytes);
-            page = rda_to_vda(l->next_rda);
-            data += nbytes;
-            done += nbytes;
-            size -= nbytes;
-            if (nbytes < PAGESZ) {
-               if (update) {
-               }
-               break;
-            }
-        } else if ((off_t)(offs + PAGESZ) > offset) {
-            // partial page read
-            off_t from = offset - offs;
-            nbytes -= from;
-#if defined(DEBUG)
-            log(3,"%s: offs=0x%06lx page=%-5ld nbytes=0x%03lx from=0x%03lx\n",
-                __func__, offs, page, nbytes, from);
-#endif
-            char buff[PAGESZ];
-            read_page(page, buff, PAGESZ);
-            memcpy(data, buff + from, nbytes);
-            data += nbytes;
-            done += nbytes;
-            size -= nbytes;
-        } else {
+    while (size > 0 && idx < pages.size()) {
+        const page_t page = pages[idx];
+        const afs_label_t* l = page_label(page);
+        if (from >= l->nbytes)
+            break;
+        const size_t nbytes = std::min<size_t>(l->nbytes - from, size);
 #if defined(DEBUG)
-            log(4,"%s: offs=0x%06lx page=%-5ld (seeking to 0x%06lx)\n",
-                __func__, offs, page, offs);
+        log(3,"%s: idx=%lu page=%-5ld nbytes=0x%03lx from=0x%03lx\n",
+            __func__, idx, page, nbytes, from);
 #endif
-        }
-        offs += nbytes;
+        read_page(page, data, nbytes, from);
+        data += nbytes;
+        done += nbytes;
+        size -= nbytes;
+        if (l->nbytes < PAGESZ)
+            break;
+        from = 0;
+        idx++;
     }
 
     if (update) {
@@ -1346,90 +2391,72 @@ size_t AltoFS::read_file(page_t leader_page_vda, char* data, size_t size, off_t
 }
 
 /**
- * @brief Write a file starting ad leader_page_vda from the buffer at data
- * @param leader_page_vda page number of leader VDA
- * @param data buffer of PAGESZ bytes
+ * @brief Write an open file from the buffer at data
+ *
+ * Writing beyond the end of the file fills the gap with zero bytes.
+ *
+ * @param info pointer to the file info node, as returned by find_fileinfo()
+ * @param data buffer of size bytes
  * @param size number of bytes to write
  * @param offs start offset to write to
+ * @return number of bytes actually written, -ENOENT if the file was removed,
+ *         or -ENOSPC if nothing could be written
  */
-size_t AltoFS::write_file(page_t leader_page_vda, const char* data, size_t size, off_t offset, bool update)
+ssize_t AltoFS::write_file(afs_fileinfo* info, const char* data, size_t size, off_t offset, bool update)
 {
-    afs_leader_t* lp = page_leader(leader_page_vda);
-    afs_label_t* l = page_label(leader_page_vda);
-    std::string fn = filename_to_string(lp->filename);
-    afs_fileinfo* info = find_fileinfo(fn);
-    my_assert_or_die(info != NULL, "%s: Could not find file info for %s\n", __func__, fn.c_str());
-    if (info == NULL)
-        return -1;
-
-    off_t offs = 0;
-    page_t page = rda_to_vda(l->next_rda);
-
-    // See if offs is at or beyond last page
-    if (offset >= (lp->last_page_hint.filepage - 1) * PAGESZ) {
-        // In this case use the leader page's last_page_hint
-        page = lp->last_page_hint.vda;
-        offs = (lp->last_page_hint.filepage - 1) * PAGESZ;
-    }
+    afs_fslocker lock(&m_lock);
+    if (info->removed())
+        return -ENOENT;
 
+    afs_rwlocker flock(info->lock(), true);
+    std::vector<page_t>& pages = file_pages(info);
+    int res = extend_file(info, offset);
+    // Allocate the pages for the data at once, so they are consecutive
+    const size_t npages = (offset + size + PAGESZ - 1) / PAGESZ;
+    if (0 == res && npages > pages.size() + 1)
+        alloc_pages(pages.back(), npages - pages.size(), pages);
+    size_t idx = offset / PAGESZ;
+    size_t from = offset % PAGESZ;
     size_t done = 0;
-    while (page && size > 0) {
-        l = page_label(page);
-        size_t nbytes = size < PAGESZ ? size : PAGESZ;
-        if (offs >= offset && l->nbytes == PAGESZ) {
-            // aligned page write
-            l->nbytes = nbytes;
-#if defined(DEBUG)
-            log(3,"%s: offs=0x%06lx page=%-5ld nbytes=0x%03lx size=0x%06lx\n",
-                __func__, offs, page, nbytes, size);
-#endif
-            write_page(page, data, nbytes);
-            data += nbytes;
-            done += nbytes;
-            size -= nbytes;
-        } else if (l->nbytes < PAGESZ) {
-            // partial page write to fill it up to PAGESZ
-            off_t to = l->nbytes;
-            nbytes = size < (size_t)(PAGESZ - to) ? size : (size_t)(PAGESZ - to);
-            char buff[PAGESZ];
-            read_page(page, buff, PAGESZ);  // get the current page
-#if defined(DEBUG)
-            log(3,"%s: offs=0x%06lx page=%-5ld nbytes=0x%03lx size=0x%06lx to=0x%03lx\n",
-                __func__, offs, page, nbytes, size, to);
-#endif
-            memcpy(buff + to, data, nbytes);
-            l->nbytes = to + nbytes;
-            write_page(page, buff, l->nbytes); // write the modified page
-            data += nbytes;
-            done += nbytes;
-            size -= nbytes;
-            if (l->nbytes < PAGESZ)
+    while (0 == res && size > 0) {
+        if (idx == pages.size()) {
+            // Need to allocate a new page
+            const page_t page = alloc_page(pages.back());
+            if (0 == page) {
+                res = -ENOSPC;
                 break;
-        } else {
+            }
+            pages.push_back(page);
+        }
+        const page_t page = pages[idx];
+        afs_label_t* l = page_label(page);
+        const size_t nbytes = std::min<size_t>(PAGESZ - from, size);
 #if defined(DEBUG)
-            log(4,"%s: offs=0x%06lx page=%-5ld (seeking to 0x%06lx)\n",
-                __func__, offs, page, offset);
+        log(3,"%s: idx=%lu page=%-5ld nbytes=0x%03lx from=0x%03lx\n",
+            __func__, idx, page, nbytes, from);
 #endif
-        }
-        offs += PAGESZ;
-        if (size > 0 && l->next_rda == 0) {
-            // Need to allocate a new page
-            page = alloc_page(page);
-        }
-        page = rda_to_vda(l->next_rda);
+        write_page(page, data, nbytes, from);
+        if (from + nbytes > l->nbytes)
+            l->nbytes = from + nbytes;
+        data += nbytes;
+        done += nbytes;
+        size -= nbytes;
+        from = 0;
+        idx++;
     }
-
-    lp->last_page_hint.vda = page;
-    lp->last_page_hint.filepage = l->filepage;
-    lp->last_page_hint.char_pos = l->nbytes;
+    update_file(info);
 
     if (update) {
         struct timeval tv;
         gettimeofday(&tv, NULL);
         info->setStatMtime(tv.tv_sec);
-        info->setStatSize(done);
     }
+    // The kernel already has the data it wrote; only the status changed
+    if (done > 0)
+        report_attr(info);
 
+    if (0 == done && res < 0)
+        return res;
     return done;
 }
 
@@ -1502,7 +2529,7 @@ word AltoFS::getword(afs_fa_t *fa)
         "%s: disk corruption - expected vda %d to be filepage %d\n",
         __func__, fa->vda, l->filepage);
 
-    w = m_disk[fa->vda].data[fa->char_pos >> 1];
+    w = disk_page(fa->vda)->data[fa->char_pos >> 1];
     if (SWAP_GETPUT_WORD)
         w = (w >> 8) | (w << 8);
 
@@ -1530,16 +2557,285 @@ int AltoFS::putword(afs_fa_t* fa, word w)
 
     if (SWAP_GETPUT_WORD)
         w = (w >> 8) | (w << 8);
-    m_disk[fa->vda].data[fa->char_pos >> 1] = w;
+    disk_page(fa->vda)->data[fa->char_pos >> 1] = w;
+    mark_dirty(fa->vda);
 
     fa->char_pos += 2;
     return 0;
 }
 
+/**
+ * @brief Reverse the order of the bits in a word
+ * @param w word
+ * @return word with bit 15 swapped with bit 0, 14 with 1, etc.
+ */
+static inline word reverse_bits(word w)
+{
+    w = ((w & 0x5555) << 1) | ((w >> 1) & 0x5555);
+    w = ((w & 0x3333) << 2) | ((w >> 2) & 0x3333);
+    w = ((w & 0x0f0f) << 4) | ((w >> 4) & 0x0f0f);
+    return (word)((w << 8) | (w >> 8));
+}
+
+/**
+ * @brief Load the bit table from the words of the DiskDescriptor
+ *
+ * On disk the bit table is big endian, so page 0 is in bit 15 of
+ * word 0, page 1 is in bit 14, and page 15 is in bit 0. In memory
+ * page n is in bit n % 64 of the 64 bit word n / 64, so that a free
+ * page can be found with count trailing/leading zeros. The bits past
+ * m_bit_count are set, i.e. never free.
+ *
+ * @param words bit table words
+ */
+void AltoFS::load_bit_table(const std::vector<word>& words)
+{
+    m_bit_table.assign((words.size() + 3) / 4, ~(uint64_t)0);
+    for (size_t i = 0; i < words.size(); i++) {
+        const int shift = 16 * (i % 4);
+        uint64_t& bits = m_bit_table[i / 4];
+        bits &= ~((uint64_t)0xffff << shift);
+        bits |= (uint64_t)reverse_bits(words[i]) << shift;
+    }
+    make_bt_summary();
+}
+
+/**
+ * @brief Return a word of the bit table in the DiskDescriptor format
+ * @param i word index
+ * @return bit table word
+ */
+word AltoFS::bit_table_word(size_t i) const
+{
+    return reverse_bits((word)(m_bit_table[i / 4] >> (16 * (i % 4))));
+}
+
+/**
+ * @brief Rebuild the per cylinder summary of the bit table
+ *
+ * For each cylinder (CYLPAGES consecutive pages) m_cyl_free holds the
+ * number of free pages and m_cyl_map has a bit set, if there is any.
+ * The summary lets searches skip over full cylinders 64 at a time and
+ * over free cylinders when looking for a run of free pages.
+ */
+void AltoFS::make_bt_summary()
+{
+    const page_t ncyls = (m_bit_count + CYLPAGES - 1) / CYLPAGES;
+    m_cyl_free.assign(ncyls, 0);
+    m_cyl_map.assign((ncyls + 63) / 64, 0);
+    for (page_t cyl = 0; cyl < ncyls; cyl++) {
+        const page_t end = std::min<page_t>((cyl + 1) * CYLPAGES, m_bit_count);
+        for (page_t page = cyl * CYLPAGES; page < end; page++)
+            if (0 == ((m_bit_table[page / 64] >> (page % 64)) & 1))
+                m_cyl_free[cyl]++;
+        if (m_cyl_free[cyl])
+            m_cyl_map[cyl / 64] |= (uint64_t)1 << (cyl % 64);
+    }
+}
+
+/**
+ * @brief Count the pages marked as free in the bit table
+ * @return number of free pages
+ */
+page_t AltoFS::count_free_pages() const
+{
+    page_t nfree = 0;
+    for (size_t cyl = 0; cyl < m_cyl_free.size(); cyl++)
+        nfree += m_cyl_free[cyl];
+    return nfree;
+}
+
+/**
+ * @brief Find the first cylinder with free pages at or after cyl
+ * @param cyl cylinder number
+ * @return cylinder number, or -1 if there is none
+ */
+page_t AltoFS::next_free_cyl(page_t cyl) const
+{
+    if (cyl < 0)
+        cyl = 0;
+    if (cyl >= (page_t)m_cyl_free.size())
+        return -1;
+    size_t i = cyl / 64;
+    uint64_t bits = m_cyl_map[i] & (~(uint64_t)0 << (cyl % 64));
+    while (0 == bits) {
+        if (++i >= m_cyl_map.size())
+            return -1;
+        bits = m_cyl_map[i];
+    }
+    return i * 64 + __builtin_ctzll(bits);
+}
+
+/**
+ * @brief Find the last cylinder with free pages at or before cyl
+ * @param cyl cylinder number
+ * @return cylinder number, or -1 if there is none
+ */
+page_t AltoFS::prev_free_cyl(page_t cyl) const
+{
+    if (cyl >= (page_t)m_cyl_free.size())
+        cyl = m_cyl_free.size() - 1;
+    if (cyl < 0)
+        return -1;
+    size_t i = cyl / 64;
+    uint64_t bits = m_cyl_map[i] & (~(uint64_t)0 >> (63 - cyl % 64));
+    while (0 == bits) {
+        if (0 == i--)
+            return -1;
+        bits = m_cyl_map[i];
+    }
+    return i * 64 + 63 - __builtin_clzll(bits);
+}
+
+/**
+ * @brief Find the first page at or after page and before end with its bit equal to used
+ * @param page first page number
+ * @param end page number past the last one to look at
+ * @param used true to look for a page in use, false for a free page
+ * @return page number, or -1 if there is none
+ */
+page_t AltoFS::scan_bt(page_t page, page_t end, bool used) const
+{
+    const uint64_t flip = used ? 0 : ~(uint64_t)0;
+    while (page < end) {
+        const uint64_t bits = (m_bit_table[page / 64] ^ flip) >> (page % 64);
+        if (bits) {
+            page += __builtin_ctzll(bits);
+            return page < end ? page : -1;
+        }
+        page = (page / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+/**
+ * @brief Find the first page marked as free at or after page
+ * @param page page number
+ * @return page number, or -1 if there is none
+ */
+page_t AltoFS::next_free_page(page_t page) const
+{
+    if (page < 0)
+        page = 0;
+    while (page < m_bit_count) {
+        page_t cyl = page / CYLPAGES;
+        if (m_cyl_free[cyl]) {
+            const page_t end = std::min<page_t>((cyl + 1) * CYLPAGES, m_bit_count);
+            const page_t found = scan_bt(page, end, false);
+            if (found >= 0)
+                return found;
+        }
+        cyl = next_free_cyl(cyl + 1);
+        if (cyl < 0)
+            break;
+        page = cyl * CYLPAGES;
+    }
+    return -1;
+}
+
+/**
+ * @brief Find the last page marked as free at or before page
+ * @param page page number
+ * @return page number, or -1 if there is none
+ */
+page_t AltoFS::prev_free_page(page_t page) const
+{
+    if (page >= m_bit_count)
+        page = m_bit_count - 1;
+    while (page >= 0) {
+        page_t cyl = page / CYLPAGES;
+        if (m_cyl_free[cyl]) {
+            // At most CYLPAGES pages, so look at them one by one
+            for (page_t p = page; p >= cyl * CYLPAGES; p--)
+                if (0 == ((m_bit_table[p / 64] >> (p % 64)) & 1))
+                    return p;
+        }
+        cyl = prev_free_cyl(cyl - 1);
+        if (cyl < 0)
+            break;
+        page = std::min<page_t>((cyl + 1) * CYLPAGES, m_bit_count) - 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Find the first page marked as used at or after page
+ * Cylinders with all pages free are skipped.
+ * @param page page number
+ * @return page number, or m_bit_count if there is none
+ */
+page_t AltoFS::next_used_page(page_t page) const
+{
+    if (page < 0)
+        page = 0;
+    while (page < m_bit_count) {
+        const page_t cyl = page / CYLPAGES;
+        const page_t end = std::min<page_t>((cyl + 1) * CYLPAGES, m_bit_count);
+        if (m_cyl_free[cyl] < end - cyl * CYLPAGES) {
+            const page_t found = scan_bt(page, end, true);
+            if (found >= 0)
+                return found;
+        }
+        page = end;
+    }
+    return m_bit_count;
+}
+
+/**
+ * @brief Find the free page nearest to page
+ *
+ * The free pages closest to page in both directions are looked up,
+ * and the one after page wins if both are equally close. Pages 0
+ * and 1 are never returned by looking backwards.
+ *
+ * @param page page number
+ * @return page number, or -1 if there is no free page
+ */
+page_t AltoFS::nearest_free_page(page_t page) const
+{
+    const page_t after = next_free_page(page + 1);
+    const page_t before = page > 2 ? prev_free_page(page - 1) : -1;
+    if (after >= 0 && (before <= 1 || after - page <= page - before))
+        return after;
+    if (before > 1)
+        return before;
+    return -1;
+}
+
+/**
+ * @brief Find a run of count free pages
+ *
+ * The first run starting at or after page is returned, or else the
+ * first one starting before it.
+ *
+ * @param page page number where to start looking
+ * @param count number of consecutive free pages required
+ * @return page number of the first page of the run, or -1 if there is none
+ */
+page_t AltoFS::find_free_run(page_t page, page_t count) const
+{
+    if (count <= 0 || count > m_bit_count)
+        return -1;
+    page_t start = page < 0 || page >= m_bit_count ? 0 : page;
+    for (int pass = 0; pass < 2; pass++) {
+        page_t first = next_free_page(start);
+        while (first >= 0) {
+            const page_t last = next_used_page(first);
+            if (last - first >= count)
+                return first;
+            if (pass > 0 && first >= page)
+                break;
+            first = next_free_page(last);
+        }
+        if (0 == start)
+            break;
+        start = 0;
+    }
+    return -1;
+}
+
 /**
  * @brief Get bit from free page bit table
- * The bit table is big endian, so page 0 is in bit 15,
- * page 1 is in bit 14, and page 15 is in bit 0
  * @param page page number
  * @return bit value 0 or 1
  */
@@ -1549,10 +2845,7 @@ int AltoFS::getBT(page_t page)
         "%s: page out of bounds (%d)\n",
         __func__, page))
         return 1;
-    int offs = page / 16;
-    // int bit = page % 16;
-    int bit = 15 - (page % 16);
-    return (m_bit_table[offs] >> bit) & 1;
+    return (m_bit_table[page / 64] >> (page % 64)) & 1;
 }
 
 /**
@@ -1566,12 +2859,20 @@ void AltoFS::setBT(page_t page, int val)
         "%s: page out of bounds (%d)\n",
         __func__, page))
         return;
-    int offs = page / 16;
-    // int bit = page % 16;
-    int bit = 15 - (page % 16);
-    if (val != ((m_bit_table[offs] >> bit) & 1)) {
-        m_bit_table[offs] = (m_bit_table[offs] & ~(1 << bit)) | ((val & 1) << bit);
+    uint64_t& bits = m_bit_table[page / 64];
+    const uint64_t mask = (uint64_t)1 << (page % 64);
+    if (val != (0 != (bits & mask))) {
+        bits ^= mask;
         m_disk_descriptor_dirty = true;
+        const page_t cyl = page / CYLPAGES;
+        if (val)
+            m_cyl_free[cyl]--;
+        else
+            m_cyl_free[cyl]++;
+        if (m_cyl_free[cyl])
+            m_cyl_map[cyl / 64] |= (uint64_t)1 << (cyl % 64);
+        else
+            m_cyl_map[cyl / 64] &= ~((uint64_t)1 << (cyl % 64));
     }
 }
 
@@ -1588,6 +2889,7 @@ void AltoFS::setBT(page_t page, int val)
  */
 void AltoFS::free_page(page_t page, word id)
 {
+    afs_locker lock(&m_page_mutex);
     afs_label_t* l;
     l = page_label(page);
 
@@ -1597,6 +2899,7 @@ void AltoFS::free_page(page_t page, word id)
     l->fid_file = 0xffff;
     l->fid_dir = 0xffff;
     l->fid_id = 0xffff;
+    mark_dirty(page);
     m_kdh.free_pages += 1;
     m_disk_descriptor_dirty = true;
     // mark as freed
@@ -1631,10 +2934,12 @@ int AltoFS::verify_headers()
     int ok = 1;
 
     const int last = m_doubledisk ? NPAGES * 2 : NPAGES;
-    for (int i = 0; i < last; i += 1)
-        ok &= my_assert(m_disk[i].pagenum == rda_to_vda(m_disk[i].header[1]),
+    for (int i = 0; i < last; i += 1) {
+        const afs_page_t* p = disk_page(i);
+        ok &= my_assert(p->pagenum == rda_to_vda(p->header[1]),
             "%s: page %04x header doesn't match: %04x %04x\n",
-            __func__, m_disk[i].pagenum, m_disk[i].header[0], m_disk[i].header[1]);
+            __func__, p->pagenum, p->header[0], p->header[1]);
+    }
     return ok;
 }
 
@@ -1650,23 +2955,26 @@ int AltoFS::validate_disk_descriptor()
     afs_fa_t fa;
 
     // Locate DiskDescriptor and copy it into the global data structure
-    ddlp = find_file("DiskDescriptor");
+    ddlp = m_dd_leader;
     my_assert_or_die(ddlp != -1, "%s: Can't find DiskDescriptor\n", __func__);
+    if (ddlp == -1)
+        return 0;
 
     lp = page_leader(ddlp);
     (void)lp; // yet unused
     l = page_label(ddlp);
 
     fa.vda = rda_to_vda(l->next_rda);
-    memcpy(&m_kdh, &m_disk[fa.vda].data[0], sizeof(m_kdh));
+    memcpy(&m_kdh, &disk_page(fa.vda)->data[0], sizeof(m_kdh));
     m_bit_count = m_kdh.disk_bt_size * 16;
-    m_bit_table.resize(m_kdh.disk_bt_size);
+    std::vector<word> words(m_kdh.disk_bt_size);
 
     // Now copy the bit table from the disk into bit_table
     fa.filepage = 1;
     fa.char_pos = sizeof(m_kdh);
     for (word i = 0; i < m_kdh.disk_bt_size; i++)
-        m_bit_table[i] = getword(&fa);
+        words[i] = getword(&fa);
+    load_bit_table(words);
     m_disk_descriptor_dirty = false;
     log(0, "%s: The bit table size is %u words (%u bits)\n", __func__, m_kdh.disk_bt_size, m_bit_count);
     ok = 1;
@@ -1684,20 +2992,14 @@ int AltoFS::validate_disk_descriptor()
     ok &= my_assert(m_kdh.def_versions_kept == 0, "%s: defaultVersions != 0\n", __func__);
 
     // Count free pages in bit table
-    nfree = 0;
-    for (int i = 0; i < m_bit_count; i++)
-        nfree += getBT(i) ? 0 : 1;
+    nfree = count_free_pages();
 
     ok &= my_assert(nfree == m_kdh.free_pages,
         "%s: Bit table free page count %d doesn't match KDH value %d\n",
         __func__, nfree, m_kdh.free_pages);
 
-    // Count pages marked as unused in actual image
-    nfree = 0;
-    const page_t last = m_doubledisk ? NPAGES * 2 : NPAGES;
-    for (page_t page = 0; page < last; page++)
-        nfree += is_page_free(page);
-
+    // Pages marked as unused in actual image, as counted by make_fileinfo()
+    nfree = m_nfree_pages;
     ok &= my_assert(nfree == m_kdh.free_pages,
         "%s: Disk image free page count %d doesn't match KDH value %d\n",
         __func__, nfree, m_kdh.free_pages);
@@ -1722,6 +3024,7 @@ void AltoFS::fix_disk_descriptor()
 {
     int nfree = 0;
     int res;
+    bool refresh = false;
 
 #if FIX_FREE_PAGE_BITS
     // First scan the disk image for free pages and fix up the bit table
@@ -1733,9 +3036,8 @@ void AltoFS::fix_disk_descriptor()
     }
 #endif
 
-    res = make_fileinfo();
-    if (0 == res)
-        res = read_sysdir();
+    // The fileinfo was made by the caller
+    res = read_sysdir();
 
     if (0 == res) {
         // Reconstruct bit_table from SysDir files and their pages
@@ -1778,6 +3080,7 @@ void AltoFS::fix_disk_descriptor()
                     log(0, "%s: page:%-4ld filepage:%u nbytes:%u is wrong (should be:%u)\n",
                         __func__, page, filepage, nbytes, l->nbytes);
                     fixed = true;
+                    mark_dirty(page);
                 }
 
                 if (filepage > 0 && left < PAGESZ && nbytes != left) {
@@ -1785,6 +3088,7 @@ void AltoFS::fix_disk_descriptor()
                     log(0, "%s: page:%-4ld filepage:%u last page nbytes:%u is wrong (should be:%u)\n",
                         __func__, page, filepage, nbytes, l->nbytes);
                     fixed = true;
+                    mark_dirty(page);
                 }
 
                 // The following checks are only relevant for pages where nbytes > 0
@@ -1794,24 +3098,28 @@ void AltoFS::fix_disk_descriptor()
                             __func__, page, filepage, l->filepage, filepage);
                         l->filepage = filepage;
                         fixed = true;
+                        mark_dirty(page);
                     }
                     if (l->fid_file != l0->fid_file) {
                         log(0, "%s: page:%-4ld filepage:%u fid_file:0x%04x is wrong (should be 0x%04x)\n",
                             __func__, page, filepage, l->fid_file, l0->fid_file);
                         l->fid_file = l0->fid_file;
                         fixed = true;
+                        mark_dirty(page);
                     }
                     if (l->fid_dir != l0->fid_dir) {
                         log(0, "%s: page:%-4ld filepage:%u fid_dir:0x%04x is wrong (should be 0x%04x)\n",
                             __func__, page, filepage, l->fid_dir, l0->fid_dir);
                         l->fid_dir = l0->fid_dir;
                         fixed = true;
+                        mark_dirty(page);
                     }
                     if (l->fid_id != l0->fid_id) {
                         log(0, "%s: page:%-4ld filepage:%u fid_id:0x%04x is wrong (should be 0x%04x)\n",
                             __func__, page, filepage, l->fid_id, l0->fid_id);
                         l->fid_id = l0->fid_id;
                         fixed = true;
+                        mark_dirty(page);
                     }
                 }
 
@@ -1821,6 +3129,7 @@ void AltoFS::fix_disk_descriptor()
                 filepage++;
             }
             if (fixed) {
+                refresh = true;
                 std::string fn = filename_to_string(lp->filename);
                 log(0, "%s: file '%s', %ld page%s, %ld bytes was fixed\n",
                     __func__, fn.c_str(), pages, pages != 1 ? "s" : "", length);
@@ -1835,9 +3144,7 @@ void AltoFS::fix_disk_descriptor()
     }
 
     // Count free pages in bit table - again
-    nfree = 0;
-    for (int i = 0; i < m_bit_count; i++)
-        nfree += getBT(i) ? 0 : 1;
+    nfree = count_free_pages();
     my_assert (nfree == m_kdh.free_pages,
         "%s: Bit table free page count %d doesn't match KDH value %d\n",
         __func__, nfree, m_kdh.free_pages);
@@ -1846,6 +3153,11 @@ void AltoFS::fix_disk_descriptor()
         m_disk_descriptor_dirty = false;
     }
 
+    // The file sizes were counted from the labels before they were fixed
+    if (refresh) {
+        make_fileinfo();
+        read_sysdir();
+    }
 }
 
 /**
@@ -1874,7 +3186,9 @@ bool AltoFS::my_assert(bool flag, const char *errmsg, ...)
  * @brief An assert() like function which exits
  *
  * As opposed to assert(), this function is in debug and release
- * builds. This version exits if the assertion fails.
+ * builds. This version exits if the assertion fails, unless the
+ * file system was opened with AFS_NOEXIT; then it sets the error
+ * and the caller gives up instead.
  *
  * @param flag if false, print the assert message and exit with returncode 1
  * @param errmsg message format (printf style)
@@ -1888,6 +3202,11 @@ void AltoFS::my_assert_or_die(bool flag, const char *errmsg, ...)
     vfprintf(stdout, errmsg, ap);
     va_end(ap);
     fflush(stdout);
+    if (m_noexit) {
+        if (0 == m_error)
+            m_error = -EIO;
+        return;
+    }
     exit(1);
 }
 
@@ -1906,13 +3225,7 @@ void AltoFS::swabit(char *data, size_t count)
         "%s: Called with unaligned data (%p)\n",
         __func__, (void*)data);
 
-    count /= 2;
-    word* d = (word *) data;
-    while (count--) {
-        word w = *d;
-        w = (w >> 8) | (w << 8);
-        *d++ = w;
-    }
+    afs_swab::inplace(data, count);
 }
 
 /**
@@ -1976,6 +3289,8 @@ void AltoFS::string_to_filename(char* dst, std::string src)
  */
 int AltoFS::statvfs(struct statvfs* vfs)
 {
+    afs_fslocker lock(&m_lock);
+    afs_locker plock(&m_page_mutex);
     memset(vfs, 0, sizeof(*vfs));
     if (NULL == m_root_dir)
         return -EBADF;
@@ -1985,11 +3300,12 @@ int AltoFS::statvfs(struct statvfs* vfs)
     vfs->f_blocks = NPAGES;             // Total number of blocks on the file system, in units of f_frsize.
     if (m_doubledisk)
         vfs->f_blocks *= 2;
-    vfs->f_bfree = m_kdh.free_pages;    // Total number of free blocks.
-    vfs->f_bavail = m_kdh.free_pages;   // Total number of free blocks available to non-privileged processes.
+    const page_t nfree = count_free_pages();
+    vfs->f_bfree = nfree;               // Total number of free blocks.
+    vfs->f_bavail = nfree;              // Total number of free blocks available to non-privileged processes.
     vfs->f_files = m_files.size();      // Total number of file nodes (inodes) on the file system.
     // Per 2 free pages we could create 1 file (leader page and 1st file page)
-    size_t inodes = m_kdh.free_pages / 2;
+    size_t inodes = nfree / 2;
     vfs->f_ffree = inodes;              // Total number of free file nodes (inodes).
     vfs->f_favail = inodes;             // Total number of free file nodes (inodes) available to non-privileged processes.
     // File system ID number. Use the "serialno" stored in the disk header
@@ -1999,3 +3315,226 @@ int AltoFS::statvfs(struct statvfs* vfs)
     vfs->f_namemax = FNLEN-2;
     return 0;
 }
+
+/**
+ * @brief Set the layout for the pages of files allocated from now on
+ * @param layout layout with the sector, head and cylinder skew
+ */
+void AltoFS::set_layout(const afs_layout& layout)
+{
+    afs_fslocker lock(&m_lock, true);
+    m_layout = layout;
+}
+
+/**
+ * @brief Set the function to report changes of files and names to
+ *
+ * Renaming, unlinking, creating, truncating, writing, setting the times
+ * of and defragmenting files are reported, e.g. so that cached names
+ * and attributes can be invalidated.
+ *
+ * @param fn function to call with each change, or NULL to report none
+ * @param arg argument to pass to fn
+ */
+void AltoFS::set_change_callback(afs_change_fn fn, void* arg)
+{
+    afs_fslocker lock(&m_lock, true);
+    m_change_fn = fn;
+    m_change_arg = arg;
+}
+
+/**
+ * @brief Compute the expected time for an emulated Diablo to read a file
+ *
+ * The pages are read in order starting with the leader page, and the
+ * time to access each page after the previous one is added up.
+ *
+ * @param info pointer to the file info node
+ * @param score pointer to a afs_score_t to receive the times
+ * @return 0 on success, or -ENOENT if the file was removed
+ */
+int AltoFS::score_file(afs_fileinfo* info, afs_score_t* score)
+{
+    afs_fslocker lock(&m_lock);
+    memset(score, 0, sizeof(*score));
+    if (info->removed())
+        return -ENOENT;
+
+    index_pages(info);
+    afs_rwlocker flock(info->lock());
+    page_t prev = info->leader_page_vda();
+    score->pages = 1;
+    score->read_ms = DIABLO_SECTOR_MS;
+    const std::vector<page_t>& pages = info->pages();
+    for (size_t i = 0; i < pages.size(); i++) {
+        afs_access_t acc;
+        m_layout.access(prev, pages[i], &acc);
+        score->pages++;
+        score->seeks += acc.seek ? 1 : 0;
+        score->seek_ms += acc.seek_ms;
+        score->rotate_ms += acc.rotate_ms;
+        score->read_ms += acc.read_ms;
+        prev = pages[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Find free pages for a chain of pages as the layout places them
+ *
+ * The first chain starting at or after page is returned, or else the
+ * first one starting before it. Pages 0 and 1 are never used.
+ *
+ * @param page page number where to start looking
+ * @param count number of pages in the chain
+ * @param chain vector to receive the page numbers
+ * @return true if a chain was found
+ */
+bool AltoFS::find_layout_chain(page_t page, size_t count, std::vector<page_t>& chain)
+{
+    chain.clear();
+    if (m_layout.linear()) {
+        page_t first = find_free_run(std::max<page_t>(page, 2), count);
+        if (first >= 0 && first < 2)
+            first = find_free_run(2, count);
+        if (first < 2)
+            return false;
+        for (size_t i = 0; i < count; i++)
+            chain.push_back(first + i);
+        return true;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        page_t first = next_free_page(pass ? 2 : std::max<page_t>(page, 2));
+        while (first >= 0 && (0 == pass || first < page)) {
+            chain.assign(1, first);
+            while (chain.size() < count) {
+                const page_t next = m_layout.next(chain.back());
+                if (next < 2 || next >= m_bit_count || getBT(next))
+                    break;
+                chain.push_back(next);
+            }
+            if (chain.size() == count)
+                return true;
+            first = next_free_page(first + 1);
+        }
+    }
+    chain.clear();
+    return false;
+}
+
+/**
+ * @brief Move the pages of a file to where the layout places them
+ *
+ * The leader and data pages are copied to a chain of free pages (or
+ * pages of the file itself) with new next_rda and prev_rda links, and
+ * the pages no longer used are freed. The SysDir entry, the last page
+ * hint and the file info node are updated to the new pages. The file
+ * keeps its inode number, so that the inode numbers handed out by the
+ * low-level backend stay valid.
+ *
+ * @param info pointer to the file info node
+ * @return 1 if the file was moved, 0 if not
+ */
+int AltoFS::defragment_file(afs_fileinfo* info)
+{
+    std::vector<page_t> from(1, info->leader_page_vda());
+    const std::vector<page_t>& pages = file_pages(info);
+    from.insert(from.end(), pages.begin(), pages.end());
+    const size_t count = from.size();
+
+    size_t i = 1;
+    while (i < count && from[i] == m_layout.next(from[i - 1]))
+        i++;
+    if (i == count)
+        return 0;
+
+    // The pages of the file itself may be reused
+    for (i = 0; i < count; i++)
+        setBT(from[i], 0);
+    std::vector<page_t> to;
+    if (!find_layout_chain(from[0], count, to)) {
+        for (i = 0; i < count; i++)
+            setBT(from[i], 1);
+        return 0;
+    }
+    log(1,"%s: moving %s (%lu pages) from %ld to %ld\n", __func__,
+        info->name().c_str(), count, from[0], to[0]);
+
+    // Copy the labels and data first, as the chains may overlap
+    std::vector<afs_page_t> copy(count);
+    for (i = 0; i < count; i++)
+        memcpy(&copy[i], disk_page(from[i]), sizeof(afs_page_t));
+
+    for (i = 0; i < count; i++) {
+        afs_page_t* p = disk_page(to[i]);
+        memcpy(p->label, copy[i].label, sizeof(p->label));
+        memcpy(p->data, copy[i].data, sizeof(p->data));
+        afs_label_t* l = page_label(to[i]);
+        l->prev_rda = i > 0 ? vda_to_rda(to[i - 1]) : 0;
+        l->next_rda = i + 1 < count ? vda_to_rda(to[i + 1]) : 0;
+        mark_dirty(to[i]);
+        setBT(to[i], 1);
+    }
+
+    std::vector<page_t> used(to);
+    std::sort(used.begin(), used.end());
+    for (i = 0; i < count; i++) {
+        if (std::binary_search(used.begin(), used.end(), from[i]))
+            continue;
+        afs_label_t* l = page_label(from[i]);
+        l->fid_file = 0xffff;
+        l->fid_dir = 0xffff;
+        l->fid_id = 0xffff;
+        mark_dirty(from[i]);
+    }
+
+    for (i = 0; i < m_files.size(); i++) {
+        afs_dv_t* dv = &m_files[i].data;
+        if (4 == dv->typelength[lsb()] && dv->fileptr.leader_vda == from[0]) {
+            dv->fileptr.leader_vda = to[0];
+            m_sysdir_dirty = true;
+        }
+    }
+
+    info->setLeaderPageVda(to[0]);
+    info->pages().assign(to.begin() + 1, to.end());
+    update_file(info);
+    // Drop what was cached from the old pages
+    report_data(info, 0, 0);
+    return 1;
+}
+
+/**
+ * @brief Move the pages of all files to where the layout places them
+ *
+ * SysDir, DiskDescriptor and the file with the boot page 0 are never
+ * moved, as their places are known elsewhere. Files for which there is
+ * no free chain of pages are left as they are.
+ *
+ * @return number of files moved, or -EROFS if the file system is read-only
+ */
+int AltoFS::defragment()
+{
+    afs_fslocker lock(&m_lock, true);
+    log(1,"%s: defragmenting\n", __func__);
+    if (m_readonly)
+        return -EROFS;
+
+    int moved = 0;
+    for (int i = 0; i < m_root_dir->size(); i++) {
+        afs_fileinfo* info = m_root_dir->child(i);
+        if (info->deleted() || info->removed())
+            continue;
+        if (info->name() == "SysDir" || info->name() == "DiskDescriptor")
+            continue;
+        const std::vector<page_t>& pages = file_pages(info);
+        if (info->leader_page_vda() <= 1 ||
+            std::find(pages.begin(), pages.end(), 0) != pages.end())
+            continue;
+        afs_txn txn(this);
+        moved += defragment_file(info);
+    }
+    log(1,"%s: moved %d files\n", __func__, moved);
+    return moved;
+}
@@ -12,19 +12,88 @@
 
 #include "afs_types.h"
 #include "fileinfo.h"
+#include "diskimage.h"
+#include "journal.h"
+#include "fsindex.h"
+#include "shadow.h"
+#include "layout.h"
+#include "swabcopy.h"
+#include "locks.h"
+#include <algorithm>
+#include <set>
+
+/**
+ * @brief Flags for opening the file system
+ */
+enum {
+    AFS_READONLY    = (1 << 0),         //!< Map the disk image(s) private and never write back
+    AFS_JOURNAL     = (1 << 1),         //!< Keep a write-ahead journal of metadata changes
+    AFS_OVERLAY     = (1 << 2),         //!< Write modified pages to an overlay file instead of the image(s)
+    AFS_SHADOW      = (1 << 3),         //!< Keep a host byte order shadow of the pages for read_file_shadow()
+    AFS_NOEXIT      = (1 << 4)          //!< Fail with error() instead of exiting, if the image can't be loaded
+};
+
+/**
+ * @brief Range of bytes in the shadow memory file
+ */
+typedef struct {
+    off_t pos;                          //!< Position in the memory file
+    size_t size;                        //!< Number of bytes
+}   afs_extent_t;
+
+/**
+ * @brief Name and status of a directory entry
+ */
+typedef struct {
+    std::string name;                   //!< File name
+    struct stat st;                     //!< Status
+}   afs_dirent_t;
+
+/**
+ * @brief Kinds of changes reported to the change callback
+ */
+typedef enum {
+    AFS_CHANGE_ATTR,                    //!< The status of a file changed
+    AFS_CHANGE_DATA,                    //!< The data, and thus the status, of a file changed
+    AFS_CHANGE_ENTRY                    //!< A name in the root directory was added, removed, or refers to another file
+}   afs_change_kind_t;
+
+/**
+ * @brief Change of a file or a name in the root directory
+ */
+typedef struct {
+    afs_change_kind_t kind;             //!< What changed
+    ino_t ino;                          //!< Inode number (st_ino) of the file, for ATTR and DATA
+    std::string name;                   //!< File name, for ENTRY
+    off_t offset;                       //!< Start of the changed data, for DATA
+    off_t length;                       //!< Number of bytes changed, or 0 for up to the end, for DATA
+}   afs_change_t;
+
+/**
+ * @brief Function called with each change
+ *
+ * It is called while the file system is locked, so it must neither call
+ * back into the AltoFS nor wait for anything which might need it.
+ */
+typedef void (*afs_change_fn)(void* arg, const afs_change_t& change);
 
 class AltoFS
 {
 public:
 
     AltoFS();
-    AltoFS(const char* filename, int verbosity = 0);
+    AltoFS(const char* filename, int verbosity = 0, int flags = 0);
     ~AltoFS();
 
     int verbosity() const;
     void setVerbosity(int verbosity);
+    bool readonly() const;
+    int error() const;
 
     afs_fileinfo* find_fileinfo(std::string path) const;
+    afs_fileinfo* find_inode(ino_t ino) const;
+    int stat_file(std::string path, struct stat* st) const;
+    int read_dir(std::string path, std::vector<afs_dirent_t>& entries) const;
 
     int unlink_file(std::string path);
     int rename_file(std::string path, std::string newname);
@@ -32,24 +101,84 @@ public:
     int create_file(std::string path);
     int set_times(std::string path, const timespec tv[]);
 
-    size_t read_file(page_t leader_page_vda, char* data, size_t size,
+    ssize_t read_file(afs_fileinfo* info, char* data, size_t size,
         off_t offset = 0, bool update = true);
-    size_t write_file(page_t leader_page_vda, const char* data, size_t size,
+    ssize_t write_file(afs_fileinfo* info, const char* data, size_t size,
         off_t offset = 0, bool update = true);
+    int allocate_file(afs_fileinfo* info, off_t length);
+    ssize_t read_file_shadow(afs_fileinfo* info, std::vector<afs_extent_t>& extents,
+        size_t size, off_t offset = 0, bool update = true);
+    int shadow_fd() const;
 
     int statvfs(struct statvfs* vfs);
 
+    void set_layout(const afs_layout& layout);
+    void set_change_callback(afs_change_fn fn, void* arg);
+    int score_file(afs_fileinfo* info, afs_score_t* score);
+    int defragment();
+
+    int flush(bool sync = true);
+    int commit_overlay();
+    int start_flush_thread(int interval, size_t threshold);
+    void stop_flush_thread();
+
 private:
+    /**
+     * @brief Class to bracket a metadata transaction while in scope
+     */
+    class afs_txn
+    {
+    public:
+        afs_txn(AltoFS* afs) : m_afs(afs) { m_afs->begin_txn(); }
+        ~afs_txn() { m_afs->commit_txn(); }
+    private:
+        AltoFS* m_afs;
+    };
+
+    /**
+     * @brief Arguments for reading a disk image in a thread
+     */
+    typedef struct {
+        AltoFS* afs;                    //!< The file system
+        std::string name;               //!< File name of the disk image
+        afs_diskimage* disk;            //!< The disk image to map it to
+        bool ok;                        //!< Result of read_single_disk()
+    }   afs_read_disk_t;
+
+    void init_locks();
+    afs_fileinfo* lookup(std::string path) const;
+    ino_t unique_ino(ino_t ino);
+    void index_pages(afs_fileinfo* info);
+    static void* flush_thread(void* arg);
+    void flush_loop();
+    size_t dirty_pages() const;
+
     void log(int verbosity, const char* format, ...);
 
+    afs_page_t* disk_page(page_t vda);
+    void mark_dirty(page_t vda);
+
+    int open_journal();
+
+    std::string index_name() const;
+    bool index_keys(std::vector<afs_index_key_t>& keys) const;
+    bool load_index();
+    void save_index();
+    void begin_txn();
+    void commit_txn();
+    void report(const afs_change_t& change);
+    void report_attr(afs_fileinfo* info);
+    void report_data(afs_fileinfo* info, off_t offset, off_t length);
+    void report_entry(const std::string& name);
     afs_leader_t* page_leader(page_t vda);
     afs_label_t* page_label(page_t vda);
 
     int read_disk_file(std::string name);
-    bool read_single_disk(std::string , afs_page_t* diskp);
+    bool read_single_disk(std::string name, afs_diskimage* disk);
+    static void* read_disk_thread(void* arg);
 
     int save_disk_file();
-    bool save_single_disk(std::string name, afs_page_t* diskp);
+    bool save_single_disk(afs_diskimage* disk);
 
     void dump_memory(char* data, size_t nwords);
     void dump_disk_block(page_t page);
@@ -61,6 +190,8 @@ private:
     word vda_to_rda(page_t vda);
 
     page_t alloc_page(page_t page);
+    int alloc_pages(page_t prev, size_t count, std::vector<page_t>& pages);
+    page_t claim_page(page_t prev_vda, page_t page);
     page_t find_file(const char *name);
 
     int read_sysdir();
@@ -70,12 +201,20 @@ private:
     int remove_sysdir_entry(std::string name);
     int rename_sysdir_entry(std::string name, std::string newname);
 
+    int make_root_dir();
     int make_fileinfo();
-    int make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda);
+    int make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda, ssize_t size = -1, size_t npages = 0);
 
-    void read_page(page_t filepage, char* data, size_t size = PAGESZ);
-    void write_page(page_t filepage, const char* data, size_t size = PAGESZ);
+    void read_page(page_t filepage, char* data, size_t size = PAGESZ, size_t offs = 0);
+    void write_page(page_t filepage, const char* data, size_t size = PAGESZ, size_t offs = 0);
     void zero_page(page_t filepage);
+    void shadow_page(page_t vda);
+
+    std::vector<page_t>& file_pages(afs_fileinfo* info);
+    bool find_layout_chain(page_t page, size_t count, std::vector<page_t>& chain);
+    int defragment_file(afs_fileinfo* info);
+    void update_file(afs_fileinfo* info);
+    int extend_file(afs_fileinfo* info, size_t length);
 
     void altotime_to_time(afs_time_t at, time_t* ptime);
     void time_to_altotime(time_t time, afs_time_t* at);
@@ -85,6 +224,18 @@ private:
     word getword(afs_fa_t *fa);
     int putword(afs_fa_t *fa, word w);
 
+    void load_bit_table(const std::vector<word>& words);
+    word bit_table_word(size_t i) const;
+    void make_bt_summary();
+    page_t count_free_pages() const;
+    page_t next_free_cyl(page_t cyl) const;
+    page_t prev_free_cyl(page_t cyl) const;
+    page_t scan_bt(page_t page, page_t end, bool used) const;
+    page_t next_free_page(page_t page) const;
+    page_t prev_free_page(page_t page) const;
+    page_t next_used_page(page_t page) const;
+    page_t nearest_free_page(page_t page) const;
+    page_t find_free_run(page_t page, page_t count) const;
     int getBT(page_t page);
     void setBT(page_t page, int val);
 
@@ -109,17 +260,49 @@ private:
     int msb() const { return m_little.lh[1]; }
     afs_kdh_t m_kdh;                    //!< Storage for disk allocation datastructures: disk descriptor
     page_t m_bit_count;                 //!< Number of bits in bit_table
-    std::vector<word> m_bit_table;      //!< bitmap for pages allocated
+    std::vector<uint64_t> m_bit_table;  //!< bitmap for pages allocated, page n in bit n % 64 of word n / 64
+    std::vector<byte> m_cyl_free;       //!< number of free pages per cylinder
+    std::vector<uint64_t> m_cyl_map;    //!< bitmap for cylinders with free pages
     bool m_disk_descriptor_dirty;       //!< Flag to tell when the bit_table was written to
+    page_t m_dd_leader;                 //!< Leader page of the DiskDescriptor, or -1 if not yet known
+    page_t m_nfree_pages;               //!< Number of free pages counted by make_fileinfo()
     std::vector<char> m_sysdir;         //!< A copy of the on-disk SysDir file
     bool m_sysdir_dirty;                //!< Flag to tell when the sysdir was written to
     std::vector<afs_dv> m_files;        //!< The contents of SysDir as vector of files
-    std::vector<afs_page_t> m_disk;     //!< Storage for the disk image for dp0 and (optionally) dp1
+    afs_diskimage m_disk[2];            //!< Mapped disk images for dp0 and (optionally) dp1
     bool m_doubledisk;                  //!< If doubledisk is true, then both of dp0 and dp1 are loaded
     std::string m_dp0name;              //!< the name of the first disk image
     std::string m_dp1name;              //!< the name of the second disk image, if any
     int m_verbose;                      //!< verbosity value
+    bool m_readonly;                    //!< If readonly is true, the disk images are never written to
+    bool m_use_overlay;                 //!< If true, modified pages are written to overlay files
+    bool m_committed;                   //!< If true, the overlays were committed and the images closed
+    bool m_use_journal;                 //!< If true, metadata changes are journaled before the images are written
+    afs_journal m_journal;              //!< The metadata write-ahead journal
+    afs_shadow m_shadow;                //!< Host byte order shadow of the pages, if enabled
+    afs_layout m_layout;                //!< Layout of the pages of files
+    int m_txn_depth;                    //!< Nesting depth of the open transaction
+    std::set<page_t> m_txn_pages;       //!< Pages modified by the open transaction
+    std::set<page_t> m_journaled;       //!< Pages in the journal since the last checkpoint
+    std::set<page_t> m_rejournal;       //!< Journaled pages modified outside of a transaction
+    afs_change_fn m_change_fn;          //!< Function to report changes to, or NULL
+    void* m_change_arg;                 //!< Argument for m_change_fn
+    std::vector<afs_change_t> m_changes; //!< Changes of the open transaction, reported when it is committed
     afs_fileinfo* m_root_dir;           //!< The root directory file info node
+    std::set<ino_t> m_inos;             //!< Inode numbers handed out since mounting; never reused
+    mutable afs_epoch m_epoch;          //!< Epoch of the lock-free readers of the root directory snapshot
+    mutable afs_rwlock m_lock;          //!< Lock shared for reading and writing files, exclusive for metadata changes
+    mutable pthread_mutex_t m_page_mutex; //!< Recursive mutex for page allocation and dirty tracking
+    pthread_mutex_t m_flush_mutex;      //!< Mutex for the flush thread condition
+    pthread_cond_t m_flush_cond;        //!< Condition to wake up the flush thread
+    pthread_t m_flush_thread;           //!< The background flush thread
+    bool m_flush_running;               //!< True, while the flush thread is running
+    bool m_flush_quit;                  //!< Flag to tell the flush thread to quit
+    std::atomic<bool> m_flush_due;      //!< Set under m_flush_mutex when the dirty page threshold is reached
+    int m_flush_interval;               //!< Seconds between background flushes (0 = never)
+    size_t m_flush_threshold;           //!< Number of dirty pages which trigger a flush (0 = never)
+    bool m_noexit;                      //!< If true, fatal errors while loading set m_error instead of exiting
+    int m_error;                        //!< -errno, if the image(s) could not be loaded
 };
 
 #endif // !defined(_ALTOFS_H_)
@@ -0,0 +1,201 @@
+/*******************************************************************************************
+ *
+ * Read throughput of AltoFS with a growing number of threads
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include <atomic>
+#include "altofs.h"
+
+/**
+ * @brief Shared state of the reader threads
+ */
+typedef struct {
+    AltoFS* afs;                        //!< The file system
+    std::vector<afs_fileinfo*> files;   //!< Files to read
+    size_t chunk;                       //!< Number of bytes per read_file() call
+    std::atomic<bool> quit;             //!< Set when the threads should stop
+}   stress_t;
+
+/**
+ * @brief Result of one reader thread
+ */
+typedef struct {
+    stress_t* stress;                   //!< The shared state
+    size_t first;                       //!< Index of the first file to read
+    uint64_t bytes;                     //!< Number of bytes read
+    int error;                          //!< First error, or 0
+}   reader_t;
+
+/**
+ * @brief Return the time of a monotonic clock in seconds
+ * @return seconds
+ */
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Read all files over and over, until told to quit
+ *
+ * Each thread starts at another file, so the threads don't all read
+ * the same pages at the same time.
+ *
+ * @param arg pointer to the reader_t
+ * @return NULL
+ */
+static void* reader(void* arg)
+{
+    reader_t* r = reinterpret_cast<reader_t *>(arg);
+    stress_t* s = r->stress;
+    std::vector<char> buff(s->chunk);
+    size_t idx = r->first;
+    while (!s->quit.load(std::memory_order_relaxed)) {
+        afs_fileinfo* info = s->files[idx];
+        if (++idx == s->files.size())
+            idx = 0;
+        off_t offset = 0;
+        for (;;) {
+            ssize_t done = s->afs->read_file(info, buff.data(), buff.size(), offset, false);
+            if (done < 0) {
+                r->error = (int)done;
+                return NULL;
+            }
+            if (0 == done)
+                break;
+            r->bytes += done;
+            offset += done;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run nthreads readers for the given time
+ * @param s pointer to the shared state
+ * @param nthreads number of threads
+ * @param seconds time to run
+ * @return number of bytes read per second, or -errno on error
+ */
+static double run(stress_t* s, int nthreads, double seconds)
+{
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<reader_t> readers(nthreads);
+    s->quit = false;
+    const double start = now();
+    for (int i = 0; i < nthreads; i++) {
+        readers[i].stress = s;
+        readers[i].first = (size_t)i * s->files.size() / nthreads;
+        readers[i].bytes = 0;
+        readers[i].error = 0;
+        if (0 != pthread_create(&threads[i], NULL, reader, &readers[i])) {
+            nthreads = i;
+            break;
+        }
+    }
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && EINTR == errno)
+        ;
+    s->quit = true;
+
+    uint64_t bytes = 0;
+    int error = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        bytes += readers[i].bytes;
+        if (0 == error)
+            error = readers[i].error;
+    }
+    if (error < 0)
+        return error;
+    return bytes / (now() - start);
+}
+
+static int usage(const char* program)
+{
+    const char* prog = strrchr(program, '/');
+    prog = prog ? prog + 1 : program;
+    fprintf(stderr, "usage: %s [options] <disk image file(s)>\n", prog);
+    fprintf(stderr, "Where [options] can be one or more of\n");
+    fprintf(stderr, "    -t N       run with 1, 2, 4, ... up to N threads (default 8)\n");
+    fprintf(stderr, "    -s N       run N seconds for each number of threads (default 2)\n");
+    fprintf(stderr, "    -c N       read N bytes per read_file() call (default 4096)\n");
+    fprintf(stderr, "    -o shadow  keep a host byte order shadow of the pages\n");
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    int maxthreads = 8;
+    double seconds = 2.0;
+    size_t chunk = 4096;
+    int flags = AFS_READONLY;
+    const char* filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "-t") && i + 1 < argc) {
+            maxthreads = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-s") && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-c") && i + 1 < argc) {
+            chunk = strtoul(argv[++i], NULL, 0);
+        } else if (0 == strcmp(argv[i], "-o") && i + 1 < argc && 0 == strcmp(argv[i + 1], "shadow")) {
+            flags |= AFS_SHADOW;
+            i++;
+        } else if ('-' == argv[i][0] || filename) {
+            return usage(argv[0]);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (!filename || maxthreads < 1 || seconds <= 0 || chunk < 1)
+        return usage(argv[0]);
+
+    stress_t s;
+    s.afs = new AltoFS(filename, 0, flags | AFS_NOEXIT);
+    if (s.afs->error() < 0) {
+        fprintf(stderr, "%s: can't load %s\n", argv[0], filename);
+        delete s.afs;
+        return 1;
+    }
+    s.chunk = chunk;
+
+    std::vector<afs_dirent_t> entries;
+    s.afs->read_dir("/", entries);
+    for (size_t i = 0; i < entries.size(); i++) {
+        afs_fileinfo* info = s.afs->find_fileinfo(entries[i].name);
+        if (info && entries[i].st.st_size > 0)
+            s.files.push_back(info);
+    }
+    if (s.files.empty()) {
+        fprintf(stderr, "%s: no files to read in %s\n", argv[0], filename);
+        delete s.afs;
+        return 1;
+    }
+
+    printf("%lu files, %lu bytes per read, swab kernel %s\n",
+        s.files.size(), chunk, afs_swab::kernel());
+    printf("threads       MB/s  MB/s/thread  speedup\n");
+    double single = 0;
+    for (int n = 1; n <= maxthreads; n *= 2) {
+        const double rate = run(&s, n, seconds);
+        if (rate < 0) {
+            fprintf(stderr, "%s: read_file() failed (%s)\n", argv[0], strerror((int)-rate));
+            delete s.afs;
+            return 1;
+        }
+        if (1 == n)
+            single = rate;
+        printf("%7d %10.1f %12.1f %8.2f\n", n, rate / 1e6, rate / 1e6 / n,
+            single > 0 ? rate / single : 0.0);
+        fflush(stdout);
+    }
+    delete s.afs;
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*******************************************************************************************
+ *
+ * Decoders for compressed disk images
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include <zlib.h>
+#include "decompress.h"
+
+/**
+ * @brief Size of the input buffer
+ */
+#define DECODER_BUFSIZE 65536
+
+afs_decoder::afs_decoder(int fd) :
+    m_fd(fd),
+    m_buffer(DECODER_BUFSIZE),
+    m_pos(0),
+    m_end(0),
+    m_error(0)
+{
+}
+
+afs_decoder::~afs_decoder()
+{
+}
+
+/**
+ * @brief Decode the stream into a block of memory
+ * @param dst pointer to the memory
+ * @param size maximum number of bytes to decode
+ * @return number of bytes decoded, or -errno on error
+ */
+ssize_t afs_decoder::decode(void* dst, size_t size)
+{
+    if (need(2) < 2)
+        return m_error ? m_error : -EINVAL;
+
+    const byte m0 = m_buffer[m_pos];
+    const byte m1 = m_buffer[m_pos + 1];
+    if (LZW_MAGIC0 == m0 && LZW_MAGIC1 == m1) {
+        m_pos += 2;
+        return unlzw(reinterpret_cast<byte *>(dst), size);
+    }
+    if (GZIP_MAGIC0 == m0 && GZIP_MAGIC1 == m1)
+        return gunzip(reinterpret_cast<byte *>(dst), size);
+    return -EINVAL;
+}
+
+/**
+ * @brief Make count bytes available at m_pos, if possible
+ * @param count number of bytes
+ * @return number of bytes available, which is less than count at the end of file
+ */
+size_t afs_decoder::need(size_t count)
+{
+    while (m_end - m_pos < count) {
+        if (m_pos > 0) {
+            // Move the remaining data to the start of the buffer
+            memmove(m_buffer.data(), &m_buffer[m_pos], m_end - m_pos);
+            m_end -= m_pos;
+            m_pos = 0;
+        }
+        ssize_t bytes = read(m_fd, &m_buffer[m_end], m_buffer.size() - m_end);
+        if (bytes < 0) {
+            if (EINTR == errno)
+                continue;
+            m_error = -errno;
+            break;
+        }
+        if (0 == bytes)
+            break;
+        m_end += bytes;
+    }
+    return m_end - m_pos;
+}
+
+/**
+ * @brief Decode a compress(1) stream
+ *
+ * Codes are stored LSB first in groups of eight codes. When the code
+ * width changes, or the table is cleared, the rest of the current group
+ * is padding and skipped.
+ *
+ * @param dst pointer to the memory
+ * @param size maximum number of bytes to decode
+ * @return number of bytes decoded, or -errno on error
+ */
+ssize_t afs_decoder::unlzw(byte* dst, size_t size)
+{
+    if (need(1) < 1)
+        return m_error ? m_error : -EINVAL;
+    const byte flags = m_buffer[m_pos++];
+    const int maxbits = flags & LZW_BITS_MASK;
+    const bool block_mode = 0 != (flags & LZW_BLOCK_MODE);
+    if (maxbits < LZW_INIT_BITS || maxbits > LZW_MAX_BITS)
+        return -EINVAL;
+
+    const uint32_t maxmaxcode = 1u << maxbits;
+    std::vector<uint16_t> prefix(maxmaxcode);
+    std::vector<byte> suffix(maxmaxcode);
+    std::vector<byte> stack(maxmaxcode);
+    for (uint32_t code = 0; code < 256; code++)
+        suffix[code] = code;
+
+    int n_bits = LZW_INIT_BITS;
+    uint32_t maxcode = (1u << n_bits) - 1;
+    uint32_t free_ent = block_mode ? LZW_CLEAR + 1 : LZW_CLEAR;
+    int32_t oldcode = -1;
+    byte finchar = 0;
+    size_t bitpos = 0;      // bit position relative to m_pos
+    size_t done = 0;
+
+    while (done < size) {
+        bool skip = false;
+        uint32_t code = 0;
+        if (free_ent > maxcode) {
+            skip = true;
+        } else {
+            const size_t bytes = (bitpos + n_bits + 7) / 8;
+            const size_t avail = need(bytes);
+            if (avail < bytes)
+                break;
+            const byte* p = &m_buffer[m_pos + bitpos / 8];
+            uint32_t bits = p[0] | (p[1] << 8);
+            if (bytes - bitpos / 8 > 2)
+                bits |= p[2] << 16;
+            code = (bits >> (bitpos % 8)) & ((1u << n_bits) - 1);
+            bitpos += n_bits;
+            if (bitpos >= (size_t)n_bits * 8) {
+                // A group of eight codes is complete
+                m_pos += n_bits;
+                bitpos -= n_bits * 8;
+            }
+            skip = block_mode && LZW_CLEAR == code;
+        }
+
+        if (skip) {
+            // Skip the padding up to the end of the current group
+            if (bitpos > 0) {
+                if (need(n_bits) < (size_t)n_bits)
+                    break;
+                m_pos += n_bits;
+                bitpos = 0;
+            }
+            if (free_ent > maxcode) {
+                n_bits++;
+                maxcode = n_bits == maxbits ? maxmaxcode : (1u << n_bits) - 1;
+            } else {
+                n_bits = LZW_INIT_BITS;
+                maxcode = (1u << n_bits) - 1;
+                free_ent = LZW_CLEAR + 1;
+                oldcode = -1;
+            }
+            continue;
+        }
+
+        if (oldcode < 0) {
+            if (code > 255)
+                return -EINVAL;
+            finchar = code;
+            oldcode = code;
+            dst[done++] = finchar;
+            continue;
+        }
+
+        const uint32_t incode = code;
+        size_t sp = 0;
+        if (code >= free_ent) {
+            // The KwKwK case: the code is the one about to be defined
+            if (code > free_ent)
+                return -EINVAL;
+            stack[sp++] = finchar;
+            code = oldcode;
+        }
+        while (code > 255) {
+            stack[sp++] = suffix[code];
+            code = prefix[code];
+        }
+        finchar = suffix[code];
+        stack[sp++] = finchar;
+        while (sp > 0 && done < size)
+            dst[done++] = stack[--sp];
+
+        if (free_ent < maxmaxcode) {
+            prefix[free_ent] = oldcode;
+            suffix[free_ent] = finchar;
+            free_ent++;
+        }
+        oldcode = incode;
+    }
+    if (m_error)
+        return m_error;
+    return done;
+}
+
+/**
+ * @brief Decode a gzip(1) stream, which may consist of several members
+ * @param dst pointer to the memory
+ * @param size maximum number of bytes to decode
+ * @return number of bytes decoded, or -errno on error
+ */
+ssize_t afs_decoder::gunzip(byte* dst, size_t size)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 + MAX_WBITS: expect a gzip header and trailer
+    if (Z_OK != inflateInit2(&zs, 16 + MAX_WBITS))
+        return -ENOMEM;
+
+    zs.next_out = dst;
+    zs.avail_out = size;
+    int res = Z_OK;
+    while (zs.avail_out > 0) {
+        if (need(1) < 1)
+            break;
+        zs.next_in = &m_buffer[m_pos];
+        zs.avail_in = m_end - m_pos;
+        res = inflate(&zs, Z_NO_FLUSH);
+        m_pos = m_end - zs.avail_in;
+        if (Z_STREAM_END == res) {
+            // There may be another member following
+            inflateReset(&zs);
+            continue;
+        }
+        if (Z_OK != res)
+            break;
+    }
+    const size_t done = size - zs.avail_out;
+    inflateEnd(&zs);
+    if (m_error)
+        return m_error;
+    if (Z_OK != res && Z_STREAM_END != res && Z_BUF_ERROR != res)
+        return -EIO;
+    return done;
+}
@@ -0,0 +1,56 @@
+/*******************************************************************************************
+ *
+ * Decoders for compressed disk images
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_DECOMPRESS_H_)
+#define _DECOMPRESS_H_
+
+#include <vector>
+
+#include "afs_types.h"
+
+#define LZW_MAGIC0      0x1f            //!< First magic byte of a compress(1) file
+#define LZW_MAGIC1      0x9d            //!< Second magic byte of a compress(1) file
+#define LZW_BITS_MASK   0x1f            //!< Mask for the maximum code width in the flags byte
+#define LZW_BLOCK_MODE  0x80            //!< Flag for block mode (code 256 clears the table)
+#define LZW_INIT_BITS   9               //!< Initial code width
+#define LZW_MAX_BITS    16              //!< Maximum code width
+#define LZW_CLEAR       256             //!< Code to clear the table in block mode
+
+#define GZIP_MAGIC0     0x1f            //!< First magic byte of a gzip(1) file
+#define GZIP_MAGIC1     0x8b            //!< Second magic byte of a gzip(1) file
+
+/**
+ * @brief Class to decode a compress(1) (.Z) or gzip(1) (.gz) stream
+ *
+ * The format is detected from the magic bytes. The input is read from
+ * a file descriptor through a small buffer, and the output is decoded
+ * straight into the caller's memory, e.g. the pages of a disk image.
+ */
+class afs_decoder
+{
+public:
+    afs_decoder(int fd);
+    ~afs_decoder();
+
+    ssize_t decode(void* dst, size_t size);
+
+private:
+    afs_decoder(const afs_decoder&);
+    afs_decoder& operator=(const afs_decoder&);
+
+    size_t need(size_t count);
+    ssize_t unlzw(byte* dst, size_t size);
+    ssize_t gunzip(byte* dst, size_t size);
+
+    int m_fd;                           //!< File descriptor to read from
+    std::vector<byte> m_buffer;         //!< Input buffer
+    size_t m_pos;                       //!< Read position in m_buffer
+    size_t m_end;                       //!< End of the data in m_buffer
+    int m_error;                        //!< -errno of a failed read(), or 0
+};
+
+#endif // !defined(_DECOMPRESS_H_)
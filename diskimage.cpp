@@ -0,0 +1,558 @@
+/*******************************************************************************************
+ *
+ * Alto disk image backing store
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include <sys/mman.h>
+#include "diskimage.h"
+#include "decompress.h"
+
+/**
+ * @brief Return the position of the compressed file extension (.Z or .gz) in name
+ * @param name file name
+ * @return position of the extension, or -1 if there is none
+ */
+static int compressed_ext(const std::string& name)
+{
+    int pos = name.find(".Z");
+    if (pos < 0)
+        pos = name.find(".gz");
+    return pos;
+}
+
+afs_diskimage::afs_diskimage() :
+    m_name(),
+    m_fd(-1),
+    m_pages(0),
+    m_size(0),
+    m_dirty(),
+    m_ndirty(0),
+    m_mode(AFS_MAP_SHARED),
+    m_readonly(false),
+    m_shared(false),
+    m_compressed(false),
+    m_ovl_fd(-1),
+    m_ovl_index(),
+    m_ovl_slots(0)
+{
+}
+
+afs_diskimage::~afs_diskimage()
+{
+    close();
+}
+
+std::string afs_diskimage::name() const
+{
+    return m_name;
+}
+
+bool afs_diskimage::readonly() const
+{
+    return m_readonly;
+}
+
+bool afs_diskimage::shared() const
+{
+    return m_shared;
+}
+
+bool afs_diskimage::compressed() const
+{
+    return m_compressed;
+}
+
+/**
+ * @brief Return a pointer to the page vda of this image
+ * @param vda page number (0 ... NPAGES-1)
+ * @return pointer to afs_page_t, or NULL if the image is not open
+ */
+afs_page_t* afs_diskimage::page(page_t vda) const
+{
+    if (!m_pages)
+        return NULL;
+    return &m_pages[vda];
+}
+
+/**
+ * @brief Mark the page vda as modified
+ * @param vda page number (0 ... NPAGES-1)
+ */
+void afs_diskimage::mark_dirty(page_t vda)
+{
+    if (m_dirty.empty() || m_dirty[vda])
+        return;
+    m_dirty[vda] = true;
+    m_ndirty++;
+}
+
+/**
+ * @brief Return true, if the page vda was modified since the last sync()
+ * @param vda page number (0 ... NPAGES-1)
+ * @return true if dirty
+ */
+bool afs_diskimage::is_dirty(page_t vda) const
+{
+    return !m_dirty.empty() && m_dirty[vda];
+}
+
+/**
+ * @brief Return the number of modified pages
+ * @return number of dirty pages
+ */
+size_t afs_diskimage::dirty() const
+{
+    return m_ndirty;
+}
+
+/**
+ * @brief Return true, if the pages differ from what opening the image again would map
+ * @return true if modified
+ */
+bool afs_diskimage::modified() const
+{
+    // A compressed image, once written back, lives on in its backup file
+    return m_ndirty > 0 || (m_compressed && m_fd >= 0);
+}
+
+/**
+ * @brief Open and map a disk image file
+ * @param name file name of the disk image
+ * @param mode how to map the image
+ * @param readonly if true, modifications are never written back, e.g. to the overlay
+ * @return 0 on success, or -ENOENT, -ENOMEM etc. on error
+ */
+int afs_diskimage::open(std::string name, afs_map_mode_t mode, bool readonly)
+{
+    close();
+    m_name = name;
+    m_mode = mode;
+    m_readonly = readonly || AFS_MAP_READONLY == mode;
+    m_size = NPAGES * sizeof(afs_page_t);
+    m_dirty.assign(NPAGES, false);
+    m_ndirty = 0;
+    // We conclude the disk image is compressed if the name ends with .Z or .gz
+    m_compressed = compressed_ext(name) > 0;
+    int res = m_compressed ? map_compressed() : map_file();
+    if (0 == res && AFS_MAP_OVERLAY == mode) {
+        res = open_overlay();
+        if (res < 0)
+            close();
+    }
+    return res;
+}
+
+/**
+ * @brief Write back the modified pages of the image
+ *
+ * Runs of dirty pages are coalesced into extents. Shared mappings
+ * are synced with msync() per extent, other images are written with
+ * pwrite() per extent and then fdatasync()ed. Nothing is written, if no page is dirty.
+ * The first sync() of a compressed image writes
+ * the entire image, because the file written back to is created then.
+ * In overlay mode the dirty pages are written to the overlay file.
+ *
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::sync()
+{
+    if (!m_pages || m_readonly || 0 == m_ndirty)
+        return 0;
+
+    if (AFS_MAP_OVERLAY == m_mode) {
+        int res = write_overlay();
+        if (res < 0)
+            return res;
+        m_dirty.assign(NPAGES, false);
+        m_ndirty = 0;
+        return 0;
+    }
+
+    if (!m_shared && m_fd < 0) {
+        int res = write_all();
+        if (res < 0)
+            return res;
+        m_dirty.assign(NPAGES, false);
+        m_ndirty = 0;
+        return 0;
+    }
+
+    page_t vda = 0;
+    while (m_ndirty > 0 && vda < NPAGES) {
+        if (!m_dirty[vda]) {
+            vda++;
+            continue;
+        }
+        page_t end = vda;
+        while (end < NPAGES && m_dirty[end])
+            end++;
+        int res = write_extent(vda, end - vda);
+        if (res < 0)
+            return res;
+        m_ndirty -= end - vda;
+        for (; vda < end; vda++)
+            m_dirty[vda] = false;
+    }
+    if (!m_shared && fdatasync(m_fd) < 0)
+        return -errno;
+    return 0;
+}
+
+/**
+ * @brief Merge the overlay into a new image
+ *
+ * All pages, i.e. the image with the overlay applied, are written to
+ * a new file named like the backup_name() of the image, which is then
+ * synced. Finally the overlay file is removed and the image is closed.
+ *
+ * @param outname if not NULL, receives the name of the new image
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::commit(std::string* outname)
+{
+    if (!m_pages || AFS_MAP_OVERLAY != m_mode)
+        return -EINVAL;
+
+    std::string name = backup_name(m_name);
+    int fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -errno;
+    int res = write_data(fd, m_pages, m_size, 0);
+    if (0 == res && fdatasync(fd) < 0)
+        res = -errno;
+    ::close(fd);
+    if (res < 0) {
+        unlink(name.c_str());
+        return res;
+    }
+
+    if (unlink(overlay_name(m_name).c_str()) < 0 && ENOENT != errno)
+        res = -errno;
+    if (outname)
+        *outname = name;
+    close();
+    return res;
+}
+
+/**
+ * @brief Return the name of the file a modified image is saved to
+ * The name is the image name with the .Z or .gz removed and a '~' appended.
+ * @param name file name of the image
+ * @return file name
+ */
+std::string afs_diskimage::backup_name(std::string name)
+{
+    // Remove the .Z or .gz extension, as we will save uncompressed
+    int pos = compressed_ext(name);
+    if (pos > 0)
+        name.erase(pos);
+    return name + "~";
+}
+
+/**
+ * @brief Return the name of the overlay file of an image
+ * @param name file name of the image
+ * @return file name
+ */
+std::string afs_diskimage::overlay_name(std::string name)
+{
+    return name + ".overlay";
+}
+
+/**
+ * @brief Unmap the image and close its file
+ */
+void afs_diskimage::close()
+{
+    if (m_ovl_fd >= 0) {
+        ::close(m_ovl_fd);
+        m_ovl_fd = -1;
+    }
+    m_ovl_index.clear();
+    m_ovl_slots = 0;
+    if (m_pages) {
+        munmap(m_pages, m_size);
+        m_pages = 0;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_dirty.clear();
+    m_ndirty = 0;
+    m_shared = false;
+}
+
+/**
+ * @brief Map an uncompressed disk image file
+ *
+ * Images shorter than NPAGES pages (e.g. written by older versions
+ * of fuse-alto) are extended with zero pages when opened read-write.
+ * Read-only short images are copied into an anonymous mapping instead,
+ * because accessing a mapping beyond the end of file raises SIGBUS.
+ * In overlay mode the image is treated like a read-only image.
+ *
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::map_file()
+{
+    const bool rdonly = m_readonly || AFS_MAP_OVERLAY == m_mode;
+    m_fd = ::open(m_name.c_str(), rdonly ? O_RDONLY : O_RDWR);
+    if (m_fd < 0)
+        return -errno;
+
+    struct stat st;
+    if (fstat(m_fd, &st) < 0) {
+        int res = -errno;
+        close();
+        return res;
+    }
+
+    if ((size_t)st.st_size < m_size) {
+        if (rdonly) {
+            void* pages = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (MAP_FAILED == pages) {
+                int res = -errno;
+                close();
+                return res;
+            }
+            m_pages = reinterpret_cast<afs_page_t *>(pages);
+            ssize_t done = pread(m_fd, m_pages, st.st_size, 0);
+            int res = done == st.st_size ? 0 : -EIO;
+            ::close(m_fd);
+            m_fd = -1;
+            return res;
+        }
+        if (ftruncate(m_fd, m_size) < 0) {
+            int res = -errno;
+            close();
+            return res;
+        }
+    }
+
+    m_shared = AFS_MAP_SHARED == m_mode;
+    void* pages = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+        m_shared ? MAP_SHARED : MAP_PRIVATE, m_fd, 0);
+    if (MAP_FAILED == pages) {
+        int res = -errno;
+        close();
+        return res;
+    }
+    m_pages = reinterpret_cast<afs_page_t *>(pages);
+    return 0;
+}
+
+/**
+ * @brief Decompress a disk image file into an anonymous mapping
+ *
+ * compress(1) and gzip(1) files are decoded in-process, straight into
+ * the mapping.
+ *
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::map_compressed()
+{
+    void* pages = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == pages)
+        return -errno;
+    m_pages = reinterpret_cast<afs_page_t *>(pages);
+
+    int fd = ::open(m_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        int res = -errno;
+        close();
+        return res;
+    }
+    afs_decoder decoder(fd);
+    ssize_t totalbytes = decoder.decode(m_pages, m_size);
+    ::close(fd);
+    if (totalbytes < (ssize_t)m_size) {
+        close();
+        return totalbytes < 0 ? totalbytes : -EIO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open or create the overlay file and apply its pages to the mapping
+ *
+ * An overlay whose header was never written, i.e. is all zero, is empty.
+ * Index entries beyond the header's number of slots were written after
+ * the last complete header, and are ignored.
+ *
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::open_overlay()
+{
+    std::string name = overlay_name(m_name);
+    if (m_readonly) {
+        m_ovl_fd = ::open(name.c_str(), O_RDONLY);
+        // A missing overlay is an empty overlay
+        if (m_ovl_fd < 0 && ENOENT == errno)
+            return 0;
+    } else {
+        m_ovl_fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    }
+    if (m_ovl_fd < 0)
+        return -errno;
+    m_ovl_index.assign(NPAGES, 0);
+    m_ovl_slots = 0;
+
+    afs_overlay_hdr_t hdr;
+    ssize_t done = pread(m_ovl_fd, &hdr, sizeof(hdr), 0);
+    if (done < 0)
+        return -errno;
+    if (0 == done)
+        // A new overlay file; the header is written with the first slot
+        return 0;
+    static const afs_overlay_hdr_t nohdr = afs_overlay_hdr_t();
+    if (0 == memcmp(&hdr, &nohdr, done))
+        // Slots were written, but not yet the header
+        return 0;
+    if (done != sizeof(hdr) || hdr.magic != OVERLAY_MAGIC || hdr.npages != NPAGES)
+        return -EINVAL;
+
+    const size_t isize = NPAGES * sizeof(uint32_t);
+    if (pread(m_ovl_fd, m_ovl_index.data(), isize, sizeof(hdr)) != (ssize_t)isize)
+        return -EIO;
+    m_ovl_slots = hdr.nslots;
+
+    const off_t slots = sizeof(hdr) + isize;
+    for (page_t vda = 0; vda < NPAGES; vda++) {
+        const uint32_t slot = m_ovl_index[vda];
+        if (0 == slot)
+            continue;
+        if (slot > m_ovl_slots) {
+            m_ovl_index[vda] = 0;
+            continue;
+        }
+        off_t offs = slots + (off_t)(slot - 1) * sizeof(afs_page_t);
+        if (pread(m_ovl_fd, &m_pages[vda], sizeof(afs_page_t), offs) != sizeof(afs_page_t))
+            return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write the dirty pages to the overlay file
+ *
+ * Pages already in the overlay are rewritten in their slot, other pages
+ * are appended to new slots. New slots are synced before the index and
+ * header refer to them, then the overlay is synced again.
+ *
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::write_overlay()
+{
+    const size_t isize = NPAGES * sizeof(uint32_t);
+    const off_t slots = sizeof(afs_overlay_hdr_t) + isize;
+    bool grown = false;
+    for (page_t vda = 0; vda < NPAGES; vda++) {
+        if (!m_dirty[vda])
+            continue;
+        if (0 == m_ovl_index[vda]) {
+            m_ovl_index[vda] = ++m_ovl_slots;
+            grown = true;
+        }
+        off_t offs = slots + (off_t)(m_ovl_index[vda] - 1) * sizeof(afs_page_t);
+        int res = write_data(m_ovl_fd, &m_pages[vda], sizeof(afs_page_t), offs);
+        if (res < 0)
+            return res;
+    }
+
+    if (grown) {
+        if (fdatasync(m_ovl_fd) < 0)
+            return -errno;
+        afs_overlay_hdr_t hdr;
+        hdr.magic = OVERLAY_MAGIC;
+        hdr.npages = NPAGES;
+        hdr.nslots = m_ovl_slots;
+        hdr.reserved = 0;
+        int res = write_data(m_ovl_fd, m_ovl_index.data(), isize, sizeof(hdr));
+        if (0 == res)
+            res = write_data(m_ovl_fd, &hdr, sizeof(hdr), 0);
+        if (res < 0)
+            return res;
+    }
+    if (fdatasync(m_ovl_fd) < 0)
+        return -errno;
+    return 0;
+}
+
+/**
+ * @brief Create the file written back to and write the entire mapping
+ *
+ * The file name is the backup_name() of the image.
+ * The file stays open for the following incremental writes.
+ *
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::write_all()
+{
+    std::string name = backup_name(m_name);
+
+    m_fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0)
+        return -errno;
+
+    int res = write_extent(0, NPAGES);
+    if (0 == res && fdatasync(m_fd) < 0)
+        res = -errno;
+    if (res < 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    return res;
+}
+
+/**
+ * @brief Write an extent of pages back to the file
+ * @param vda first page number
+ * @param count number of pages
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::write_extent(page_t vda, page_t count)
+{
+    if (m_shared) {
+        // msync() wants an address aligned to the system page size
+        const size_t pagesize = sysconf(_SC_PAGESIZE);
+        size_t start = vda * sizeof(afs_page_t);
+        size_t end = (vda + count) * sizeof(afs_page_t);
+        start -= start % pagesize;
+        if (msync(reinterpret_cast<char *>(m_pages) + start, end - start, MS_SYNC) < 0)
+            return -errno;
+        return 0;
+    }
+
+    return write_data(m_fd, &m_pages[vda], count * sizeof(afs_page_t), vda * sizeof(afs_page_t));
+}
+
+/**
+ * @brief Write a block of data to a file, retrying short writes
+ * @param fd file descriptor
+ * @param data pointer to the data
+ * @param total number of bytes
+ * @param offs file offset
+ * @return 0 on success, or -errno on error
+ */
+int afs_diskimage::write_data(int fd, const void* data, size_t total, off_t offs)
+{
+    const char *dp = reinterpret_cast<const char *>(data);
+    size_t totalbytes = 0;
+    while (totalbytes < total) {
+        ssize_t bytes = pwrite(fd, dp, total - totalbytes, offs);
+        if (bytes < 0) {
+            if (EINTR == errno)
+                continue;
+            return -errno;
+        }
+        dp += bytes;
+        offs += bytes;
+        totalbytes += bytes;
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*******************************************************************************************
+ *
+ * Alto disk image backing store
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_DISKIMAGE_H_)
+#define _DISKIMAGE_H_
+
+#include <string>
+#include <vector>
+
+#include "afs_types.h"
+
+/**
+ * @brief How a disk image is mapped and written back
+ */
+typedef enum {
+    AFS_MAP_SHARED,                         //!< MAP_SHARED; modifications go straight to the file
+    AFS_MAP_PRIVATE,                        //!< MAP_PRIVATE; dirty pages are written back with pwrite()
+    AFS_MAP_READONLY,                       //!< MAP_PRIVATE; modifications are never written back
+    AFS_MAP_OVERLAY                         //!< MAP_PRIVATE; dirty pages are written to the overlay file
+}   afs_map_mode_t;
+
+#define OVERLAY_MAGIC   0x4c564f41          //!< "AOVL" in the overlay file header
+
+/**
+ * @brief Header of an overlay file.
+ * It is followed by the index of NPAGES slot numbers (uint32_t),
+ * where 0 means the page is not in the overlay and n means it is
+ * stored in slot n-1, and then by the slots (afs_page_t) themselves.
+ */
+typedef struct {
+    uint32_t    magic;                      //!< OVERLAY_MAGIC
+    uint32_t    npages;                     //!< Number of pages in the image (NPAGES)
+    uint32_t    nslots;                     //!< Number of slots used
+    uint32_t    reserved;                   //!< Reserved; 0
+}   afs_overlay_hdr_t;
+
+/**
+ * @brief Class to keep one memory mapped disk image of NPAGES pages
+ *
+ * Uncompressed images are mapped MAP_SHARED when opened read-write,
+ * so that modifications go straight to the file, and MAP_PRIVATE
+ * when opened read-only, or when the pages must not reach the file
+ * before they are written back explicitly (e.g. for journaling).
+ * Compressed images can't be mapped and are decompressed into an
+ * anonymous mapping instead.
+ *
+ * In overlay mode the image file is never written to. Modified pages
+ * are stored in a compact indexed delta file "<image>.overlay" instead,
+ * and are applied on top of the image when it is opened again.
+ * commit() merges the overlay into a new image.
+ *
+ * Modified pages are tracked per page, so that sync() only writes back
+ * the runs of dirty pages, coalesced into contiguous extents.
+ */
+class afs_diskimage
+{
+public:
+    afs_diskimage();
+    ~afs_diskimage();
+
+    std::string name() const;
+    bool readonly() const;
+    bool shared() const;
+    bool compressed() const;
+    afs_page_t* page(page_t vda) const;
+
+    void mark_dirty(page_t vda);
+    bool is_dirty(page_t vda) const;
+    size_t dirty() const;
+    bool modified() const;
+
+    int open(std::string name, afs_map_mode_t mode = AFS_MAP_SHARED, bool readonly = false);
+    int sync();
+    int commit(std::string* outname = NULL);
+    void close();
+
+    static std::string backup_name(std::string name);
+    static std::string overlay_name(std::string name);
+
+private:
+    afs_diskimage(const afs_diskimage&);
+    afs_diskimage& operator=(const afs_diskimage&);
+
+    int map_file();
+    int map_compressed();
+    int open_overlay();
+    int write_overlay();
+    int write_all();
+    int write_extent(page_t vda, page_t count);
+    static int write_data(int fd, const void* data, size_t total, off_t offs);
+
+    std::string m_name;                     //!< File name of the disk image
+    int m_fd;                               //!< File descriptor of the image, or of the file written back to, or -1
+    afs_page_t* m_pages;                    //!< The mapped pages
+    size_t m_size;                          //!< Size of the mapping in bytes
+    std::vector<bool> m_dirty;              //!< Dirty flag per page
+    size_t m_ndirty;                        //!< Number of dirty pages
+    afs_map_mode_t m_mode;                  //!< How the image is mapped
+    bool m_readonly;                        //!< True, if the image is never written back
+    bool m_shared;                          //!< True, if the mapping is MAP_SHARED with the file
+    bool m_compressed;                      //!< True, if the image file is compressed
+    int m_ovl_fd;                           //!< File descriptor of the overlay file, or -1
+    std::vector<uint32_t> m_ovl_index;      //!< Overlay slot number + 1 per page, or 0
+    uint32_t m_ovl_slots;                   //!< Number of slots used in the overlay file
+};
+
+#endif // !defined(_DISKIMAGE_H_)
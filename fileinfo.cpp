@@ -3,21 +3,41 @@
 afs_fileinfo::afs_fileinfo() :
     m_parent(0),
     m_name(),
-    m_st(),
+    m_st(new struct stat()),
+    m_st_mutex(),
+    m_lock(),
     m_leader_page_vda(0),
     m_deleted(true),
-    m_children()
+    m_removed(false),
+    m_pages(),
+    m_children(),
+    m_index(),
+    m_snap(0),
+    m_changed(false),
+    m_epoch(0)
 {
+    pthread_mutex_init(&m_st_mutex, NULL);
+    pthread_rwlock_init(&m_lock, NULL);
 }
 
 afs_fileinfo::afs_fileinfo(afs_fileinfo* parent, std::string name, struct stat st, int vda, bool deleted) :
     m_parent(parent),
     m_name(name),
-    m_st(st),
+    m_st(new struct stat(st)),
+    m_st_mutex(),
+    m_lock(),
     m_leader_page_vda(vda),
     m_deleted(deleted),
-    m_children()
+    m_removed(false),
+    m_pages(),
+    m_children(),
+    m_index(),
+    m_snap(0),
+    m_changed(false),
+    m_epoch(0)
 {
+    pthread_mutex_init(&m_st_mutex, NULL);
+    pthread_rwlock_init(&m_lock, NULL);
 }
 
 afs_fileinfo::~afs_fileinfo()
@@ -28,6 +48,12 @@ afs_fileinfo::~afs_fileinfo()
         m_children.erase(it);
         delete child;
     }
+    afs_dirsnap* snap = m_snap.load();
+    if (snap)
+        snap->unref();
+    delete m_st.load();
+    pthread_rwlock_destroy(&m_lock);
+    pthread_mutex_destroy(&m_st_mutex);
 }
 
 afs_fileinfo* afs_fileinfo::parent() const
@@ -37,17 +63,31 @@ afs_fileinfo* afs_fileinfo::parent() const
 
 std::string afs_fileinfo::name() const
 {
+    afs_locker lock(&m_st_mutex);
     return m_name;
 }
 
-struct stat* afs_fileinfo::st()
+/**
+ * @brief Copy the published status of the file
+ * @param st pointer to a struct stat to receive it
+ */
+void afs_fileinfo::copyStat(struct stat* st) const
 {
-    return &m_st;
+    afs_epoch_guard guard(epoch());
+    *st = *m_st.load();
 }
 
-const struct stat* afs_fileinfo::st() const
+/**
+ * @brief Return the lock for the page index and data pages of the file
+ *
+ * Readers of the data lock it shared, writers exclusive. Changes of
+ * the directory are guarded by the file system lock instead.
+ *
+ * @return pointer to the pthread rwlock
+ */
+pthread_rwlock_t* afs_fileinfo::lock()
 {
-    return &m_st;
+    return &m_lock;
 }
 
 page_t afs_fileinfo::leader_page_vda() const
@@ -55,6 +95,13 @@ page_t afs_fileinfo::leader_page_vda() const
     return m_leader_page_vda;
 }
 
+void afs_fileinfo::setLeaderPageVda(page_t vda)
+{
+    m_leader_page_vda = vda;
+    if (m_parent)
+        m_parent->m_changed = true;
+}
+
 bool afs_fileinfo::deleted() const
 {
     return m_deleted;
@@ -63,6 +110,18 @@ bool afs_fileinfo::deleted() const
 void afs_fileinfo::setDeleted(bool on)
 {
     m_deleted = on;
+    if (m_parent)
+        m_parent->m_changed = true;
+}
+
+bool afs_fileinfo::removed() const
+{
+    return m_removed;
+}
+
+void afs_fileinfo::setRemoved(bool on)
+{
+    m_removed = on;
 }
 
 int afs_fileinfo::size() const
@@ -70,6 +129,11 @@ int afs_fileinfo::size() const
     return m_children.size();
 }
 
+std::vector<page_t>& afs_fileinfo::pages()
+{
+    return m_pages;
+}
+
 std::vector<afs_fileinfo*> afs_fileinfo::children() const
 {
     return m_children;
@@ -85,128 +149,257 @@ const afs_fileinfo* afs_fileinfo::child(int idx) const
     return m_children.at(idx);
 }
 
+/**
+ * @brief Find a child node by name
+ * If more than one child has the name, the first one is returned.
+ * @param name file name
+ * @return pointer to the child node, or NULL if not found
+ */
 afs_fileinfo* afs_fileinfo::find(std::string name)
 {
-    std::vector<afs_fileinfo*>::iterator it;
-    for (it = m_children.begin(); it != m_children.end(); it++) {
-        afs_fileinfo* node = *it.base();
-        if (!node)
-            continue;
-        if (name == node->name())
-            return node;
-    }
-    return NULL;
+    std::unordered_map<std::string, afs_fileinfo*>::const_iterator it = m_index.find(name);
+    if (it == m_index.end())
+        return NULL;
+    return it->second;
+}
 
+/**
+ * @brief Return the published snapshot of the children
+ *
+ * The caller must be inside a section of the epoch passed to publish(),
+ * or hold the file system lock, while it uses the snapshot.
+ *
+ * @return pointer to the snapshot, or NULL if none was published
+ */
+afs_dirsnap* afs_fileinfo::snapshot() const
+{
+    return m_snap.load();
+}
+
+/**
+ * @brief Publish a new snapshot of the children, if they changed
+ *
+ * The previous snapshot is retired to the epoch, which releases it once
+ * the readers which may still use it are done.
+ *
+ * @param epoch pointer to the epoch of the readers
+ */
+void afs_fileinfo::publish(afs_epoch* epoch)
+{
+    m_epoch = epoch;
+    if (!m_changed && m_snap.load())
+        return;
+    afs_dirsnap* old = m_snap.exchange(new afs_dirsnap(m_children));
+    m_changed = false;
+    if (old)
+        epoch->retire(old);
 }
 
 ino_t afs_fileinfo::statIno() const
 {
-    return m_st.st_ino;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_ino;
 }
 
 time_t afs_fileinfo::statCtime() const
 {
-    return m_st.st_ctime;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_ctime;
 }
 
 time_t afs_fileinfo::statMtime() const
 {
-    return m_st.st_mtime;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_mtime;
 }
 
 time_t afs_fileinfo::statAtime() const
 {
-    return m_st.st_atime;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_atime;
 }
 
 uid_t afs_fileinfo::statUid() const
 {
-    return m_st.st_uid;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_uid;
 }
 
 gid_t afs_fileinfo::statGid() const
 {
-    return m_st.st_gid;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_gid;
 }
 
 mode_t afs_fileinfo::statMode() const
 {
-    return m_st.st_mode;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_mode;
 }
 
 size_t afs_fileinfo::statSize() const
 {
-    return m_st.st_size;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_size;
 }
 
 size_t afs_fileinfo::statBlockSize() const
 {
-    return m_st.st_blksize;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_blksize;
 }
 
 size_t afs_fileinfo::statBlocks() const
 {
-    return m_st.st_blocks;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_blocks;
 }
 
 size_t afs_fileinfo::statNLink() const
 {
-    return m_st.st_nlink;
+    afs_epoch_guard guard(epoch());
+    return m_st.load()->st_nlink;
 }
 
 void afs_fileinfo::setIno(ino_t ino)
 {
-    m_st.st_ino = ino;
+    {
+        afs_locker lock(&m_st_mutex);
+        struct stat st = *m_st.load();
+        st.st_ino = ino;
+        setStat(st);
+    }
+    // The inode number is indexed in the snapshot
+    if (m_parent)
+        m_parent->m_changed = true;
 }
 
 void afs_fileinfo::setStatCtime(time_t t)
 {
-    m_st.st_ctime = t;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_ctime == t)
+        return;
+    st.st_ctime = t;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatMtime(time_t t)
 {
-    m_st.st_mtime = t;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_mtime == t)
+        return;
+    st.st_mtime = t;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatAtime(time_t t)
 {
-    m_st.st_atime = t;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_atime == t)
+        return;
+    st.st_atime = t;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatUid(uid_t uid)
 {
-    m_st.st_uid = uid;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_uid == uid)
+        return;
+    st.st_uid = uid;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatGid(gid_t gid)
 {
-    m_st.st_gid = gid;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_gid == gid)
+        return;
+    st.st_gid = gid;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatMode(mode_t mode)
 {
-    m_st.st_mode = mode;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_mode == mode)
+        return;
+    st.st_mode = mode;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatSize(size_t size)
 {
-    m_st.st_size = size;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_size == (off_t)size)
+        return;
+    st.st_size = size;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatBlockSize(size_t blocksize)
 {
-    m_st.st_blksize = blocksize;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_blksize == (blksize_t)blocksize)
+        return;
+    st.st_blksize = blocksize;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatBlocks(size_t blocks)
 {
-    m_st.st_blocks = blocks;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_blocks == (blkcnt_t)blocks)
+        return;
+    st.st_blocks = blocks;
+    setStat(st);
 }
 
 void afs_fileinfo::setStatNLink(size_t count)
 {
-    m_st.st_nlink = count;
+    afs_locker lock(&m_st_mutex);
+    struct stat st = *m_st.load();
+    if (st.st_nlink == (nlink_t)count)
+        return;
+    st.st_nlink = count;
+    setStat(st);
+}
+
+/**
+ * @brief Return the epoch of the readers of the file system
+ * @return pointer to the epoch, or NULL if the root directory was not yet published
+ */
+afs_epoch* afs_fileinfo::epoch() const
+{
+    return m_parent ? m_parent->epoch() : m_epoch;
+}
+
+/**
+ * @brief Publish a new status of the file
+ *
+ * The caller holds m_st_mutex, so the published status can't be
+ * replaced while the setters copy it. The previous one is retired to
+ * the epoch, as readers may still be copying it.
+ *
+ * @param st the new status
+ */
+void afs_fileinfo::setStat(const struct stat& st)
+{
+    const struct stat* old = m_st.exchange(new struct stat(st));
+    afs_epoch* e = epoch();
+    if (e)
+        e->retire(old);
+    else
+        delete old;
 }
 
 void afs_fileinfo::erase(int pos, int count)
@@ -218,26 +411,41 @@ void afs_fileinfo::erase(int pos, int count)
             continue;
         if (idx >= pos + count)
             break;
+        unindex(*it);
         m_children.erase(it);
-        m_st.st_nlink -= 1;
+        m_changed = true;
+        setStatNLink(statNLink() - 1);
         idx++;
     }
 }
 
 void afs_fileinfo::erase(std::vector<afs_fileinfo*>::iterator pos)
 {
+    unindex(*pos);
     m_children.erase(pos);
+    m_changed = true;
 }
 
 void afs_fileinfo::rename(std::string newname)
 {
-    m_name = newname;
+    if (m_parent)
+        m_parent->unindex(this);
+    {
+        afs_locker lock(&m_st_mutex);
+        m_name = newname;
+    }
+    if (m_parent) {
+        m_parent->index(this);
+        m_parent->m_changed = true;
+    }
 }
 
 void afs_fileinfo::append(afs_fileinfo* info)
 {
     m_children.push_back(info);
-    m_st.st_nlink += 1;
+    index(info);
+    m_changed = true;
+    setStatNLink(statNLink() + 1);
 }
 
 bool afs_fileinfo::remove(afs_fileinfo* child)
@@ -247,10 +455,55 @@ bool afs_fileinfo::remove(afs_fileinfo* child)
     for (it = m_children.begin(); it != m_children.end(); it++) {
         afs_fileinfo* node = m_children.at(idx);
         if (child->name() == node->name()) {
+            unindex(node);
             m_children.erase(it);
+            m_changed = true;
             return true;
         }
         idx++;
     }
     return false;
 }
+
+/**
+ * @brief Add a child node to the name index
+ * If another child has the same name, the first of them stays in the index.
+ * @param child pointer to the child node
+ */
+void afs_fileinfo::index(afs_fileinfo* child)
+{
+    std::unordered_map<std::string, afs_fileinfo*>::iterator it = m_index.find(child->name());
+    if (it == m_index.end()) {
+        m_index[child->name()] = child;
+        return;
+    }
+    std::vector<afs_fileinfo*>::const_iterator ci;
+    for (ci = m_children.begin(); ci != m_children.end(); ci++) {
+        if (*ci == it->second)
+            return;
+        if (*ci == child) {
+            it->second = child;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Remove a child node from the name index
+ * If another child has the same name, the first of them takes its place.
+ * @param child pointer to the child node
+ */
+void afs_fileinfo::unindex(afs_fileinfo* child)
+{
+    std::unordered_map<std::string, afs_fileinfo*>::iterator it = m_index.find(child->name());
+    if (it == m_index.end() || it->second != child)
+        return;
+    m_index.erase(it);
+    std::vector<afs_fileinfo*>::const_iterator ci;
+    for (ci = m_children.begin(); ci != m_children.end(); ci++) {
+        if (*ci != child && (*ci)->name() == child->name()) {
+            m_index[child->name()] = *ci;
+            break;
+        }
+    }
+}
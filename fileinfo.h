@@ -4,12 +4,27 @@
 #include <sys/stat.h>
 #include <cstddef>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "afs_types.h"
+#include "locks.h"
+#include "snapshot.h"
 
 /**
  * @brief Class to keep information about a file or directory
+ *
+ * The status is published as an immutable struct stat, which readers
+ * copy without locking while inside a section of the epoch. Setters
+ * replace it with an updated copy under a mutex, which also guards the
+ * name, and only if the value changed, so that reading a file doesn't
+ * publish a new status for every access.
+ * lock() guards the page index and the data pages of the file.
+ *
+ * A directory publishes an immutable snapshot of its children, which
+ * lookups and listings read without locking. Changes of the children
+ * are made in m_children under the file system's exclusive lock and
+ * become visible to them with publish().
  */
 class afs_fileinfo
 {
@@ -20,17 +35,23 @@ public:
 
     afs_fileinfo* parent() const;
     std::string name() const;
-    struct stat* st();
-    const struct stat* st() const;
+    void copyStat(struct stat* st) const;
+    pthread_rwlock_t* lock();
     page_t leader_page_vda() const;
+    void setLeaderPageVda(page_t vda);
     bool deleted() const;
     void setDeleted(bool on);
+    bool removed() const;
+    void setRemoved(bool on);
     int size() const;
+    std::vector<page_t>& pages();
     std::vector<afs_fileinfo*> children() const;
     afs_fileinfo* child(int idx);
     const afs_fileinfo* child(int idx) const;
 
     afs_fileinfo* find(std::string name);
+    afs_dirsnap* snapshot() const;
+    void publish(afs_epoch* epoch);
 
     ino_t statIno() const;
     time_t statCtime() const;
@@ -63,12 +84,27 @@ public:
     bool remove(afs_fileinfo* child);
 
 private:
+    afs_fileinfo(const afs_fileinfo&);
+    afs_fileinfo& operator=(const afs_fileinfo&);
+    void index(afs_fileinfo* child);
+    void unindex(afs_fileinfo* child);
+    afs_epoch* epoch() const;
+    void setStat(const struct stat& st);
+
     afs_fileinfo* m_parent;                 //!< Parent directory
     std::string m_name;                     //!< Filename
-    struct stat m_st;                       //!< Status
+    std::atomic<const struct stat*> m_st;   //!< Published status
+    mutable pthread_mutex_t m_st_mutex;     //!< Mutex for replacing m_st, and protecting m_name
+    pthread_rwlock_t m_lock;                //!< Lock for the page index and data pages
     page_t m_leader_page_vda;               //!< Leader page of this file
     bool m_deleted;                         //!< True, if the file is marked as deleted
+    bool m_removed;                         //!< True, if the file was unlinked and its pages freed
+    std::vector<page_t> m_pages;            //!< Index of the data pages; empty until built
     std::vector<afs_fileinfo*> m_children;  //!< Vector of child nodes
+    std::unordered_map<std::string, afs_fileinfo*> m_index; //!< First child node of each name
+    std::atomic<afs_dirsnap*> m_snap;       //!< Published snapshot of the children, or NULL
+    bool m_changed;                         //!< True, if the children changed since the snapshot
+    afs_epoch* m_epoch;                     //!< Epoch of the readers, set on the root directory by publish()
 };
 
 #endif // !defined(_FILEINFO_H_)
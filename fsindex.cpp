@@ -0,0 +1,189 @@
+/*******************************************************************************************
+ *
+ * Alto file system startup index
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include "fsindex.h"
+
+afs_index::afs_index() :
+    m_kdh(),
+    m_bit_table(),
+    m_sysdir(),
+    m_dirents(),
+    m_files()
+{
+    memset(&m_kdh, 0, sizeof(m_kdh));
+}
+
+afs_index::~afs_index()
+{
+}
+
+afs_kdh_t& afs_index::kdh()
+{
+    return m_kdh;
+}
+
+std::vector<word>& afs_index::bit_table()
+{
+    return m_bit_table;
+}
+
+std::vector<char>& afs_index::sysdir()
+{
+    return m_sysdir;
+}
+
+std::vector<afs_dv_t>& afs_index::dirents()
+{
+    return m_dirents;
+}
+
+std::vector<afs_index_file_t>& afs_index::files()
+{
+    return m_files;
+}
+
+/**
+ * @brief Make the key for an image file and its overlay file
+ * @param image file name of the image
+ * @param overlay file name of the overlay, or empty if none is used
+ * @param key pointer to the key to fill
+ * @return 0 on success, or -errno on error
+ */
+int afs_index::make_key(std::string image, std::string overlay, afs_index_key_t* key)
+{
+    memset(key, 0, sizeof(*key));
+    struct stat st;
+    if (stat(image.c_str(), &st) < 0)
+        return -errno;
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+    // A missing overlay leaves its part of the key 0
+    if (!overlay.empty() && 0 == stat(overlay.c_str(), &st)) {
+        key->ovl_size = st.st_size;
+        key->ovl_mtime = st.st_mtim.tv_sec;
+        key->ovl_mtime_nsec = st.st_mtim.tv_nsec;
+    }
+    return 0;
+}
+
+/**
+ * @brief Load an index file, if it matches the keys
+ * @param name file name of the index
+ * @param keys keys of the image file(s)
+ * @return 0 on success, -ESTALE if the keys differ, or -errno on error
+ */
+int afs_index::load(std::string name, const std::vector<afs_index_key_t>& keys)
+{
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -errno;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+    std::vector<char> data(st.st_size);
+    ssize_t done = pread(fd, data.data(), data.size(), 0);
+    close(fd);
+    if (done != st.st_size)
+        return -EIO;
+
+    afs_index_hdr_t hdr;
+    if (data.size() < sizeof(hdr))
+        return -EINVAL;
+    memcpy(&hdr, data.data(), sizeof(hdr));
+    if (hdr.magic != INDEX_MAGIC || hdr.version != INDEX_VERSION)
+        return -EINVAL;
+    if (hdr.ndisks != keys.size())
+        return -ESTALE;
+
+    const size_t size = sizeof(hdr) +
+        hdr.ndisks * sizeof(afs_index_key_t) +
+        sizeof(afs_kdh_t) +
+        hdr.nbits * sizeof(word) +
+        hdr.nsysdir +
+        hdr.ndirents * sizeof(afs_dv_t) +
+        hdr.nfiles * sizeof(afs_index_file_t);
+    if (data.size() != size)
+        return -EINVAL;
+
+    const char* src = data.data() + sizeof(hdr);
+    if (memcmp(src, keys.data(), hdr.ndisks * sizeof(afs_index_key_t)))
+        return -ESTALE;
+    src += hdr.ndisks * sizeof(afs_index_key_t);
+
+    memcpy(&m_kdh, src, sizeof(m_kdh));
+    src += sizeof(m_kdh);
+    m_bit_table.resize(hdr.nbits);
+    memcpy(m_bit_table.data(), src, hdr.nbits * sizeof(word));
+    src += hdr.nbits * sizeof(word);
+    m_sysdir.assign(src, src + hdr.nsysdir);
+    src += hdr.nsysdir;
+    m_dirents.resize(hdr.ndirents);
+    memcpy(m_dirents.data(), src, hdr.ndirents * sizeof(afs_dv_t));
+    src += hdr.ndirents * sizeof(afs_dv_t);
+    m_files.resize(hdr.nfiles);
+    memcpy(m_files.data(), src, hdr.nfiles * sizeof(afs_index_file_t));
+    return 0;
+}
+
+/**
+ * @brief Save the index file
+ *
+ * The index is written to a temporary file, which is then renamed,
+ * so that a partially written index is never loaded.
+ *
+ * @param name file name of the index
+ * @param keys keys of the image file(s)
+ * @return 0 on success, or -errno on error
+ */
+int afs_index::save(std::string name, const std::vector<afs_index_key_t>& keys) const
+{
+    afs_index_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = INDEX_MAGIC;
+    hdr.version = INDEX_VERSION;
+    hdr.ndisks = keys.size();
+    hdr.nbits = m_bit_table.size();
+    hdr.nsysdir = m_sysdir.size();
+    hdr.ndirents = m_dirents.size();
+    hdr.nfiles = m_files.size();
+
+    std::vector<char> data;
+    const char* hp = reinterpret_cast<const char *>(&hdr);
+    data.insert(data.end(), hp, hp + sizeof(hdr));
+    const char* kp = reinterpret_cast<const char *>(keys.data());
+    data.insert(data.end(), kp, kp + keys.size() * sizeof(afs_index_key_t));
+    const char* dp = reinterpret_cast<const char *>(&m_kdh);
+    data.insert(data.end(), dp, dp + sizeof(m_kdh));
+    const char* bp = reinterpret_cast<const char *>(m_bit_table.data());
+    data.insert(data.end(), bp, bp + m_bit_table.size() * sizeof(word));
+    data.insert(data.end(), m_sysdir.begin(), m_sysdir.end());
+    const char* ep = reinterpret_cast<const char *>(m_dirents.data());
+    data.insert(data.end(), ep, ep + m_dirents.size() * sizeof(afs_dv_t));
+    const char* fp = reinterpret_cast<const char *>(m_files.data());
+    data.insert(data.end(), fp, fp + m_files.size() * sizeof(afs_index_file_t));
+
+    std::string tmpname = name + "~";
+    int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -errno;
+    ssize_t done = write(fd, data.data(), data.size());
+    int res = done == (ssize_t)data.size() ? 0 : -EIO;
+    if (done < 0)
+        res = -errno;
+    close(fd);
+    if (0 == res && rename(tmpname.c_str(), name.c_str()) < 0)
+        res = -errno;
+    if (res < 0)
+        unlink(tmpname.c_str());
+    return res;
+}
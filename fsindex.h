@@ -0,0 +1,90 @@
+/*******************************************************************************************
+ *
+ * Alto file system startup index
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_FSINDEX_H_)
+#define _FSINDEX_H_
+
+#include <string>
+#include <vector>
+
+#include "afs_types.h"
+
+#define INDEX_MAGIC     0x58444941      //!< "AIDX" in the index file header
+#define INDEX_VERSION   1               //!< Version of the index file format
+
+/**
+ * @brief Key identifying the state of one disk image file (and its overlay)
+ */
+typedef struct {
+    uint64_t    dev;                    //!< Device of the image file
+    uint64_t    ino;                    //!< Inode of the image file
+    uint64_t    size;                   //!< Size of the image file
+    uint64_t    mtime;                  //!< Modification time of the image file (seconds)
+    uint64_t    mtime_nsec;             //!< Modification time of the image file (nanoseconds)
+    uint64_t    ovl_size;               //!< Size of the overlay file, or 0
+    uint64_t    ovl_mtime;              //!< Modification time of the overlay file (seconds), or 0
+    uint64_t    ovl_mtime_nsec;         //!< Modification time of the overlay file (nanoseconds), or 0
+}   afs_index_key_t;
+
+/**
+ * @brief Header of an index file
+ * It is followed by ndisks keys, the afs_kdh_t, the bit table words,
+ * the SysDir bytes, the SysDir entries and the file records.
+ */
+typedef struct {
+    uint32_t    magic;                  //!< INDEX_MAGIC
+    uint32_t    version;                //!< INDEX_VERSION
+    uint32_t    ndisks;                 //!< Number of keys
+    uint32_t    nbits;                  //!< Number of words in the bit table
+    uint32_t    nsysdir;                //!< Number of bytes of SysDir
+    uint32_t    ndirents;               //!< Number of SysDir entries
+    uint32_t    nfiles;                 //!< Number of file records
+    uint32_t    reserved;               //!< Reserved; 0
+}   afs_index_hdr_t;
+
+/**
+ * @brief Record of a file in the root directory, in directory order
+ */
+typedef struct {
+    uint32_t    leader_vda;             //!< Leader page of the file
+    uint32_t    size;                   //!< File size in bytes
+    uint32_t    npages;                 //!< Number of data pages
+    uint32_t    deleted;                //!< Non-zero, if the file is deleted
+}   afs_index_file_t;
+
+/**
+ * @brief Class to keep the results of the startup scans of a file system
+ *
+ * The index is only valid for the exact image file(s) it was made from,
+ * which is checked by comparing the keys.
+ */
+class afs_index
+{
+public:
+    afs_index();
+    ~afs_index();
+
+    static int make_key(std::string image, std::string overlay, afs_index_key_t* key);
+
+    int load(std::string name, const std::vector<afs_index_key_t>& keys);
+    int save(std::string name, const std::vector<afs_index_key_t>& keys) const;
+
+    afs_kdh_t& kdh();
+    std::vector<word>& bit_table();
+    std::vector<char>& sysdir();
+    std::vector<afs_dv_t>& dirents();
+    std::vector<afs_index_file_t>& files();
+
+private:
+    afs_kdh_t m_kdh;                    //!< The DiskDescriptor header
+    std::vector<word> m_bit_table;      //!< The bit table
+    std::vector<char> m_sysdir;         //!< The SysDir bytes
+    std::vector<afs_dv_t> m_dirents;    //!< The SysDir entries
+    std::vector<afs_index_file_t> m_files;  //!< The files
+};
+
+#endif // !defined(_FSINDEX_H_)
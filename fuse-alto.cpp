@@ -9,11 +9,15 @@
 
 #include "config.h"
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
+#include <deque>
 #include "altofs.h"
+#include "imagedir.h"
 
 static struct fuse_args fuse_args;
 static int verbose = 0;
@@ -23,16 +27,65 @@ static char* filenames = NULL;
 static struct fuse_chan* chan = NULL;
 static struct fuse* fuse = NULL;
 static struct fuse_operations* fuse_ops = NULL;
+static struct fuse_session* session = NULL;
+static struct fuse_lowlevel_ops* fuse_ll_ops = NULL;
 static int foreground = 0;
 static int multithreaded = 1;
+static int readonly = 0;
+static int journal = 0;
+static int overlay = 0;
+static int commit = 0;
+static int flush_interval = 30;
+static int flush_threshold = 1024;
+static int image_cache = 256;
+static int shadow = 0;
+static int score = 0;
+static int defrag = 0;
+static int sector_skew = 0;
+static int head_skew = 0;
+static int cylinder_skew = 0;
+static int lowlevel = 0;
+static double entry_timeout = -1.0;
+static double attr_timeout = -1.0;
+static int keep_cache = 0;
+static int owner_uid = -1;
+static int owner_gid = -1;
+static int owner_umask = -1;
+static pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<afs_change_t> notify_queue;
+static pthread_t notify_thread;
+static bool notify_running = false;
+static bool notify_quit = false;
 static AltoFS* afs = 0;
+static afs_imagedir* imagedir = 0;
 
 enum {
     KEY_HELP,
     KEY_FOREGROUND,
     KEY_SINGLE_THREADED,
     KEY_VERBOSE,
-    KEY_VERSION
+    KEY_VERSION,
+    KEY_READONLY,
+    KEY_FLUSH_INTERVAL,
+    KEY_FLUSH_THRESHOLD,
+    KEY_JOURNAL,
+    KEY_OVERLAY,
+    KEY_COMMIT,
+    KEY_IMAGE_CACHE,
+    KEY_SHADOW,
+    KEY_SCORE,
+    KEY_DEFRAG,
+    KEY_SECTOR_SKEW,
+    KEY_HEAD_SKEW,
+    KEY_CYLINDER_SKEW,
+    KEY_LOWLEVEL,
+    KEY_ENTRY_TIMEOUT,
+    KEY_ATTR_TIMEOUT,
+    KEY_KEEP_CACHE,
+    KEY_UID,
+    KEY_GID,
+    KEY_UMASK
 };
 
 /**
@@ -49,13 +102,203 @@ static struct fuse_opt alto_opts[] = {
     FUSE_OPT_KEY("--verbose",    KEY_VERBOSE),
     FUSE_OPT_KEY("-V",           KEY_VERSION),
     FUSE_OPT_KEY("--version",    KEY_VERSION),
+    FUSE_OPT_KEY("ro",           KEY_READONLY),
+    FUSE_OPT_KEY("flush_interval=",  KEY_FLUSH_INTERVAL),
+    FUSE_OPT_KEY("flush_threshold=", KEY_FLUSH_THRESHOLD),
+    FUSE_OPT_KEY("journal",      KEY_JOURNAL),
+    FUSE_OPT_KEY("overlay",      KEY_OVERLAY),
+    FUSE_OPT_KEY("--commit",     KEY_COMMIT),
+    FUSE_OPT_KEY("image_cache=", KEY_IMAGE_CACHE),
+    FUSE_OPT_KEY("shadow",       KEY_SHADOW),
+    FUSE_OPT_KEY("--score",      KEY_SCORE),
+    FUSE_OPT_KEY("--defrag",     KEY_DEFRAG),
+    FUSE_OPT_KEY("sector_skew=", KEY_SECTOR_SKEW),
+    FUSE_OPT_KEY("head_skew=",   KEY_HEAD_SKEW),
+    FUSE_OPT_KEY("cylinder_skew=", KEY_CYLINDER_SKEW),
+    FUSE_OPT_KEY("lowlevel",     KEY_LOWLEVEL),
+    FUSE_OPT_KEY("entry_timeout=", KEY_ENTRY_TIMEOUT),
+    FUSE_OPT_KEY("attr_timeout=", KEY_ATTR_TIMEOUT),
+    FUSE_OPT_KEY("keep_cache",   KEY_KEEP_CACHE),
+    FUSE_OPT_KEY("uid=",         KEY_UID),
+    FUSE_OPT_KEY("gid=",         KEY_GID),
+    FUSE_OPT_KEY("umask=",       KEY_UMASK),
     FUSE_OPT_END
 };
 
-static int create_alto(const char* path, mode_t mode, dev_t dev)
+/**
+ * @brief Class to find the AltoFS serving a path, and to hold it while in scope
+ *
+ * With a single image (pair), the path is used as is. With a directory
+ * of images, the first path component names the image, which is loaded
+ * if necessary, and is removed from the path.
+ */
+class alto_ref
+{
+public:
+    alto_ref(const char* path) :
+        m_afs(::afs),
+        m_path(path),
+        m_image(),
+        m_err(0),
+        m_keep(false)
+    {
+        if (!imagedir)
+            return;
+        const char* name = path + 1;
+        const char* slash = strchr(name, '/');
+        m_image = slash ? std::string(name, slash - name) : std::string(name);
+        m_path = slash ? std::string(slash) : std::string("/");
+        m_afs = NULL;
+        m_err = -ENOENT;
+        if (!m_image.empty())
+            m_afs = imagedir->acquire(m_image, &m_err);
+    }
+    ~alto_ref()
+    {
+        if (imagedir && m_afs && !m_keep)
+            imagedir->release(m_image);
+    }
+    AltoFS* afs() const { return m_afs; }
+    const char* path() const { return m_path.c_str(); }
+    std::string image() const { return m_image; }
+    int error() const { return m_err; }
+    //! Keep the image acquired when going out of scope; release_alto() releases it
+    void keep() { m_keep = true; }
+
+private:
+    AltoFS* m_afs;                      //!< The AltoFS serving the path, or NULL
+    std::string m_path;                 //!< The path inside the AltoFS
+    std::string m_image;                //!< The name of the image, if serving a directory of images
+    int m_err;                          //!< -errno, if m_afs is NULL
+    bool m_keep;                        //!< If true, the image is not released
+};
+
+/**
+ * @brief Open file handle, stored in fuse_file_info::fh
+ *
+ * Reads and writes go straight to the file info node, without resolving
+ * the path again. With a directory of images, the image stays acquired
+ * until the handle is released, so that it is not evicted while open.
+ */
+typedef struct {
+    AltoFS* afs;                        //!< The AltoFS serving the file
+    afs_fileinfo* info;                 //!< The file info node
+    std::string image;                  //!< The name of the image, if serving a directory of images
+}   alto_file;
+
+/**
+ * @brief Return the open file handle of a fuse_file_info
+ * @param fi pointer to the fuse_file_info
+ * @return pointer to the alto_file
+ */
+static alto_file* alto_fh(struct fuse_file_info* fi)
+{
+    return reinterpret_cast<alto_file *>(fi->fh);
+}
+
+/**
+ * @brief Open directory handle, stored in fuse_file_info::fh
+ *
+ * The entries are copied when the directory is opened, so the image of
+ * a directory of images needn't stay acquired while it is open.
+ */
+typedef struct {
+    std::string path;                   //!< Path of the directory
+    std::vector<afs_dirent_t> entries;  //!< Snapshot of the entries, with their status
+    bool listed;                        //!< True, once the entries were listed
+}   alto_dir;
+
+/**
+ * @brief Return the open directory handle of a fuse_file_info
+ * @param fi pointer to the fuse_file_info
+ * @return pointer to the alto_dir
+ */
+static alto_dir* alto_dh(struct fuse_file_info* fi)
+{
+    return reinterpret_cast<alto_dir *>(fi->fh);
+}
+
+/**
+ * @brief Owner and umask to show the files with
+ */
+typedef struct {
+    uid_t uid;                          //!< User id
+    gid_t gid;                          //!< Group id
+    mode_t umask;                       //!< Mode bits to clear
+}   alto_owner_t;
+
+/**
+ * @brief Return the owner and umask given with the options, or else those of the caller
+ * @param uid user id of the caller
+ * @param gid group id of the caller
+ * @param umask umask of the caller
+ * @return the owner and umask
+ */
+static alto_owner_t alto_owner(uid_t uid, gid_t gid, mode_t umask)
+{
+    alto_owner_t owner;
+    owner.uid = owner_uid >= 0 ? (uid_t)owner_uid : uid;
+    owner.gid = owner_gid >= 0 ? (gid_t)owner_gid : gid;
+    owner.umask = owner_umask >= 0 ? (mode_t)owner_umask : umask;
+    return owner;
+}
+
+/**
+ * @brief Return true, if all of -o uid=,gid=,umask= were given
+ *
+ * The files then look the same to every caller, and the context of
+ * a request isn't fetched at all.
+ */
+static bool fixed_owner()
 {
+    return owner_uid >= 0 && owner_gid >= 0 && owner_umask >= 0;
+}
+
+/**
+ * @brief Return the owner and umask for the caller of the current request
+ * @return the owner and umask
+ */
+static alto_owner_t alto_owner()
+{
+    if (fixed_owner())
+        return alto_owner(0, 0, 0);
     struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    return alto_owner(ctx->uid, ctx->gid, ctx->umask);
+}
+
+/**
+ * @brief Fill a struct stat for the top directory of a directory of images
+ * @param owner owner and umask to show it with
+ * @param stbuf pointer to the struct stat
+ */
+static void imagedir_stat(const alto_owner_t& owner, struct stat* stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = S_IFDIR | (0777 & ~owner.umask);
+    stbuf->st_nlink = 2;
+    stbuf->st_uid = owner.uid;
+    stbuf->st_gid = owner.gid;
+}
+
+/**
+ * @brief Set the owner and mode of a copy of a file's struct stat
+ * @param owner owner and umask to show it with
+ * @param stbuf pointer to the struct stat
+ */
+static void alto_stat(const alto_owner_t& owner, struct stat* stbuf)
+{
+    stbuf->st_uid = owner.uid;
+    stbuf->st_gid = owner.gid;
+    stbuf->st_mode &= ~owner.umask;
+}
+
+static int create_alto(const char* path, mode_t mode, dev_t dev)
+{
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
     int res;
 
     afs_fileinfo* info = afs->find_fileinfo(path);
@@ -88,126 +331,329 @@ static int create_alto(const char* path, mode_t mode, dev_t dev)
 
 static int getattr_alto(const char *path, struct stat *stbuf)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    const alto_owner_t owner = alto_owner();
+    if (imagedir && 0 == strcmp(path, "/")) {
+        imagedir_stat(owner, stbuf);
+        return 0;
+    }
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
 
     memset(stbuf, 0, sizeof(struct stat));
-    afs_fileinfo* info = afs->find_fileinfo(path);
-    if (!info)
-        return -ENOENT;
-
-    info->setStatUid(ctx->uid);
-    info->setStatGid(ctx->gid);
-    info->setStatMode(info->statMode() & ~ctx->umask);
+    int res = afs->stat_file(path, stbuf);
+    if (res < 0)
+        return res;
 
-    memcpy(stbuf, info->st(), sizeof(*stbuf));
+    // The caller's view is set up in the copy, not in the shared file info
+    alto_stat(owner, stbuf);
     return 0;
 }
 
-static int readdir_alto(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+/**
+ * @brief Take a snapshot of the entries of a directory
+ *
+ * The first entry is the directory itself, the second its parent.
+ *
+ * @param path path of the directory
+ * @param entries vector to receive the entries
+ * @return 0 on success, or -errno on error
+ */
+static int alto_list(const char* path, std::vector<afs_dirent_t>& entries)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
-
-    afs_fileinfo* info = afs->find_fileinfo("/");
-    if (!info)
-        return -ENOENT;
-
-    info->setStatUid(ctx->uid);
-    info->setStatGid(ctx->gid);
-    info->setStatMode(info->statMode() & ~ctx->umask);
-    filler(buf, ".", info->st(), 0);
-    filler(buf, "..", NULL, 0);
-
-    for (int i = 0; i < info->size(); i++) {
-        afs_fileinfo* child = info->child(i);
-        if (!child)
-            continue;
-        if (child->deleted())
-            continue;
+    entries.clear();
+    if (imagedir && 0 == strcmp(path, "/")) {
+        // List the images as directories, without loading them
+        // The owner and umask of the caller are set when listing
+        const alto_owner_t none = { 0, 0, 0 };
+        afs_dirent_t ent;
+        imagedir_stat(none, &ent.st);
+        ent.name = ".";
+        entries.push_back(ent);
+        ent.name = "..";
+        entries.push_back(ent);
+        imagedir->scan();
+        std::vector<std::string> names = imagedir->names();
+        for (size_t i = 0; i < names.size(); i++) {
+            ent.name = names[i];
+            entries.push_back(ent);
+        }
+        return 0;
+    }
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
+
+    int res = afs->read_dir(path, entries);
+    if (res < 0)
+        return res;
+    // The root directory is its own parent, as far as we know
+    afs_dirent_t dotdot = entries[0];
+    dotdot.name = "..";
+    entries.insert(entries.begin() + 1, dotdot);
+    return 0;
+}
 
-        child->setStatUid(ctx->uid);
-        child->setStatGid(ctx->gid);
-        child->setStatMode(child->statMode() & ~ctx->umask);
+/**
+ * @brief Open a directory, and take a snapshot of its entries for the handle
+ *
+ * Listing it in several calls then continues where the previous call
+ * stopped, even if files are created or unlinked meanwhile.
+ */
+static int opendir_alto(const char* path, struct fuse_file_info* fi)
+{
+    alto_dir* dh = new alto_dir;
+    int res = alto_list(path, dh->entries);
+    if (res < 0) {
+        delete dh;
+        return res;
+    }
+    dh->path = path;
+    dh->listed = false;
+    fi->fh = (uint64_t)dh;
+    return 0;
+}
 
-        if (filler(buf, child->name().c_str(), child->st(), 0))
+/**
+ * @brief List a directory from the snapshot of its handle
+ *
+ * The offset of an entry is its index in the snapshot plus one, so that
+ * the next call continues after the last entry which fit into the buffer.
+ * Listing it again from the start, e.g. after rewinddir(), takes a new
+ * snapshot. The status of each entry is passed along with its name.
+ */
+static int readdir_alto(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    alto_dir* dh = alto_dh(fi);
+    if (0 == offset && dh->listed) {
+        int res = alto_list(dh->path.c_str(), dh->entries);
+        if (res < 0)
+            return res;
+    }
+    dh->listed = true;
+
+    const alto_owner_t owner = alto_owner();
+    for (size_t i = (size_t)offset; i < dh->entries.size(); i++) {
+        // The caller's view is set up in a copy, so the snapshot stays as it is
+        struct stat st = dh->entries[i].st;
+        alto_stat(owner, &st);
+        if (filler(buf, dh->entries[i].name.c_str(), &st, (off_t)(i + 1)))
             break;
     }
+    return 0;
+}
 
+static int releasedir_alto(const char* path, struct fuse_file_info* fi)
+{
+    delete alto_dh(fi);
+    fi->fh = 0;
     return 0;
 }
 
 static int open_alto(const char *path, struct fuse_file_info *fi)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
 
     afs_fileinfo* info = afs->find_fileinfo(path);
     if (!info)
         return -ENOENT;
 
-    fi->fh = (uint64_t)info;
+    alto_file* fh = new alto_file;
+    fh->afs = afs;
+    fh->info = info;
+    fh->image = ref.image();
+    ref.keep();
+    fi->fh = (uint64_t)fh;
+    fi->keep_cache = keep_cache;
     return 0;
 }
 
-static int read_alto(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info*)
+static int release_alto(const char* path, struct fuse_file_info* fi)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    alto_file* fh = alto_fh(fi);
+    if (imagedir)
+        imagedir->release(fh->image);
+    delete fh;
+    fi->fh = 0;
+    return 0;
+}
 
-    afs_fileinfo* info = afs->find_fileinfo(path);
-    if (!info)
-        return -ENOENT;
-    if (offset >= info->st()->st_size)
+static int read_alto(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    alto_file* fh = alto_fh(fi);
+    if ((size_t)offset >= fh->info->statSize())
         return 0;
-    size_t done = afs->read_file(info->leader_page_vda(), buf, size, offset);
-    return done;
+    return fh->afs->read_file(fh->info, buf, size, offset);
 }
 
-static int write_alto(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info*)
+/**
+ * @brief Read a file without copying the data in user space
+ *
+ * The data is returned as ranges of the shadow memory file, which
+ * FUSE can splice to the kernel.
+ */
+static int read_buf_alto(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    alto_file* fh = alto_fh(fi);
+    std::vector<afs_extent_t> extents;
+    if ((size_t)offset < fh->info->statSize()) {
+        ssize_t res = fh->afs->read_file_shadow(fh->info, extents, size, offset);
+        if (res < 0)
+            return res;
+    }
 
-    afs_fileinfo* info = afs->find_fileinfo(path);
-    if (!info)
-        return -ENOENT;
-    size_t done = afs->write_file(info->leader_page_vda(), buf, size, offset);
-    return done;
+    // An empty read is a single empty buffer
+    const size_t count = extents.empty() ? 1 : extents.size();
+    const size_t bytes = sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf);
+    struct fuse_bufvec* bufv = reinterpret_cast<struct fuse_bufvec *>(malloc(bytes));
+    if (!bufv)
+        return -ENOMEM;
+    memset(bufv, 0, bytes);
+    bufv->count = count;
+    bufv->buf[0].fd = -1;
+    for (size_t i = 0; i < extents.size(); i++) {
+        bufv->buf[i].size = extents[i].size;
+        bufv->buf[i].flags = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufv->buf[i].mem = NULL;
+        bufv->buf[i].fd = fh->afs->shadow_fd();
+        bufv->buf[i].pos = extents[i].pos;
+    }
+    *bufp = bufv;
+    return 0;
+}
+
+static int write_alto(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    alto_file* fh = alto_fh(fi);
+    return fh->afs->write_file(fh->info, buf, size, offset);
+}
+
+/**
+ * @brief Allocate the pages of a file up to offset + length
+ *
+ * Only mode 0 is supported, as the pages of an Alto file can't be
+ * reserved beyond its end, nor can holes be punched into it.
+ */
+static int fallocate_alto(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
+{
+    if (0 != mode)
+        return -EOPNOTSUPP;
+    alto_file* fh = alto_fh(fi);
+    return fh->afs->allocate_file(fh->info, offset + length);
 }
 
 static int truncate_alto(const char* path, off_t offset)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
     return afs->truncate_file(path, offset);
 }
 
 static int unlink_alto(const char *path)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
     return afs->unlink_file(path);
 }
 
 static int rename_alto(const char *path, const char* newname)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
+    if (imagedir) {
+        // Files can't be moved between images
+        const std::string prefix = "/" + ref.image() + "/";
+        if (0 != strncmp(newname, prefix.c_str(), prefix.size()))
+            return -EXDEV;
+        newname += prefix.size() - 1;
+    }
     return afs->rename_file(path, newname);
 }
 
 static int utimens_alto(const char* path, const struct timespec tv[2])
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
     return afs->set_times(path, tv);
 }
 
+static int flush_alto(const char* path, struct fuse_file_info* fi)
+{
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
+    // Store SysDir and DiskDescriptor in the image, but leave the I/O to fsync
+    return afs->flush(false);
+}
+
+static int fsync_alto(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
+    return afs->flush(true);
+}
+
+/**
+ * @brief Set an extended attribute
+ *
+ * There are no extended attributes, but setting "user.alto.defragment"
+ * on the root directory of an image defragments it while mounted, e.g.
+ * with "setfattr -n user.alto.defragment /mnt/alto".
+ */
+static int setxattr_alto(const char* path, const char* name, const char* value, size_t size, int flags)
+{
+    if (strcmp(name, "user.alto.defragment"))
+        return -ENOTSUP;
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
+    if (strcmp(path, "/"))
+        return -ENOTSUP;
+    int res = afs->defragment();
+    return res < 0 ? res : 0;
+}
+
 static int statfs_alto(const char *path, struct statvfs* vfs)
 {
-    struct fuse_context* ctx = fuse_get_context();
-    AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+    if (imagedir && 0 == strcmp(path, "/")) {
+        memset(vfs, 0, sizeof(*vfs));
+        vfs->f_bsize = PAGESZ;
+        vfs->f_frsize = PAGESZ;
+        vfs->f_namemax = FNLEN-2;
+        return 0;
+    }
+    alto_ref ref(path);
+    AltoFS* afs = ref.afs();
+    if (!afs)
+        return ref.error();
+    path = ref.path();
 
     // We have but a single root directory
     if (strcmp(path, "/"))
@@ -215,6 +661,7 @@ static int statfs_alto(const char *path, struct statvfs* vfs)
     return afs->statvfs(vfs);
 }
 
+
 #if defined(DEBUG)
 static const char* fuse_cap(unsigned flags)
 {
@@ -248,11 +695,40 @@ static const char* fuse_cap(unsigned flags)
 }
 #endif
 
-void* init_alto(fuse_conn_info* info)
+/**
+ * @brief Load the disk image(s), or scan the directory of disk images
+ *
+ * This runs when FUSE is initialized, i.e. after fuse_daemonize(),
+ * so that the flush thread is started in the daemon.
+ */
+static void open_images()
 {
-    (void)info;
+    int flags = 0;
+    if (readonly)
+        flags |= AFS_READONLY;
+    if (journal)
+        flags |= AFS_JOURNAL;
+    if (overlay)
+        flags |= AFS_OVERLAY;
+    if (shadow)
+        flags |= AFS_SHADOW;
+    afs_layout layout;
+    layout.set_skew(sector_skew, head_skew, cylinder_skew);
+    struct stat st;
+    if (0 == stat(filenames, &st) && S_ISDIR(st.st_mode)) {
+        imagedir = new afs_imagedir(filenames, verbose, flags, (size_t)image_cache << 20);
+        imagedir->set_flush(flush_interval, flush_threshold);
+        imagedir->set_layout(layout);
+    } else {
+        afs = new AltoFS(filenames, verbose, flags);
+        afs->start_flush_thread(flush_interval, flush_threshold);
+        afs->set_layout(layout);
+    }
+}
 
-    afs = new AltoFS(filenames, verbose);
+void* init_alto(fuse_conn_info* info)
+{
+    open_images();
 
 #if defined(DEBUG)
     if (verbose > 2) {
@@ -273,17 +749,527 @@ void* init_alto(fuse_conn_info* info)
     return afs;
 }
 
+/*
+ * Low-level backend
+ *
+ * Requests name the file by its inode number instead of a path. The inode
+ * number of a file is its leader page VDA at mount or creation time, which
+ * it keeps when it is defragmented, offset by FUSE_ROOT_ID, so that the
+ * root directory (st_ino 0) is FUSE_ROOT_ID. No inode number is used for
+ * two files while mounted, so the generation is always 0. The kernel
+ * caches entries and attributes for entry_timeout and attr_timeout
+ * seconds, so that most repeated lookups and stats never reach us. Only a single image (pair)
+ * can be served this way.
+ */
+
+/**
+ * @brief Return the FUSE inode number for a file's struct stat
+ * @param st pointer to the struct stat
+ * @return inode number
+ */
+static fuse_ino_t alto_ino(const struct stat* st)
+{
+    return (fuse_ino_t)st->st_ino + FUSE_ROOT_ID;
+}
+
+/**
+ * @brief Return the file info node for a FUSE inode number
+ * @param ino inode number
+ * @return pointer to the afs_fileinfo, or NULL if not found
+ */
+static afs_fileinfo* alto_node(fuse_ino_t ino)
+{
+    if (!afs || ino < FUSE_ROOT_ID)
+        return NULL;
+    return afs->find_inode((ino_t)(ino - FUSE_ROOT_ID));
+}
+
+/**
+ * @brief Return the path of a child of the root directory
+ * @param parent inode number of the directory
+ * @param name file name
+ * @return path with "/" prepended, or an empty string if parent is not the root
+ */
+static std::string alto_path(fuse_ino_t parent, const char* name)
+{
+    if (parent != FUSE_ROOT_ID)
+        return std::string();
+    return std::string("/") + name;
+}
+
+/**
+ * @brief Copy a file's struct stat for the caller of a request
+ * @param req the request
+ * @param info pointer to the afs_fileinfo
+ * @param stbuf pointer to the struct stat
+ */
+static void alto_stat_ll(fuse_req_t req, afs_fileinfo* info, struct stat* stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    info->copyStat(stbuf);
+    if (fixed_owner()) {
+        alto_stat(alto_owner(0, 0, 0), stbuf);
+    } else {
+        const struct fuse_ctx* ctx = fuse_req_ctx(req);
+        alto_stat(alto_owner(ctx->uid, ctx->gid, ctx->umask), stbuf);
+    }
+    stbuf->st_ino = alto_ino(stbuf);
+}
+
+/**
+ * @brief Fill a fuse_entry_param for a file
+ * @param req the request
+ * @param path path of the file
+ * @param e pointer to the fuse_entry_param
+ * @return 0 on success, or -errno on error
+ */
+static int alto_entry_ll(fuse_req_t req, const std::string& path, struct fuse_entry_param* e)
+{
+    afs_fileinfo* info = afs->find_fileinfo(path);
+    if (!info)
+        return -ENOENT;
+    memset(e, 0, sizeof(*e));
+    alto_stat_ll(req, info, &e->attr);
+    e->ino = e->attr.st_ino;
+    // Inode numbers are never reused while mounted
+    e->generation = 0;
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
+    return 0;
+}
+
+/**
+ * @brief Queue a change reported by the AltoFS
+ *
+ * The kernel must not be notified while the AltoFS is locked, nor from
+ * a request handler, as it may wait for a request on the same inode.
+ * The changes are delivered by notify_loop() instead.
+ */
+static void change_alto(void* arg, const afs_change_t& change)
+{
+    (void)arg;
+    pthread_mutex_lock(&notify_mutex);
+    notify_queue.push_back(change);
+    pthread_cond_signal(&notify_cond);
+    pthread_mutex_unlock(&notify_mutex);
+}
+
+/**
+ * @brief Invalidate the kernel's cached names, attributes and data as the AltoFS changes
+ */
+static void* notify_loop(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&notify_mutex);
+    for (;;) {
+        while (notify_queue.empty() && !notify_quit)
+            pthread_cond_wait(&notify_cond, &notify_mutex);
+        if (notify_queue.empty())
+            break;
+        afs_change_t change = notify_queue.front();
+        notify_queue.pop_front();
+        pthread_mutex_unlock(&notify_mutex);
+
+        // -ENOENT just means the kernel doesn't have it cached
+        const fuse_ino_t ino = (fuse_ino_t)change.ino + FUSE_ROOT_ID;
+        int res = 0;
+        switch (change.kind) {
+        case AFS_CHANGE_ATTR:
+            res = fuse_lowlevel_notify_inval_inode(chan, ino, -1, 0);
+            break;
+        case AFS_CHANGE_DATA:
+            res = fuse_lowlevel_notify_inval_inode(chan, ino, change.offset, change.length);
+            break;
+        case AFS_CHANGE_ENTRY:
+            res = fuse_lowlevel_notify_inval_entry(chan, FUSE_ROOT_ID,
+                change.name.c_str(), change.name.size());
+            break;
+        }
+        if (verbose > 1 && res < 0 && res != -ENOENT)
+            printf("%s: invalidating %s failed (%s)\n", __func__,
+                change.kind == AFS_CHANGE_ENTRY ? change.name.c_str() : "an inode",
+                strerror(-res));
+
+        pthread_mutex_lock(&notify_mutex);
+    }
+    pthread_mutex_unlock(&notify_mutex);
+    return NULL;
+}
+
+/**
+ * @brief Stop reporting changes, and deliver the ones already queued
+ */
+static void stop_notify()
+{
+    if (afs)
+        afs->set_change_callback(NULL, NULL);
+    if (!notify_running)
+        return;
+    pthread_mutex_lock(&notify_mutex);
+    notify_quit = true;
+    pthread_cond_signal(&notify_cond);
+    pthread_mutex_unlock(&notify_mutex);
+    pthread_join(notify_thread, NULL);
+    notify_running = false;
+}
+
+static void init_alto_ll(void* userdata, struct fuse_conn_info* conn)
+{
+    (void)userdata;
+    (void)conn;
+    open_images();
+
+    // The kernel caches names and attributes, so tell it what changed
+    if (0 == pthread_create(&notify_thread, NULL, notify_loop, NULL)) {
+        notify_running = true;
+        afs->set_change_callback(change_alto, NULL);
+    } else {
+        printf("%s: could not start the notify thread; the kernel caches may go stale\n", __func__);
+    }
+}
+
+static void lookup_alto_ll(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    const std::string path = alto_path(parent, name);
+    if (path.empty()) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    struct fuse_entry_param e;
+    int res = alto_entry_ll(req, path, &e);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+static void forget_alto_ll(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    // The file info nodes are never released, so there is nothing to forget
+    (void)ino;
+    (void)nlookup;
+    fuse_reply_none(req);
+}
+
+static void getattr_alto_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    (void)fi;
+    afs_fileinfo* info = alto_node(ino);
+    if (!info) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct stat st;
+    alto_stat_ll(req, info, &st);
+    fuse_reply_attr(req, &st, attr_timeout);
+}
+
+/**
+ * @brief Truncate a file and/or set its times
+ *
+ * Neither the mode nor the owner of an Alto file can be changed.
+ */
+static void setattr_alto_ll(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi)
+{
+    (void)fi;
+    afs_fileinfo* info = alto_node(ino);
+    if (!info) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    const std::string path = "/" + info->name();
+    int res = 0;
+    if (to_set & FUSE_SET_ATTR_SIZE)
+        res = truncate_alto(path.c_str(), attr->st_size);
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        // Times which are not set keep their current value
+        struct stat cur;
+        info->copyStat(&cur);
+        struct timespec tv[2];
+        tv[0].tv_sec = cur.st_atime;
+        tv[0].tv_nsec = 0;
+        tv[1].tv_sec = cur.st_mtime;
+        tv[1].tv_nsec = 0;
+        const time_t now = time(NULL);
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            tv[0].tv_sec = now;
+        else if (to_set & FUSE_SET_ATTR_ATIME)
+            tv[0].tv_sec = attr->st_atime;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            tv[1].tv_sec = now;
+        else if (to_set & FUSE_SET_ATTR_MTIME)
+            tv[1].tv_sec = attr->st_mtime;
+        res = utimens_alto(path.c_str(), tv);
+    }
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    struct stat st;
+    alto_stat_ll(req, info, &st);
+    fuse_reply_attr(req, &st, attr_timeout);
+}
+
+static void mknod_alto_ll(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev)
+{
+    const std::string path = alto_path(parent, name);
+    if (path.empty()) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    struct fuse_entry_param e;
+    int res = create_alto(path.c_str(), mode, rdev);
+    if (res == 0)
+        res = alto_entry_ll(req, path, &e);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+static void create_alto_ll(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi)
+{
+    const std::string path = alto_path(parent, name);
+    if (path.empty()) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    struct fuse_entry_param e;
+    int res = create_alto(path.c_str(), mode, 0);
+    if (res == 0)
+        res = alto_entry_ll(req, path, &e);
+    if (res == 0)
+        res = open_alto(path.c_str(), fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if (fuse_reply_create(req, &e, fi) != 0)
+        release_alto(path.c_str(), fi);
+}
+
+static void unlink_alto_ll(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    const std::string path = alto_path(parent, name);
+    if (path.empty()) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    fuse_reply_err(req, -unlink_alto(path.c_str()));
+}
+
+static void rename_alto_ll(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname)
+{
+    const std::string path = alto_path(parent, name);
+    const std::string newpath = alto_path(newparent, newname);
+    if (path.empty() || newpath.empty()) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    fuse_reply_err(req, -rename_alto(path.c_str(), newpath.c_str()));
+}
+
+static void open_alto_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    afs_fileinfo* info = alto_node(ino);
+    if (!info) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    const std::string path = "/" + info->name();
+    int res = open_alto(path.c_str(), fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if (fuse_reply_open(req, fi) != 0)
+        release_alto(path.c_str(), fi);
+}
+
+static void release_alto_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -release_alto(NULL, fi));
+}
+
+/**
+ * @brief Read a file
+ *
+ * With a shadow, the data is returned as ranges of the shadow memory
+ * file, which FUSE can splice to the kernel.
+ */
+static void read_alto_ll(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    (void)ino;
+    if (shadow) {
+        struct fuse_bufvec* bufv = NULL;
+        int res = read_buf_alto(NULL, &bufv, size, offset, fi);
+        if (res < 0) {
+            fuse_reply_err(req, -res);
+            return;
+        }
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        free(bufv);
+        return;
+    }
+    std::vector<char> buf(size);
+    int res = read_alto(NULL, buf.data(), size, offset, fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_buf(req, buf.data(), (size_t)res);
+}
+
+static void write_alto_ll(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    (void)ino;
+    int res = write_alto(NULL, buf, size, offset, fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_write(req, (size_t)res);
+}
+
+static void flush_alto_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -flush_alto("/", fi));
+}
+
+static void fsync_alto_ll(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -fsync_alto("/", datasync, fi));
+}
+
+static void opendir_alto_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    if (ino != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    int res = opendir_alto("/", fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->keep_cache = keep_cache;
+    if (fuse_reply_open(req, fi) != 0)
+        releasedir_alto(NULL, fi);
+}
+
+/**
+ * @brief List the root directory from the snapshot of its handle
+ *
+ * The offsets are those of readdir_alto(). Only the inode number and the
+ * file type of an entry can be passed along with its name, so the kernel
+ * still looks up the entries for their status; these lookups are answered
+ * from the root directory snapshot without locking.
+ */
+static void readdir_alto_ll(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    (void)ino;
+    alto_dir* dh = alto_dh(fi);
+    if (0 == offset && dh->listed) {
+        int res = alto_list(dh->path.c_str(), dh->entries);
+        if (res < 0) {
+            fuse_reply_err(req, -res);
+            return;
+        }
+    }
+    dh->listed = true;
+
+    std::vector<char> buf(size);
+    size_t pos = 0;
+    for (size_t i = (size_t)offset; i < dh->entries.size(); i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = alto_ino(&dh->entries[i].st);
+        st.st_mode = dh->entries[i].st.st_mode;
+        const size_t len = fuse_add_direntry(req, buf.data() + pos, size - pos,
+            dh->entries[i].name.c_str(), &st, (off_t)(i + 1));
+        if (len > size - pos)
+            break;
+        pos += len;
+    }
+    fuse_reply_buf(req, buf.data(), pos);
+}
+
+static void releasedir_alto_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -releasedir_alto(NULL, fi));
+}
+
+static void statfs_alto_ll(fuse_req_t req, fuse_ino_t ino)
+{
+    (void)ino;
+    struct statvfs vfs;
+    int res = statfs_alto("/", &vfs);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_statfs(req, &vfs);
+}
+
+static void setxattr_alto_ll(fuse_req_t req, fuse_ino_t ino, const char* name, const char* value, size_t size, int flags)
+{
+    if (ino != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
+    fuse_reply_err(req, -setxattr_alto("/", name, value, size, flags));
+}
+
+static void fallocate_alto_ll(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -fallocate_alto(NULL, mode, offset, length, fi));
+}
+
 static int usage(const char* program)
 {
     const char* prog = strrchr(program, '/');
     prog = prog ? prog + 1 : program;
     fprintf(stderr, "%s Version %s\n", prog, FUSE_ALTO_VERSION);
     fprintf(stderr, "usage: %s <mountpoint> [options] <disk image file(s)>\n", prog);
+    fprintf(stderr, "   or: %s <mountpoint> [options] <directory of disk images>\n", prog);
+    fprintf(stderr, "   or: %s --commit [-v] <disk image file(s)>\n", prog);
+    fprintf(stderr, "   or: %s --score [-o *_skew=N] <disk image file(s)>\n", prog);
+    fprintf(stderr, "   or: %s --defrag [-v] [-o *_skew=N] <disk image file(s)>\n", prog);
     fprintf(stderr, "Where [options] can be one or more of\n");
     fprintf(stderr, "    -h|--help              print this help\n");
     fprintf(stderr, "    -f|--foreground        run fuse-alto in the foreground\n");
     fprintf(stderr, "    -s|--single            run fuse-alto single threaded\n");
     fprintf(stderr, "    -v|--verbose           set verbose mode (can be repeated)\n");
+    fprintf(stderr, "    -o ro                  mount read-only; the disk image(s) are never written to\n");
+    fprintf(stderr, "    -o flush_interval=N    write back changes every N seconds (default %d, 0 = off)\n", flush_interval);
+    fprintf(stderr, "    -o flush_threshold=N   write back when N pages are modified (default %d, 0 = off)\n", flush_threshold);
+    fprintf(stderr, "    -o journal             journal metadata changes to <first image>.journal\n");
+    fprintf(stderr, "    -o overlay             write modified pages to <image>.overlay; the image(s) are never written to\n");
+    fprintf(stderr, "    -o image_cache=N       with a directory, keep at most N MB of images loaded (default %d, 0 = no limit)\n", image_cache);
+    fprintf(stderr, "    -o shadow              keep a host byte order copy of the pages and read without copying\n");
+    fprintf(stderr, "    -o sector_skew=N       leave out N sectors between the pages of a file (default %d)\n", sector_skew);
+    fprintf(stderr, "    -o head_skew=N         leave out N more sectors when switching heads (default %d)\n", head_skew);
+    fprintf(stderr, "    -o cylinder_skew=N     leave out N more sectors when seeking to the next cylinder (default %d)\n", cylinder_skew);
+    fprintf(stderr, "    -o lowlevel            serve a single image (pair) by inode number with the low-level API\n");
+    fprintf(stderr, "    -o entry_timeout=T     let the kernel cache names for T seconds (default 1.0)\n");
+    fprintf(stderr, "    -o attr_timeout=T      let the kernel cache attributes for T seconds (default 1.0)\n");
+    fprintf(stderr, "    -o keep_cache          keep the kernel's cached data of a file when it is opened\n");
+    fprintf(stderr, "    -o uid=N,gid=N         show the files as owned by uid/gid N (default: the caller's)\n");
+    fprintf(stderr, "    -o umask=M             clear the octal mode bits M of the files (default: the caller's umask)\n");
+    fprintf(stderr, "    --commit               merge the overlay(s) of the disk image(s) into new image(s) <image>~\n");
+    fprintf(stderr, "    --score                print the expected time for an emulated Diablo to read each file\n");
+    fprintf(stderr, "    --defrag               move the pages of each file into a chain as the skews place them\n");
     return 0;
 }
 
@@ -316,7 +1302,8 @@ static int fuse_opt_proc(void* data, const char* arg, int key, struct fuse_args*
         break;
 
     case FUSE_OPT_KEY_NONOPT:
-        if (0 == nonopt_seen++) {
+        // There is no mountpoint when committing, scoring or defragmenting
+        if (0 == nonopt_seen++ && !commit && !score && !defrag) {
             return 1;
         }
         if (NULL == filenames) {
@@ -352,6 +1339,87 @@ static int fuse_opt_proc(void* data, const char* arg, int key, struct fuse_args*
         verbose++;
         return 0;
 
+    case KEY_READONLY:
+        readonly = 1;
+        // Also pass it on to FUSE
+        return 1;
+
+    case KEY_FLUSH_INTERVAL:
+        flush_interval = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_FLUSH_THRESHOLD:
+        flush_threshold = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_JOURNAL:
+        journal = 1;
+        return 0;
+
+    case KEY_OVERLAY:
+        overlay = 1;
+        return 0;
+
+    case KEY_COMMIT:
+        commit = 1;
+        return 0;
+
+    case KEY_IMAGE_CACHE:
+        image_cache = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_SHADOW:
+        shadow = 1;
+        return 0;
+
+    case KEY_SCORE:
+        score = 1;
+        return 0;
+
+    case KEY_DEFRAG:
+        defrag = 1;
+        return 0;
+
+    case KEY_SECTOR_SKEW:
+        sector_skew = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_HEAD_SKEW:
+        head_skew = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_CYLINDER_SKEW:
+        cylinder_skew = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_LOWLEVEL:
+        lowlevel = 1;
+        return 0;
+
+    case KEY_ENTRY_TIMEOUT:
+        entry_timeout = atof(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_ATTR_TIMEOUT:
+        attr_timeout = atof(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_KEEP_CACHE:
+        keep_cache = 1;
+        return 0;
+
+    case KEY_UID:
+        owner_uid = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_GID:
+        owner_gid = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_UMASK:
+        owner_umask = (int)strtol(strchr(arg, '=') + 1, NULL, 8) & 0777;
+        return 0;
+
     case KEY_VERSION:
         printf("fuse-alto version %s\n", FUSE_ALTO_VERSION);
         fuse_opt_add_arg(outargs, "--version");
@@ -365,15 +1433,71 @@ static int fuse_opt_proc(void* data, const char* arg, int key, struct fuse_args*
     return 0;
 }
 
+/**
+ * @brief Print the expected time for an emulated Diablo to read each file
+ *
+ * The skews given with the options are taken as the delays of the drive.
+ *
+ * @return 0 on success, or -errno on error
+ */
+static int score_images()
+{
+    afs_layout layout;
+    layout.set_skew(sector_skew, head_skew, cylinder_skew);
+    afs = new AltoFS(filenames, verbose, AFS_READONLY);
+    afs->set_layout(layout);
+    afs_fileinfo* root = afs->find_fileinfo("/");
+    if (!root)
+        return -ENOENT;
+
+    printf("%-40s %6s %6s %10s %10s %10s %10s\n",
+        "File", "Pages", "Seeks", "Seek ms", "Rotate ms", "Read ms", "Total ms");
+    afs_score_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < root->size(); i++) {
+        afs_fileinfo* info = root->child(i);
+        if (info->deleted())
+            continue;
+        afs_score_t sc;
+        if (afs->score_file(info, &sc) < 0)
+            continue;
+        printf("%-40s %6lu %6lu %10.1f %10.1f %10.1f %10.1f\n",
+            info->name().c_str(), sc.pages, sc.seeks, sc.seek_ms, sc.rotate_ms,
+            sc.read_ms, sc.seek_ms + sc.rotate_ms + sc.read_ms);
+        total.pages += sc.pages;
+        total.seeks += sc.seeks;
+        total.seek_ms += sc.seek_ms;
+        total.rotate_ms += sc.rotate_ms;
+        total.read_ms += sc.read_ms;
+    }
+    const double ms = total.seek_ms + total.rotate_ms + total.read_ms;
+    printf("%-40s %6lu %6lu %10.1f %10.1f %10.1f %10.1f\n",
+        "Total", total.pages, total.seeks, total.seek_ms, total.rotate_ms,
+        total.read_ms, ms);
+    printf("Efficiency %.1f%% (time spent reading of the total time)\n",
+        ms > 0 ? 100.0 * total.read_ms / ms : 100.0);
+    return 0;
+}
+
 static void shutdown_fuse()
 {
+    stop_notify();
     delete afs;
     afs = 0;
+    delete imagedir;
+    imagedir = 0;
     if (fuse) {
         if (verbose)
             printf("%s: removing signal handlers\n", __func__);
         fuse_remove_signal_handlers(fuse_get_session(fuse));
     }
+    if (session) {
+        if (verbose)
+            printf("%s: removing signal handlers\n", __func__);
+        fuse_remove_signal_handlers(session);
+        if (chan)
+            fuse_session_remove_chan(chan);
+    }
     if (mountpoint && chan) {
         if (verbose)
             printf("%s: unmounting %s\n", __func__, mountpoint);
@@ -387,12 +1511,22 @@ static void shutdown_fuse()
         fuse_destroy(fuse);
         fuse = 0;
     }
+    if (session) {
+        if (verbose)
+            printf("%s: shutting down fuse session\n", __func__);
+        fuse_session_destroy(session);
+        session = 0;
+    }
     if (fuse_ops) {
         if (verbose)
             printf("%s: releasing fuse ops\n", __func__);
         free(fuse_ops);
         fuse_ops = 0;
     }
+    if (fuse_ll_ops) {
+        free(fuse_ll_ops);
+        fuse_ll_ops = 0;
+    }
     if (verbose)
             printf("%s: releasing fuse args\n", __func__);
     fuse_opt_free_args(&fuse_args);
@@ -409,15 +1543,45 @@ int main(int argc, char *argv[])
     fuse_ops->unlink = unlink_alto;
     fuse_ops->rename = rename_alto;
     fuse_ops->open = open_alto;
+    fuse_ops->release = release_alto;
     fuse_ops->read = read_alto;
     fuse_ops->write = write_alto;
     fuse_ops->mknod = create_alto;
     fuse_ops->truncate = truncate_alto;
+    fuse_ops->fallocate = fallocate_alto;
+    fuse_ops->opendir = opendir_alto;
     fuse_ops->readdir = readdir_alto;
+    fuse_ops->releasedir = releasedir_alto;
     fuse_ops->utimens = utimens_alto;
     fuse_ops->statfs = statfs_alto;
+    fuse_ops->setxattr = setxattr_alto;
+    fuse_ops->flush = flush_alto;
+    fuse_ops->fsync = fsync_alto;
     fuse_ops->init = init_alto;
 
+    fuse_ll_ops = reinterpret_cast<struct fuse_lowlevel_ops *>(calloc(1, sizeof(*fuse_ll_ops)));
+    fuse_ll_ops->init = init_alto_ll;
+    fuse_ll_ops->lookup = lookup_alto_ll;
+    fuse_ll_ops->forget = forget_alto_ll;
+    fuse_ll_ops->getattr = getattr_alto_ll;
+    fuse_ll_ops->setattr = setattr_alto_ll;
+    fuse_ll_ops->mknod = mknod_alto_ll;
+    fuse_ll_ops->create = create_alto_ll;
+    fuse_ll_ops->unlink = unlink_alto_ll;
+    fuse_ll_ops->rename = rename_alto_ll;
+    fuse_ll_ops->open = open_alto_ll;
+    fuse_ll_ops->release = release_alto_ll;
+    fuse_ll_ops->read = read_alto_ll;
+    fuse_ll_ops->write = write_alto_ll;
+    fuse_ll_ops->flush = flush_alto_ll;
+    fuse_ll_ops->fsync = fsync_alto_ll;
+    fuse_ll_ops->opendir = opendir_alto_ll;
+    fuse_ll_ops->readdir = readdir_alto_ll;
+    fuse_ll_ops->releasedir = releasedir_alto_ll;
+    fuse_ll_ops->statfs = statfs_alto_ll;
+    fuse_ll_ops->setxattr = setxattr_alto_ll;
+    fuse_ll_ops->fallocate = fallocate_alto_ll;
+
     atexit(shutdown_fuse);
 
     struct fuse_args a = FUSE_ARGS_INIT(argc, argv);
@@ -428,6 +1592,53 @@ int main(int argc, char *argv[])
         perror("fuse_opt_parse()");
         exit(1);
     }
+    if (shadow)
+        fuse_ops->read_buf = read_buf_alto;
+
+    if (commit) {
+        if (NULL == filenames) {
+            usage(argv[0]);
+            exit(1);
+        }
+        afs = new AltoFS(filenames, verbose, AFS_OVERLAY | (journal ? AFS_JOURNAL : 0));
+        res = afs->commit_overlay();
+        if (res < 0) {
+            fprintf(stderr, "%s: commit failed (%s)\n", filenames, strerror(-res));
+            exit(1);
+        }
+        exit(0);
+    }
+
+    if (defrag) {
+        if (NULL == filenames) {
+            usage(argv[0]);
+            exit(1);
+        }
+        afs_layout layout;
+        layout.set_skew(sector_skew, head_skew, cylinder_skew);
+        afs = new AltoFS(filenames, verbose, (journal ? AFS_JOURNAL : 0) | (overlay ? AFS_OVERLAY : 0));
+        afs->set_layout(layout);
+        res = afs->defragment();
+        if (res < 0) {
+            fprintf(stderr, "%s: defragment failed (%s)\n", filenames, strerror(-res));
+            exit(1);
+        }
+        printf("%s: moved %d files\n", filenames, res);
+        exit(0);
+    }
+
+    if (score) {
+        if (NULL == filenames) {
+            usage(argv[0]);
+            exit(1);
+        }
+        res = score_images();
+        if (res < 0) {
+            fprintf(stderr, "%s: score failed (%s)\n", filenames, strerror(-res));
+            exit(1);
+        }
+        exit(0);
+    }
 
     res = fuse_parse_cmdline(&fuse_args, &mountpoint, &multithreaded, &foreground);
     if (res == -1) {
@@ -447,12 +1658,58 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (lowlevel) {
+        if (NULL == filenames || (0 == stat(filenames, &st) && S_ISDIR(st.st_mode))) {
+            fprintf(stderr, "%s: -o lowlevel serves a single image (pair) only\n", argv[0]);
+            exit(1);
+        }
+        if (entry_timeout < 0)
+            entry_timeout = 1.0;
+        if (attr_timeout < 0)
+            attr_timeout = 1.0;
+    } else {
+        // Pass the timeouts on to the high-level API
+        char opt[64];
+        if (entry_timeout >= 0) {
+            snprintf(opt, sizeof(opt), "-oentry_timeout=%g", entry_timeout);
+            fuse_opt_add_arg(&fuse_args, opt);
+        }
+        if (attr_timeout >= 0) {
+            snprintf(opt, sizeof(opt), "-oattr_timeout=%g", attr_timeout);
+            fuse_opt_add_arg(&fuse_args, opt);
+        }
+    }
+
     chan = fuse_mount(mountpoint, &fuse_args);
     if (0 == chan) {
         perror("fuse_mount()");
         exit(1);
     }
 
+    if (lowlevel) {
+        session = fuse_lowlevel_new(&fuse_args, fuse_ll_ops, sizeof(*fuse_ll_ops), NULL);
+        if (0 == session) {
+            perror("fuse_lowlevel_new()");
+            exit(2);
+        }
+        fuse_session_add_chan(session, chan);
+
+        res = fuse_daemonize(foreground);
+        if (res != -1)
+            res = fuse_set_signal_handlers(session);
+
+        if (res != -1) {
+            if (multithreaded)
+                res = fuse_session_loop_mt(session);
+            else
+                res = fuse_session_loop(session);
+        }
+
+        shutdown_fuse();
+
+        return res;
+    }
+
     fuse = fuse_new(chan, &fuse_args, fuse_ops, sizeof(*fuse_ops), NULL);
     if (0 == fuse) {
         perror("fuse_new()");
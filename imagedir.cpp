@@ -0,0 +1,309 @@
+/*******************************************************************************************
+ *
+ * Directory of Alto disk images
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include <dirent.h>
+#include "imagedir.h"
+
+
+afs_imagedir::afs_imagedir(std::string dirname, int verbosity, int flags, size_t budget) :
+    m_dirname(dirname),
+    m_verbose(verbosity),
+    m_flags(flags),
+    m_budget(budget),
+    m_used(0),
+    m_flush_interval(0),
+    m_flush_threshold(0),
+    m_layout(),
+    m_images(),
+    m_lru()
+{
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_loaded, NULL);
+    scan();
+}
+
+afs_imagedir::~afs_imagedir()
+{
+    std::map<std::string, afs_image_t>::iterator it;
+    for (it = m_images.begin(); it != m_images.end(); it++)
+        unload(it->second);
+    pthread_cond_destroy(&m_loaded);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+std::string afs_imagedir::dirname() const
+{
+    return m_dirname;
+}
+
+/**
+ * @brief Return true, if a file name looks like a disk image
+ *
+ * Images are named *.dsk, or are compressed (.Z or .gz). The files
+ * fuse-alto writes next to images (~, .journal, .overlay) are excluded,
+ * and so are names with a comma, which AltoFS takes for an image pair.
+ *
+ * @param name file name
+ * @return true if it is an image
+ */
+bool afs_imagedir::is_image(const std::string& name)
+{
+    if (std::string::npos != name.find(','))
+        return false;
+    static const char* const exts[] = { ".dsk", ".Z", ".gz", NULL };
+    for (int i = 0; exts[i]; i++) {
+        const size_t len = strlen(exts[i]);
+        if (name.size() > len && 0 == name.compare(name.size() - len, len, exts[i]))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Return the estimated memory of one loaded image
+ * That is the mapped pages, and their shadow if enabled.
+ * @return number of bytes
+ */
+size_t afs_imagedir::image_memory() const
+{
+    size_t size = NPAGES * sizeof(afs_page_t);
+    if (m_flags & AFS_SHADOW)
+        size += NPAGES * PAGESZ;
+    return size;
+}
+
+/**
+ * @brief Scan the directory for images not yet known
+ * @return number of images, or -errno on error
+ */
+int afs_imagedir::scan()
+{
+    DIR* dir = opendir(m_dirname.c_str());
+    if (!dir)
+        return -errno;
+
+    afs_locker lock(&m_mutex);
+    struct dirent* de;
+    while (NULL != (de = readdir(dir))) {
+        std::string name = de->d_name;
+        if (!is_image(name) || m_images.count(name))
+            continue;
+        std::string path = m_dirname + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        afs_image_t img;
+        img.path = path;
+        img.afs = NULL;
+        img.refs = 0;
+        img.loading = false;
+        img.lru = m_lru.end();
+        m_images[name] = img;
+    }
+    closedir(dir);
+    return m_images.size();
+}
+
+/**
+ * @brief Return the names of all images
+ * @return vector of names
+ */
+std::vector<std::string> afs_imagedir::names()
+{
+    afs_locker lock(&m_mutex);
+    std::vector<std::string> result;
+    std::map<std::string, afs_image_t>::const_iterator it;
+    for (it = m_images.begin(); it != m_images.end(); it++)
+        result.push_back(it->first);
+    return result;
+}
+
+/**
+ * @brief Return true, if an image with this name exists
+ * @param name file name of the image
+ * @return true if it exists
+ */
+bool afs_imagedir::exists(std::string name)
+{
+    afs_locker lock(&m_mutex);
+    return m_images.count(name) > 0;
+}
+
+/**
+ * @brief Return the number of loaded images
+ * @return number of images
+ */
+size_t afs_imagedir::loaded()
+{
+    afs_locker lock(&m_mutex);
+    return m_lru.size();
+}
+
+/**
+ * @brief Return the AltoFS for an image, loading it if necessary
+ *
+ * The image becomes the most recently used one. Each successful acquire()
+ * must be followed by a release() of the name.
+ *
+ * The image is loaded with the mutex unlocked; other threads acquiring
+ * the same image wait until it is loaded. Its memory is accounted for
+ * while it is loading.
+ *
+ * @param name file name of the image
+ * @param err if not NULL, receives -ENOENT if there is no such image,
+ *        or -EIO if it can't be loaded
+ * @return pointer to the AltoFS, or NULL on error
+ */
+AltoFS* afs_imagedir::acquire(std::string name, int* err)
+{
+    afs_locker lock(&m_mutex);
+    std::map<std::string, afs_image_t>::iterator it = m_images.find(name);
+    if (it == m_images.end()) {
+        if (err)
+            *err = -ENOENT;
+        return NULL;
+    }
+
+    afs_image_t& img = it->second;
+    while (img.loading)
+        pthread_cond_wait(&m_loaded, &m_mutex);
+    if (img.afs) {
+        m_lru.erase(img.lru);
+    } else {
+        if (access(img.path.c_str(), R_OK) < 0) {
+            if (err)
+                *err = -errno;
+            return NULL;
+        }
+        evict(image_memory());
+        m_used += image_memory();
+        img.loading = true;
+        const std::string path = img.path;
+        const int flush_interval = m_flush_interval;
+        const size_t flush_threshold = m_flush_threshold;
+        const afs_layout layout = m_layout;
+        pthread_mutex_unlock(&m_mutex);
+
+        if (m_verbose)
+            printf("%s: loading %s\n", __func__, path.c_str());
+        AltoFS* afs = new AltoFS(path.c_str(), m_verbose, m_flags | AFS_NOEXIT);
+        if (afs->error() < 0) {
+            printf("%s: can't load %s\n", __func__, path.c_str());
+            delete afs;
+            afs = NULL;
+        } else {
+            afs->start_flush_thread(flush_interval, flush_threshold);
+            afs->set_layout(layout);
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        img.loading = false;
+        pthread_cond_broadcast(&m_loaded);
+        if (!afs) {
+            m_used -= image_memory();
+            if (err)
+                *err = -EIO;
+            return NULL;
+        }
+        img.afs = afs;
+    }
+    m_lru.push_front(name);
+    img.lru = m_lru.begin();
+    img.refs++;
+    return img.afs;
+}
+
+/**
+ * @brief Release an image after a successful acquire()
+ * @param name file name of the image
+ */
+void afs_imagedir::release(std::string name)
+{
+    afs_locker lock(&m_mutex);
+    std::map<std::string, afs_image_t>::iterator it = m_images.find(name);
+    if (it != m_images.end() && it->second.refs > 0)
+        it->second.refs--;
+}
+
+/**
+ * @brief Set the flush interval and threshold for the images loaded from now on
+ * @param interval flush interval in seconds
+ * @param threshold number of dirty pages
+ */
+void afs_imagedir::set_flush(int interval, size_t threshold)
+{
+    afs_locker lock(&m_mutex);
+    m_flush_interval = interval;
+    m_flush_threshold = threshold;
+}
+
+/**
+ * @brief Set the layout for the images loaded from now on
+ * @param layout layout with the sector, head and cylinder skew
+ */
+void afs_imagedir::set_layout(const afs_layout& layout)
+{
+    afs_locker lock(&m_mutex);
+    m_layout = layout;
+}
+
+/**
+ * @brief Flush all loaded images
+ * @param sync if false, the changes are only stored in the disk image pages
+ * @return 0 on success, or the first error
+ */
+int afs_imagedir::flush(bool sync)
+{
+    afs_locker lock(&m_mutex);
+    int res = 0;
+    std::list<std::string>::const_iterator it;
+    for (it = m_lru.begin(); it != m_lru.end(); it++) {
+        int err = m_images[*it].afs->flush(sync);
+        if (0 == res)
+            res = err;
+    }
+    return res;
+}
+
+/**
+ * @brief Unload least recently used images until need more bytes fit into the budget
+ * @param need number of bytes about to be used
+ */
+void afs_imagedir::evict(size_t need)
+{
+    if (0 == m_budget)
+        return;
+    std::list<std::string>::iterator it = m_lru.end();
+    while (m_used + need > m_budget && it != m_lru.begin()) {
+        --it;
+        afs_image_t& img = m_images[*it];
+        if (img.refs > 0)
+            continue;
+        if (m_verbose)
+            printf("%s: unloading %s\n", __func__, img.path.c_str());
+        // unload() erases the iterator
+        std::list<std::string>::iterator next = it;
+        ++next;
+        unload(img);
+        it = next;
+    }
+}
+
+/**
+ * @brief Destroy the AltoFS of an image, which flushes it
+ * @param img reference to the image information
+ */
+void afs_imagedir::unload(afs_image_t& img)
+{
+    if (!img.afs)
+        return;
+    delete img.afs;
+    img.afs = NULL;
+    m_lru.erase(img.lru);
+    img.lru = m_lru.end();
+    m_used -= image_memory();
+}
@@ -0,0 +1,83 @@
+/*******************************************************************************************
+ *
+ * Directory of Alto disk images
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_IMAGEDIR_H_)
+#define _IMAGEDIR_H_
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "altofs.h"
+
+/**
+ * @brief Class to serve every disk image in a host directory
+ *
+ * Each image file in the directory is known by its file name.
+ * The AltoFS for an image is created on the first acquire(),
+ * and the least recently used images are destroyed (flushed and
+ * unmapped) when the estimated memory of the loaded images exceeds
+ * the budget. Images in use, i.e. acquired and not yet released,
+ * are never evicted. An image is loaded with the mutex unlocked, so
+ * the other images stay usable meanwhile, and an image which can't
+ * be loaded fails with -EIO instead of stopping the program.
+ */
+class afs_imagedir
+{
+public:
+    afs_imagedir(std::string dirname, int verbosity = 0, int flags = 0, size_t budget = 0);
+    ~afs_imagedir();
+
+    std::string dirname() const;
+    int scan();
+    std::vector<std::string> names();
+    bool exists(std::string name);
+    size_t loaded();
+
+    AltoFS* acquire(std::string name, int* err = NULL);
+    void release(std::string name);
+
+    void set_flush(int interval, size_t threshold);
+    void set_layout(const afs_layout& layout);
+    int flush(bool sync = true);
+
+private:
+    afs_imagedir(const afs_imagedir&);
+    afs_imagedir& operator=(const afs_imagedir&);
+
+    /**
+     * @brief Information about one image in the directory
+     */
+    typedef struct {
+        std::string path;               //!< Host path of the image file
+        AltoFS* afs;                    //!< The file system, if loaded, or NULL
+        int refs;                       //!< Number of acquire() calls not yet released
+        bool loading;                   //!< True, while a thread is loading the image
+        std::list<std::string>::iterator lru;  //!< Position in m_lru, if loaded
+    }   afs_image_t;
+
+    static bool is_image(const std::string& name);
+    size_t image_memory() const;
+    void evict(size_t need);
+    void unload(afs_image_t& img);
+
+    std::string m_dirname;              //!< Host directory of the images
+    int m_verbose;                      //!< Verbosity passed to AltoFS
+    int m_flags;                        //!< Flags passed to AltoFS
+    size_t m_budget;                    //!< Memory budget for loaded images in bytes; 0 = unlimited
+    size_t m_used;                      //!< Estimated memory of the loaded images
+    int m_flush_interval;               //!< Flush interval for loaded images
+    size_t m_flush_threshold;           //!< Flush threshold for loaded images
+    afs_layout m_layout;                //!< Layout for loaded images
+    std::map<std::string, afs_image_t> m_images;    //!< Images by name
+    std::list<std::string> m_lru;       //!< Names of the loaded images, most recently used first
+    pthread_mutex_t m_mutex;            //!< Mutex protecting the above
+    pthread_cond_t m_loaded;            //!< Signalled when an image has finished loading
+};
+
+#endif // !defined(_IMAGEDIR_H_)
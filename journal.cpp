@@ -0,0 +1,267 @@
+/*******************************************************************************************
+ *
+ * Alto file system metadata journal
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include "journal.h"
+
+/**
+ * @brief Size of one page record: the vda and the page contents
+ */
+#define JOURNAL_RECORD_SIZE (sizeof(uint32_t) + sizeof(afs_page_t))
+
+afs_journal::afs_journal() :
+    m_name(),
+    m_fd(-1),
+    m_readonly(false),
+    m_serial(1),
+    m_buffer(),
+    m_txn_start(0),
+    m_txn_pages(0),
+    m_pending(0)
+{
+}
+
+afs_journal::~afs_journal()
+{
+    close();
+}
+
+std::string afs_journal::name() const
+{
+    return m_name;
+}
+
+bool afs_journal::is_open() const
+{
+    return m_fd >= 0;
+}
+
+/**
+ * @brief Return the number of committed transactions not yet written
+ * @return number of transactions
+ */
+size_t afs_journal::pending() const
+{
+    return m_pending;
+}
+
+/**
+ * @brief Open or create the journal file
+ * @param name file name of the journal
+ * @param readonly if true, the journal is opened for replay only
+ * @return 0 on success, or -errno on error
+ */
+int afs_journal::open(std::string name, bool readonly)
+{
+    close();
+    m_name = name;
+    m_readonly = readonly;
+    if (readonly) {
+        m_fd = ::open(name.c_str(), O_RDONLY);
+        // A missing journal is an empty journal
+        if (m_fd < 0 && ENOENT == errno)
+            return 0;
+    } else {
+        m_fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    }
+    if (m_fd < 0)
+        return -errno;
+    return 0;
+}
+
+/**
+ * @brief Close the journal file, dropping transactions not yet written
+ */
+void afs_journal::close()
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_buffer.clear();
+    m_txn_start = 0;
+    m_txn_pages = 0;
+    m_pending = 0;
+}
+
+/**
+ * @brief Read back the page images of all complete transactions
+ *
+ * Reading stops at the first transaction which is incomplete, has no
+ * commit record or fails its checksum; it and everything after it is
+ * discarded. Unless the journal is only replayed, the file is truncated
+ * to the valid transactions, as sync() appends to it and transactions
+ * after the garbage would never be replayed.
+ *
+ * @param pages vector to append the page images to, in journal order
+ * @return number of transactions found, or -errno on error
+ */
+int afs_journal::replay(std::vector<afs_journal_page_t>& pages)
+{
+    if (m_fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(m_fd, &st) < 0)
+        return -errno;
+    std::vector<char> data(st.st_size);
+    if (st.st_size > 0 && pread(m_fd, data.data(), st.st_size, 0) != st.st_size)
+        return -EIO;
+
+    int count = 0;
+    size_t offs = 0;
+    while (offs + sizeof(afs_journal_txn_t) <= data.size()) {
+        afs_journal_txn_t txn;
+        memcpy(&txn, &data[offs], sizeof(txn));
+        if (txn.magic != JOURNAL_TXN_MAGIC)
+            break;
+        const size_t records = offs + sizeof(txn);
+        const size_t size = txn.npages * JOURNAL_RECORD_SIZE;
+        if (records + size + sizeof(afs_journal_commit_t) > data.size())
+            break;
+        afs_journal_commit_t cr;
+        memcpy(&cr, &data[records + size], sizeof(cr));
+        if (cr.magic != JOURNAL_COMMIT_MAGIC || cr.serial != txn.serial)
+            break;
+        if (checksum(&data[records], size) != txn.checksum)
+            break;
+
+        for (uint32_t i = 0; i < txn.npages; i++) {
+            const char* rec = &data[records + i * JOURNAL_RECORD_SIZE];
+            uint32_t vda;
+            afs_journal_page_t jp;
+            memcpy(&vda, rec, sizeof(vda));
+            jp.vda = vda;
+            memcpy(&jp.page, rec + sizeof(vda), sizeof(jp.page));
+            pages.push_back(jp);
+        }
+        m_serial = txn.serial + 1;
+        offs = records + size + sizeof(afs_journal_commit_t);
+        count++;
+    }
+
+    if (!m_readonly && offs < data.size()) {
+        if (ftruncate(m_fd, offs) < 0)
+            return -errno;
+        if (fdatasync(m_fd) < 0)
+            return -errno;
+    }
+    return count;
+}
+
+/**
+ * @brief Begin a new transaction in the buffer
+ */
+void afs_journal::begin()
+{
+    m_txn_start = m_buffer.size();
+    m_txn_pages = 0;
+    m_buffer.resize(m_txn_start + sizeof(afs_journal_txn_t));
+}
+
+/**
+ * @brief Add the after-image of a page to the open transaction
+ * @param vda page number
+ * @param page pointer to the page contents
+ */
+void afs_journal::add(page_t vda, const afs_page_t* page)
+{
+    const uint32_t v = vda;
+    const size_t offs = m_buffer.size();
+    m_buffer.resize(offs + JOURNAL_RECORD_SIZE);
+    memcpy(&m_buffer[offs], &v, sizeof(v));
+    memcpy(&m_buffer[offs + sizeof(v)], page, sizeof(*page));
+    m_txn_pages++;
+}
+
+/**
+ * @brief Close the open transaction with a commit record
+ * The transaction is durable only after the next sync().
+ */
+void afs_journal::commit()
+{
+    const size_t records = m_txn_start + sizeof(afs_journal_txn_t);
+    afs_journal_txn_t txn;
+    txn.magic = JOURNAL_TXN_MAGIC;
+    txn.serial = m_serial;
+    txn.npages = m_txn_pages;
+    txn.checksum = checksum(&m_buffer[records], m_buffer.size() - records);
+    memcpy(&m_buffer[m_txn_start], &txn, sizeof(txn));
+
+    afs_journal_commit_t cr;
+    cr.magic = JOURNAL_COMMIT_MAGIC;
+    cr.serial = m_serial;
+    const size_t offs = m_buffer.size();
+    m_buffer.resize(offs + sizeof(cr));
+    memcpy(&m_buffer[offs], &cr, sizeof(cr));
+
+    m_serial++;
+    m_pending++;
+}
+
+/**
+ * @brief Append all committed transactions to the journal file and make them durable
+ * @return 0 on success, or -errno on error
+ */
+int afs_journal::sync()
+{
+    if (m_fd < 0 || m_readonly || m_buffer.empty())
+        return 0;
+
+    off_t offs = lseek(m_fd, 0, SEEK_END);
+    if (offs < 0)
+        return -errno;
+    const char* dp = m_buffer.data();
+    size_t total = m_buffer.size();
+    size_t totalbytes = 0;
+    while (totalbytes < total) {
+        ssize_t bytes = pwrite(m_fd, dp, total - totalbytes, offs);
+        if (bytes < 0) {
+            if (EINTR == errno)
+                continue;
+            return -errno;
+        }
+        dp += bytes;
+        offs += bytes;
+        totalbytes += bytes;
+    }
+    if (fdatasync(m_fd) < 0)
+        return -errno;
+    m_buffer.clear();
+    m_pending = 0;
+    return 0;
+}
+
+/**
+ * @brief Truncate the journal after the disk image was synced
+ * @return 0 on success, or -errno on error
+ */
+int afs_journal::checkpoint()
+{
+    if (m_fd < 0 || m_readonly)
+        return 0;
+    if (ftruncate(m_fd, 0) < 0)
+        return -errno;
+    if (fdatasync(m_fd) < 0)
+        return -errno;
+    return 0;
+}
+
+/**
+ * @brief Compute a FNV-1a checksum
+ * @param data pointer to the data
+ * @param size number of bytes
+ * @return 32 bit checksum
+ */
+uint32_t afs_journal::checksum(const char* data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
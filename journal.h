@@ -0,0 +1,92 @@
+/*******************************************************************************************
+ *
+ * Alto file system metadata journal
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_JOURNAL_H_)
+#define _JOURNAL_H_
+
+#include <string>
+#include <vector>
+
+#include "afs_types.h"
+
+#define JOURNAL_TXN_MAGIC       0x58544a41  //!< "AJTX" in a transaction header
+#define JOURNAL_COMMIT_MAGIC    0x4d434a41  //!< "AJCM" in a commit record
+
+/**
+ * @brief Header of a transaction in the journal file.
+ * It is followed by npages times the page's vda (uint32_t)
+ * and the page's contents (afs_page_t), then by a commit record.
+ */
+typedef struct {
+    uint32_t    magic;                  //!< JOURNAL_TXN_MAGIC
+    uint32_t    serial;                 //!< Serial number of the transaction
+    uint32_t    npages;                 //!< Number of page records
+    uint32_t    checksum;               //!< FNV-1a checksum of the page records
+}   afs_journal_txn_t;
+
+/**
+ * @brief Commit record ending a transaction
+ */
+typedef struct {
+    uint32_t    magic;                  //!< JOURNAL_COMMIT_MAGIC
+    uint32_t    serial;                 //!< Serial number of the transaction
+}   afs_journal_commit_t;
+
+/**
+ * @brief A page image read back from the journal
+ */
+typedef struct {
+    page_t      vda;                    //!< Page number
+    afs_page_t  page;                   //!< Contents of the page after the transaction
+}   afs_journal_page_t;
+
+/**
+ * @brief Class to keep an append-only write-ahead journal of page images
+ *
+ * Each transaction records the after-images of all pages it modified.
+ * Committed transactions are buffered and written with a single
+ * fdatasync() (group commit). Once the disk image itself was synced,
+ * the journal is truncated (checkpoint).
+ */
+class afs_journal
+{
+public:
+    afs_journal();
+    ~afs_journal();
+
+    std::string name() const;
+    bool is_open() const;
+    size_t pending() const;
+
+    int open(std::string name, bool readonly = false);
+    void close();
+    int replay(std::vector<afs_journal_page_t>& pages);
+
+    void begin();
+    void add(page_t vda, const afs_page_t* page);
+    void commit();
+
+    int sync();
+    int checkpoint();
+
+private:
+    afs_journal(const afs_journal&);
+    afs_journal& operator=(const afs_journal&);
+
+    static uint32_t checksum(const char* data, size_t size);
+
+    std::string m_name;                 //!< File name of the journal
+    int m_fd;                           //!< File descriptor of the journal, or -1
+    bool m_readonly;                    //!< True, if the journal is only replayed
+    uint32_t m_serial;                  //!< Serial number of the next transaction
+    std::vector<char> m_buffer;         //!< Committed transactions not yet written
+    size_t m_txn_start;                 //!< Offset of the open transaction in m_buffer
+    uint32_t m_txn_pages;               //!< Number of pages in the open transaction
+    size_t m_pending;                   //!< Number of committed transactions in m_buffer
+};
+
+#endif // !defined(_JOURNAL_H_)
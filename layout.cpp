@@ -0,0 +1,126 @@
+/*******************************************************************************************
+ *
+ * Page layout and timing model of the Diablo disk drive
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include <math.h>
+#include <algorithm>
+#include "layout.h"
+
+afs_layout::afs_layout() :
+    m_sector_skew(0),
+    m_head_skew(0),
+    m_cylinder_skew(0)
+{
+}
+
+/**
+ * @brief Set the skews
+ * @param sector number of sectors to leave out between pages
+ * @param head additional number of sectors to leave out when switching heads
+ * @param cylinder additional number of sectors to leave out when seeking to the next cylinder
+ */
+void afs_layout::set_skew(int sector, int head, int cylinder)
+{
+    m_sector_skew = std::max(0, sector) % NSECS;
+    m_head_skew = std::max(0, head) % NSECS;
+    m_cylinder_skew = std::max(0, cylinder) % NSECS;
+}
+
+int afs_layout::sector_skew() const
+{
+    return m_sector_skew;
+}
+
+int afs_layout::head_skew() const
+{
+    return m_head_skew;
+}
+
+int afs_layout::cylinder_skew() const
+{
+    return m_cylinder_skew;
+}
+
+/**
+ * @brief Return true, if all skews are 0, i.e. pages follow each other by VDA
+ * @return true if linear
+ */
+bool afs_layout::linear() const
+{
+    return 0 == m_sector_skew && 0 == m_head_skew && 0 == m_cylinder_skew;
+}
+
+/**
+ * @brief Return the preferred VDA of the page following the page vda
+ * @param vda page number
+ * @return page number, or -1 if the page would be beyond the last cylinder
+ */
+page_t afs_layout::next(page_t vda) const
+{
+    const page_t disk = vda / NPAGES;
+    const page_t page = vda % NPAGES;
+    page_t cylinder = page / CYLPAGES;
+    page_t head = (page / NSECS) % NHEADS;
+    page_t sector = page % NSECS + 1 + m_sector_skew;
+    if (sector >= NSECS) {
+        if (++head < NHEADS) {
+            sector += m_head_skew;
+        } else {
+            head = 0;
+            cylinder++;
+            sector += m_cylinder_skew;
+        }
+        sector %= NSECS;
+    }
+    if (cylinder >= NCYLS)
+        return -1;
+    return disk * NPAGES + cylinder * CYLPAGES + head * NSECS + sector;
+}
+
+/**
+ * @brief Compute the expected time to access the page to after the page from was read
+ *
+ * The skews are taken as the delays of the drive: processing a page takes
+ * sector_skew sectors, switching heads another head_skew sectors. Seeking
+ * takes from DIABLO_SEEK_MIN_MS for the next cylinder up to DIABLO_SEEK_MAX_MS
+ * across all cylinders; changing to the other drive of a double disk is
+ * counted as an average seek. Then the drive waits for the sector to
+ * come around and reads it.
+ *
+ * @param from page number of the page read before
+ * @param to page number of the page to access
+ * @param acc pointer to a afs_access_t to receive the times
+ */
+void afs_layout::access(page_t from, page_t to, afs_access_t* acc) const
+{
+    const page_t pf = from % NPAGES;
+    const page_t pt = to % NPAGES;
+    const page_t cf = pf / CYLPAGES;
+    const page_t ct = pt / CYLPAGES;
+
+    // Time (in ms, from the start of the revolution) when the drive is ready
+    double ready = (pf % NSECS + 1 + m_sector_skew) * DIABLO_SECTOR_MS;
+    acc->seek = true;
+    acc->seek_ms = 0.0;
+    if (from / NPAGES != to / NPAGES) {
+        acc->seek_ms = DIABLO_SEEK_AVG_MS;
+    } else if (cf != ct) {
+        const page_t dist = cf > ct ? cf - ct : ct - cf;
+        acc->seek_ms = DIABLO_SEEK_MIN_MS +
+            (DIABLO_SEEK_MAX_MS - DIABLO_SEEK_MIN_MS) * (dist - 1) / (NCYLS - 2);
+    } else {
+        acc->seek = false;
+        if (pf / NSECS != pt / NSECS)
+            ready += m_head_skew * DIABLO_SECTOR_MS;
+    }
+    ready += acc->seek_ms;
+
+    double wait = (pt % NSECS) * DIABLO_SECTOR_MS - fmod(ready, DIABLO_REVOLUTION_MS);
+    while (wait < -1e-6)
+        wait += DIABLO_REVOLUTION_MS;
+    acc->rotate_ms = std::max(0.0, wait);
+    acc->read_ms = DIABLO_SECTOR_MS;
+}
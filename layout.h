@@ -0,0 +1,72 @@
+/*******************************************************************************************
+ *
+ * Page layout and timing model of the Diablo disk drive
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_LAYOUT_H_)
+#define _LAYOUT_H_
+
+#include "afs_types.h"
+
+#define DIABLO_REVOLUTION_MS    40.0    //!< Time for one revolution (1500 rpm)
+#define DIABLO_SECTOR_MS        (DIABLO_REVOLUTION_MS / NSECS)  //!< Time for one sector to pass the head
+#define DIABLO_SEEK_MIN_MS      15.0    //!< Time to seek to the next cylinder
+#define DIABLO_SEEK_MAX_MS      135.0   //!< Time to seek across all cylinders
+#define DIABLO_SEEK_AVG_MS      70.0    //!< Average seek time, used when changing drives
+
+/**
+ * @brief Expected time to access a page after another one
+ */
+typedef struct {
+    double      seek_ms;                //!< Time spent seeking to the cylinder
+    double      rotate_ms;              //!< Time spent waiting for the sector to come around
+    double      read_ms;                //!< Time spent reading the sector
+    bool        seek;                   //!< True if a seek was required
+}   afs_access_t;
+
+/**
+ * @brief Expected time to read all pages of a file in order
+ */
+typedef struct {
+    size_t      pages;                  //!< Number of pages including the leader page
+    size_t      seeks;                  //!< Number of seeks
+    double      seek_ms;                //!< Total time spent seeking
+    double      rotate_ms;              //!< Total time spent waiting for sectors
+    double      read_ms;                //!< Total time spent reading sectors
+}   afs_score_t;
+
+/**
+ * @brief Class to place the pages of a file with a sector, head and cylinder skew
+ *
+ * A VDA counts the sectors of a track, then the heads of a cylinder, then
+ * the cylinders of a drive (see AltoFS::vda_to_rda()). The skews are the
+ * number of sectors to leave out between two consecutive pages of a file:
+ * after each page on the same track, and additionally when switching to
+ * the next head or to the next cylinder, so that an emulated Diablo which
+ * needs time to process a page, switch heads or seek doesn't miss the
+ * next page and wait for a whole revolution. With all skews 0 the next
+ * page is the next VDA.
+ */
+class afs_layout
+{
+public:
+    afs_layout();
+
+    void set_skew(int sector, int head, int cylinder);
+    int sector_skew() const;
+    int head_skew() const;
+    int cylinder_skew() const;
+    bool linear() const;
+
+    page_t next(page_t vda) const;
+    void access(page_t from, page_t to, afs_access_t* acc) const;
+
+private:
+    int m_sector_skew;                  //!< Sectors to leave out between pages
+    int m_head_skew;                    //!< Additional sectors to leave out when switching heads
+    int m_cylinder_skew;                //!< Additional sectors to leave out when seeking to the next cylinder
+};
+
+#endif // !defined(_LAYOUT_H_)
@@ -0,0 +1,70 @@
+/*******************************************************************************************
+ *
+ * Mutex and reader/writer lock helpers
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include "locks.h"
+
+afs_rwlock::afs_rwlock() :
+    m_rwlock(),
+    m_writer(pthread_t()),
+    m_depth(0)
+{
+    pthread_rwlock_init(&m_rwlock, NULL);
+}
+
+afs_rwlock::~afs_rwlock()
+{
+    pthread_rwlock_destroy(&m_rwlock);
+}
+
+/**
+ * @brief Return true, if the calling thread holds the lock exclusive
+ *
+ * Only the writer itself stores its thread id, and it resets the depth
+ * before unlocking, so another thread never sees itself as the owner.
+ */
+bool afs_rwlock::owned() const
+{
+    return m_depth > 0 && pthread_equal(m_writer, pthread_self());
+}
+
+/**
+ * @brief Lock shared, or nest into the exclusive lock of the calling thread
+ */
+void afs_rwlock::lock_shared()
+{
+    if (owned()) {
+        m_depth++;
+        return;
+    }
+    pthread_rwlock_rdlock(&m_rwlock);
+}
+
+/**
+ * @brief Lock exclusive, or nest into the exclusive lock of the calling thread
+ */
+void afs_rwlock::lock()
+{
+    if (owned()) {
+        m_depth++;
+        return;
+    }
+    pthread_rwlock_wrlock(&m_rwlock);
+    m_writer = pthread_self();
+    m_depth = 1;
+}
+
+/**
+ * @brief Unlock one level of a shared or exclusive lock
+ */
+void afs_rwlock::unlock()
+{
+    if (owned()) {
+        if (--m_depth > 0)
+            return;
+    }
+    pthread_rwlock_unlock(&m_rwlock);
+}
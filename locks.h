@@ -0,0 +1,90 @@
+/*******************************************************************************************
+ *
+ * Mutex and reader/writer lock helpers
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_LOCKS_H_)
+#define _LOCKS_H_
+
+#include <pthread.h>
+#include <atomic>
+
+/**
+ * @brief Class to hold a pthread mutex locked while in scope
+ */
+class afs_locker
+{
+public:
+    afs_locker(pthread_mutex_t* mutex) : m_mutex(mutex) { pthread_mutex_lock(m_mutex); }
+    ~afs_locker() { pthread_mutex_unlock(m_mutex); }
+private:
+    pthread_mutex_t* m_mutex;
+};
+
+/**
+ * @brief Class to hold a pthread rwlock locked shared or exclusive while in scope
+ */
+class afs_rwlocker
+{
+public:
+    afs_rwlocker(pthread_rwlock_t* rwlock, bool write = false) : m_rwlock(rwlock)
+    {
+        if (write)
+            pthread_rwlock_wrlock(m_rwlock);
+        else
+            pthread_rwlock_rdlock(m_rwlock);
+    }
+    ~afs_rwlocker() { pthread_rwlock_unlock(m_rwlock); }
+private:
+    pthread_rwlock_t* m_rwlock;
+};
+
+/**
+ * @brief Reader/writer lock which the writer may lock again
+ *
+ * The thread holding the lock exclusive may lock it again, shared or
+ * exclusive, e.g. when a metadata operation calls read_file() or
+ * write_file(). Readers may nest, as the lock prefers readers.
+ * A reader must never try to lock it exclusive.
+ */
+class afs_rwlock
+{
+public:
+    afs_rwlock();
+    ~afs_rwlock();
+
+    void lock_shared();
+    void lock();
+    void unlock();
+
+private:
+    afs_rwlock(const afs_rwlock&);
+    afs_rwlock& operator=(const afs_rwlock&);
+    bool owned() const;
+
+    pthread_rwlock_t m_rwlock;          //!< The lock
+    std::atomic<pthread_t> m_writer;    //!< Thread holding the lock exclusive, if m_depth > 0
+    std::atomic<int> m_depth;           //!< Nesting depth of the writer
+};
+
+/**
+ * @brief Class to hold an afs_rwlock locked shared or exclusive while in scope
+ */
+class afs_fslocker
+{
+public:
+    afs_fslocker(afs_rwlock* rwlock, bool write = false) : m_rwlock(rwlock)
+    {
+        if (write)
+            m_rwlock->lock();
+        else
+            m_rwlock->lock_shared();
+    }
+    ~afs_fslocker() { m_rwlock->unlock(); }
+private:
+    afs_rwlock* m_rwlock;
+};
+
+#endif // !defined(_LOCKS_H_)
@@ -0,0 +1,141 @@
+/*******************************************************************************************
+ *
+ * Host byte order shadow of the disk image pages
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include <sys/mman.h>
+#include "shadow.h"
+
+afs_shadow::afs_shadow() :
+    m_fd(-1),
+    m_data(0),
+    m_size(0),
+    m_valid()
+{
+}
+
+afs_shadow::~afs_shadow()
+{
+    close();
+}
+
+/**
+ * @brief Create and map the memory file
+ * @param npages number of pages
+ * @return 0 on success, or -errno on error
+ */
+int afs_shadow::open(size_t npages)
+{
+    close();
+#if defined(MFD_CLOEXEC)
+    m_fd = memfd_create("fuse-alto-shadow", MFD_CLOEXEC);
+#endif
+    if (m_fd < 0) {
+        char name[] = "/tmp/fuse-alto-shadow-XXXXXX";
+        m_fd = mkstemp(name);
+        if (m_fd < 0)
+            return -errno;
+        unlink(name);
+    }
+
+    m_size = npages * PAGESZ;
+    if (ftruncate(m_fd, m_size) < 0) {
+        int res = -errno;
+        close();
+        return res;
+    }
+    void* data = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (MAP_FAILED == data) {
+        int res = -errno;
+        close();
+        return res;
+    }
+    m_data = reinterpret_cast<char *>(data);
+    m_valid.assign(npages, false);
+    return 0;
+}
+
+/**
+ * @brief Unmap and close the memory file
+ */
+void afs_shadow::close()
+{
+    if (m_data)
+        munmap(m_data, m_size);
+    m_data = 0;
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+    m_size = 0;
+    m_valid.clear();
+}
+
+/**
+ * @brief Return true, if the shadow is open
+ * @return true if open
+ */
+bool afs_shadow::is_open() const
+{
+    return 0 != m_data;
+}
+
+/**
+ * @brief Return the file descriptor of the memory file
+ * @return file descriptor, or -1 if not open
+ */
+int afs_shadow::fd() const
+{
+    return m_fd;
+}
+
+/**
+ * @brief Return a pointer to the shadow of page vda
+ * @param vda page number
+ * @return pointer to PAGESZ bytes
+ */
+char* afs_shadow::page(page_t vda)
+{
+    return m_data + vda * PAGESZ;
+}
+
+/**
+ * @brief Return the position of the shadow of page vda in the memory file
+ * @param vda page number
+ * @return file position
+ */
+off_t afs_shadow::pos(page_t vda) const
+{
+    return (off_t)vda * PAGESZ;
+}
+
+/**
+ * @brief Return true, if the shadow of page vda is up to date
+ * @param vda page number
+ * @return true if valid
+ */
+bool afs_shadow::valid(page_t vda) const
+{
+    return (size_t)vda < m_valid.size() && m_valid[vda];
+}
+
+/**
+ * @brief Mark the shadow of page vda as filled and up to date
+ * @param vda page number
+ */
+void afs_shadow::validate(page_t vda)
+{
+    if ((size_t)vda < m_valid.size())
+        m_valid[vda] = true;
+}
+
+/**
+ * @brief Mark the shadow of page vda as out of date
+ * @param vda page number
+ */
+void afs_shadow::invalidate(page_t vda)
+{
+    if ((size_t)vda < m_valid.size())
+        m_valid[vda] = false;
+}
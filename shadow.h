@@ -0,0 +1,51 @@
+/*******************************************************************************************
+ *
+ * Host byte order shadow of the disk image pages
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_SHADOW_H_)
+#define _SHADOW_H_
+
+#include <vector>
+
+#include "afs_types.h"
+
+/**
+ * @brief Class to keep the data of disk image pages in host byte order
+ *
+ * The shadow is a memory file (memfd, or an unlinked temporary file)
+ * mapped shared, with PAGESZ bytes for each page. A page is filled on
+ * first use and invalidated when the disk image page is modified. As
+ * the data is in a file, readers can splice it to the kernel from the
+ * file descriptor without copying it in user space.
+ */
+class afs_shadow
+{
+public:
+    afs_shadow();
+    ~afs_shadow();
+
+    int open(size_t npages);
+    void close();
+    bool is_open() const;
+    int fd() const;
+
+    char* page(page_t vda);
+    off_t pos(page_t vda) const;
+    bool valid(page_t vda) const;
+    void validate(page_t vda);
+    void invalidate(page_t vda);
+
+private:
+    afs_shadow(const afs_shadow&);
+    afs_shadow& operator=(const afs_shadow&);
+
+    int m_fd;                           //!< File descriptor of the memory file
+    char* m_data;                       //!< Mapped memory file
+    size_t m_size;                      //!< Size of the mapping in bytes
+    std::vector<bool> m_valid;          //!< True for pages which are filled and up to date
+};
+
+#endif // !defined(_SHADOW_H_)
@@ -0,0 +1,251 @@
+/*******************************************************************************************
+ *
+ * Immutable directory snapshots and their epoch based reclamation
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include "snapshot.h"
+#include "fileinfo.h"
+
+/**
+ * @brief The outermost section a thread is in, so that nested sections reuse its slot
+ */
+typedef struct {
+    const afs_epoch* epoch;             //!< Epoch of the section, or NULL
+    int slot;                           //!< Slot returned by enter()
+    int depth;                          //!< Number of nested sections
+}   afs_epoch_section_t;
+
+static thread_local afs_epoch_section_t section = { NULL, 0, 0 };
+
+afs_dirsnap::afs_dirsnap(const std::vector<afs_fileinfo*>& children) :
+    m_refs(1),
+    m_entries(),
+    m_index(),
+    m_inodes()
+{
+    m_entries.reserve(children.size());
+    m_index.reserve(children.size());
+    m_inodes.reserve(children.size());
+    for (size_t i = 0; i < children.size(); i++) {
+        afs_dirsnap_entry_t ent;
+        ent.name = children[i]->name();
+        ent.info = children[i];
+        ent.deleted = children[i]->deleted();
+        m_entries.push_back(ent);
+        // The first child of a name is the one found
+        m_index.insert(std::make_pair(ent.name, i));
+        m_inodes.insert(std::make_pair(children[i]->statIno(), i));
+    }
+}
+
+afs_dirsnap::~afs_dirsnap()
+{
+}
+
+/**
+ * @brief Take another reference to the snapshot
+ */
+void afs_dirsnap::ref()
+{
+    m_refs.fetch_add(1);
+}
+
+/**
+ * @brief Drop a reference to the snapshot, and delete it if it was the last one
+ */
+void afs_dirsnap::unref()
+{
+    if (1 == m_refs.fetch_sub(1))
+        delete this;
+}
+
+size_t afs_dirsnap::size() const
+{
+    return m_entries.size();
+}
+
+const afs_dirsnap_entry_t& afs_dirsnap::entry(size_t idx) const
+{
+    return m_entries.at(idx);
+}
+
+/**
+ * @brief Find a child node by name
+ * If more than one child has the name, the first one is returned.
+ * @param name file name
+ * @return pointer to the child node, or NULL if not found
+ */
+afs_fileinfo* afs_dirsnap::find(const std::string& name) const
+{
+    std::unordered_map<std::string, size_t>::const_iterator it = m_index.find(name);
+    if (it == m_index.end())
+        return NULL;
+    return m_entries[it->second].info;
+}
+
+/**
+ * @brief Find a child node by inode number, i.e. its leader page VDA
+ * @param ino inode number
+ * @return pointer to the child node, or NULL if not found
+ */
+afs_fileinfo* afs_dirsnap::find_inode(ino_t ino) const
+{
+    std::unordered_map<ino_t, size_t>::const_iterator it = m_inodes.find(ino);
+    if (it == m_inodes.end())
+        return NULL;
+    return m_entries[it->second].info;
+}
+
+afs_epoch::afs_epoch() :
+    m_epoch(1),
+    m_slots(),
+    m_mutex(),
+    m_retired(),
+    m_overflow(0)
+{
+    for (int i = 0; i < SLOTS; i++)
+        m_slots[i].epoch = 0;
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+afs_epoch::~afs_epoch()
+{
+    for (size_t i = 0; i < m_retired.size(); i++) {
+        if (m_retired[i].snap)
+            m_retired[i].snap->unref();
+        delete m_retired[i].st;
+    }
+    m_retired.clear();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * @brief Enter a reader section
+ *
+ * A section nested in one the thread already entered reuses its slot.
+ * Otherwise the current epoch is stored in a free slot, starting at one
+ * picked by the thread id, so that readers rarely share a cache line.
+ * If all slots are taken, the reader is counted in m_overflow instead.
+ *
+ * @return slot number to pass to leave(), or SLOTS for the overflow
+ */
+int afs_epoch::enter()
+{
+    if (section.depth > 0 && section.epoch == this) {
+        section.depth++;
+        return section.slot;
+    }
+
+    const uint64_t epoch = m_epoch.load();
+    int slot = (int)((size_t)pthread_self() / 64 % SLOTS);
+    int i;
+    for (i = 0; i < SLOTS; i++) {
+        uint64_t unused = 0;
+        if (m_slots[slot].epoch.compare_exchange_strong(unused, epoch))
+            break;
+        slot = (slot + 1) % SLOTS;
+    }
+    if (i == SLOTS) {
+        pthread_mutex_lock(&m_mutex);
+        m_overflow++;
+        pthread_mutex_unlock(&m_mutex);
+        slot = SLOTS;
+    }
+
+    if (0 == section.depth) {
+        section.epoch = this;
+        section.slot = slot;
+        section.depth = 1;
+    }
+    return slot;
+}
+
+/**
+ * @brief Leave a reader section
+ * @param slot slot number returned by enter()
+ */
+void afs_epoch::leave(int slot)
+{
+    if (section.depth > 0 && section.epoch == this && section.slot == slot) {
+        if (--section.depth > 0)
+            return;
+        section.epoch = NULL;
+    }
+
+    if (SLOTS == slot) {
+        pthread_mutex_lock(&m_mutex);
+        m_overflow--;
+        pthread_mutex_unlock(&m_mutex);
+        return;
+    }
+    m_slots[slot].epoch.store(0);
+}
+
+/**
+ * @brief Retire a snapshot which is no longer published
+ *
+ * Readers which entered up to now may still use it, so it is released
+ * only once they all left their sections. The epoch is advanced, so that
+ * readers entering from now on don't hold it back.
+ *
+ * @param snap pointer to the snapshot
+ */
+void afs_epoch::retire(afs_dirsnap* snap)
+{
+    pthread_mutex_lock(&m_mutex);
+    afs_retired_t r;
+    r.epoch = m_epoch.fetch_add(1);
+    r.snap = snap;
+    r.st = NULL;
+    m_retired.push_back(r);
+    reclaim();
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * @brief Retire the status of a file which is no longer published
+ * @param st pointer to the struct stat
+ */
+void afs_epoch::retire(const struct stat* st)
+{
+    pthread_mutex_lock(&m_mutex);
+    afs_retired_t r;
+    r.epoch = m_epoch.fetch_add(1);
+    r.snap = NULL;
+    r.st = st;
+    m_retired.push_back(r);
+    reclaim();
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * @brief Release the retired snapshots older than the oldest reader
+ *
+ * The epochs of the readers in m_overflow are not known, so nothing
+ * is released while there are any.
+ */
+void afs_epoch::reclaim()
+{
+    if (m_overflow > 0)
+        return;
+
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < SLOTS; i++) {
+        const uint64_t epoch = m_slots[i].epoch.load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < m_retired.size(); i++) {
+        if (m_retired[i].epoch >= oldest) {
+            m_retired[kept++] = m_retired[i];
+            continue;
+        }
+        if (m_retired[i].snap)
+            m_retired[i].snap->unref();
+        delete m_retired[i].st;
+    }
+    m_retired.resize(kept);
+}
@@ -0,0 +1,136 @@
+/*******************************************************************************************
+ *
+ * Immutable directory snapshots and their epoch based reclamation
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_SNAPSHOT_H_)
+#define _SNAPSHOT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class afs_fileinfo;
+
+/**
+ * @brief Entry of a directory snapshot
+ */
+typedef struct {
+    std::string name;                   //!< File name at the time of the snapshot
+    afs_fileinfo* info;                 //!< The file info node
+    bool deleted;                       //!< True, if the file was marked as deleted
+}   afs_dirsnap_entry_t;
+
+/**
+ * @brief Immutable, reference counted copy of the children of a directory
+ *
+ * A snapshot is never modified after it was made, so it can be read
+ * without locking. The directory holds a reference to the snapshot it
+ * published; readers which keep a snapshot beyond their epoch section
+ * take another one with ref().
+ */
+class afs_dirsnap
+{
+public:
+    afs_dirsnap(const std::vector<afs_fileinfo*>& children);
+
+    void ref();
+    void unref();
+
+    size_t size() const;
+    const afs_dirsnap_entry_t& entry(size_t idx) const;
+    afs_fileinfo* find(const std::string& name) const;
+    afs_fileinfo* find_inode(ino_t ino) const;
+
+private:
+    ~afs_dirsnap();
+    afs_dirsnap(const afs_dirsnap&);
+    afs_dirsnap& operator=(const afs_dirsnap&);
+
+    std::atomic<int> m_refs;                        //!< Reference count
+    std::vector<afs_dirsnap_entry_t> m_entries;     //!< Children in directory order
+    std::unordered_map<std::string, size_t> m_index; //!< First entry of each name
+    std::unordered_map<ino_t, size_t> m_inodes;     //!< Entry of each inode number
+};
+
+/**
+ * @brief Epoch based reclamation of replaced directory snapshots and file status
+ *
+ * Readers enter a section before they load a snapshot, and leave it
+ * when they are done with it. A replaced snapshot is retired with the
+ * current epoch, and released when no reader entered at or before that
+ * epoch is still inside its section. Neither readers nor writers wait.
+ * The published status of a file is replaced and retired the same way.
+ *
+ * Nested sections of a thread share the slot of its outermost section.
+ * When more threads than there are slots are inside a section, the
+ * others are counted under the mutex instead, and nothing is released
+ * until they left.
+ */
+class afs_epoch
+{
+public:
+    afs_epoch();
+    ~afs_epoch();
+
+    int enter();
+    void leave(int slot);
+    void retire(afs_dirsnap* snap);
+    void retire(const struct stat* st);
+
+private:
+    afs_epoch(const afs_epoch&);
+    afs_epoch& operator=(const afs_epoch&);
+    void reclaim();
+
+    /**
+     * @brief A retired snapshot or status, and the epoch it was retired in
+     */
+    typedef struct {
+        uint64_t epoch;                 //!< Epoch at retiring
+        afs_dirsnap* snap;              //!< Snapshot to unref(), or NULL
+        const struct stat* st;          //!< Status to delete, or NULL
+    }   afs_retired_t;
+
+    enum { SLOTS = 64 };
+
+    /**
+     * @brief Epoch of a reader in its section, or 0; padded to a cache line
+     */
+    typedef struct {
+        std::atomic<uint64_t> epoch;    //!< Epoch at entering, or 0 if unused
+        char pad[64 - sizeof(std::atomic<uint64_t>)];
+    }   afs_epoch_slot_t;
+
+    std::atomic<uint64_t> m_epoch;      //!< The current epoch, starting at 1
+    afs_epoch_slot_t m_slots[SLOTS];    //!< Readers inside their section
+    pthread_mutex_t m_mutex;            //!< Mutex protecting m_retired and m_overflow
+    std::vector<afs_retired_t> m_retired; //!< Replaced snapshots and status
+    int m_overflow;                     //!< Readers inside their section without a slot
+};
+
+/**
+ * @brief Class to stay inside an epoch section while in scope
+ *
+ * Without an epoch, i.e. for a node which was not yet published,
+ * there are no other readers, and the guard does nothing.
+ */
+class afs_epoch_guard
+{
+public:
+    afs_epoch_guard(afs_epoch* epoch) : m_epoch(epoch), m_slot(epoch ? epoch->enter() : -1) {}
+    ~afs_epoch_guard() { if (m_epoch) m_epoch->leave(m_slot); }
+private:
+    afs_epoch* m_epoch;
+    int m_slot;
+};
+
+#endif // !defined(_SNAPSHOT_H_)
@@ -0,0 +1,125 @@
+/*******************************************************************************************
+ *
+ * Throughput of the byte swapping copy kernels
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include <vector>
+#include "swabcopy.h"
+
+/**
+ * @brief Return the time of a monotonic clock in seconds
+ * @return seconds
+ */
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Copy one byte at a time, as read_page() did before the kernels
+ */
+static void byte_loop(byte* dst, const byte* src, size_t size, size_t offs)
+{
+    for (size_t i = 0; i < size; i++)
+        dst[i] = src[(offs + i) ^ 1];
+}
+
+/**
+ * @brief Copy with the selected kernel
+ */
+static void kernel_copy(byte* dst, const byte* src, size_t size, size_t offs)
+{
+    afs_swab::copy_at(dst, src, size, offs);
+}
+
+typedef void (*copy_fn)(byte* dst, const byte* src, size_t size, size_t offs);
+
+/**
+ * @brief Copy size bytes at offs repeatedly for the given time
+ * @param fn copy function
+ * @param dst destination buffer
+ * @param src source buffer
+ * @param size number of bytes per copy
+ * @param offs byte offset into src
+ * @param seconds time to run
+ * @return number of bytes copied per second
+ */
+static double measure(copy_fn fn, byte* dst, const byte* src, size_t size, size_t offs, double seconds)
+{
+    uint64_t bytes = 0;
+    const double start = now();
+    double elapsed;
+    do {
+        for (int i = 0; i < 1000; i++)
+            fn(dst, src, size, offs);
+        bytes += 1000 * size;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    return bytes / elapsed;
+}
+
+static int usage(const char* program)
+{
+    const char* prog = strrchr(program, '/');
+    prog = prog ? prog + 1 : program;
+    fprintf(stderr, "usage: %s [-s seconds]\n", prog);
+    fprintf(stderr, "Set FUSE_ALTO_SWAB=scalar|sse2|avx2 to force a kernel.\n");
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = 0.5;
+    for (int i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "-s") && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else
+            return usage(argv[0]);
+    }
+    if (seconds <= 0)
+        return usage(argv[0]);
+
+    const char* want = getenv("FUSE_ALTO_SWAB");
+    printf("kernel %s (FUSE_ALTO_SWAB=%s)\n", afs_swab::kernel(), want ? want : "");
+
+    // A page, a page from an odd offset, and a large read spanning pages
+    static const struct {
+        size_t size;
+        size_t offs;
+    } cases[] = {
+        { PAGESZ, 0 },
+        { PAGESZ - 2, 1 },
+        { 128 * PAGESZ, 0 },
+    };
+    const size_t ncases = sizeof(cases) / sizeof(cases[0]);
+
+    std::vector<byte> src(128 * PAGESZ + 2);
+    std::vector<byte> ref(src.size());
+    std::vector<byte> dst(src.size());
+    for (size_t i = 0; i < src.size(); i++)
+        src[i] = (byte)(i * 7 + 3);
+
+    printf("   bytes offs  byte loop MB/s  kernel MB/s  speedup\n");
+    for (size_t c = 0; c < ncases; c++) {
+        const size_t size = cases[c].size;
+        const size_t offs = cases[c].offs;
+
+        byte_loop(ref.data(), src.data(), size, offs);
+        kernel_copy(dst.data(), src.data(), size, offs);
+        if (0 != memcmp(ref.data(), dst.data(), size)) {
+            fprintf(stderr, "%s: kernel %s copies %lu bytes at %lu wrong\n",
+                argv[0], afs_swab::kernel(), size, offs);
+            return 1;
+        }
+
+        const double loop = measure(byte_loop, dst.data(), src.data(), size, offs, seconds);
+        const double kernel = measure(kernel_copy, dst.data(), src.data(), size, offs, seconds);
+        printf("%8lu %4lu %15.1f %12.1f %8.2f\n", size, offs,
+            loop / 1e6, kernel / 1e6, kernel / loop);
+    }
+    return 0;
+}
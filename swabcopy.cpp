@@ -0,0 +1,220 @@
+/*******************************************************************************************
+ *
+ * Byte swapping copy kernels
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#include "swabcopy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SWAB_X86    1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define SWAB_NEON   1
+#endif
+
+/**
+ * @brief Name of the selected kernel
+ */
+static const char* swab_name = "scalar";
+
+/**
+ * @brief Scalar kernel; dst and src may be the same
+ */
+static void swab_scalar(byte* dst, const byte* src, size_t size)
+{
+    for (size_t i = 0; i < size; i += 2) {
+        const byte b0 = src[i];
+        const byte b1 = src[i + 1];
+        dst[i] = b1;
+        dst[i + 1] = b0;
+    }
+}
+
+#if defined(SWAB_X86)
+/**
+ * @brief SSE2 kernel, 16 bytes per iteration
+ */
+__attribute__((target("sse2")))
+static void swab_sse2(byte* dst, const byte* src, size_t size)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+    }
+    swab_scalar(dst + i, src + i, size - i);
+}
+
+/**
+ * @brief AVX2 kernel, 64 bytes per iteration
+ *
+ * The tail is done here with VEX encoded 16 byte steps, as calling
+ * the SSE2 kernel with the upper halves of the registers in use costs
+ * more than the whole page copy on some CPUs.
+ */
+__attribute__((target("avx2")))
+static void swab_avx2(byte* dst, const byte* src, size_t size)
+{
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 32));
+        v0 = _mm256_or_si256(_mm256_slli_epi16(v0, 8), _mm256_srli_epi16(v0, 8));
+        v1 = _mm256_or_si256(_mm256_slli_epi16(v1, 8), _mm256_srli_epi16(v1, 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32), v1);
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+    }
+    for (; i < size; i += 2) {
+        const byte b0 = src[i];
+        const byte b1 = src[i + 1];
+        dst[i] = b1;
+        dst[i + 1] = b0;
+    }
+}
+#endif
+
+#if defined(SWAB_NEON)
+/**
+ * @brief NEON kernel, 16 bytes per iteration
+ */
+static void swab_neon(byte* dst, const byte* src, size_t size)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+        vst1q_u8(dst + i, vrev16q_u8(vld1q_u8(src + i)));
+    swab_scalar(dst + i, src + i, size - i);
+}
+#endif
+
+/**
+ * @brief Select the kernel for this CPU
+ *
+ * The environment variable FUSE_ALTO_SWAB can name a kernel
+ * (scalar, sse2, avx2, neon) to use instead, e.g. to compare them.
+ *
+ * @param name pointer to receive the name of the kernel
+ * @return pointer to the kernel function
+ */
+afs_swab::kernel_t afs_swab::select(const char** name)
+{
+    const char* want = getenv("FUSE_ALTO_SWAB");
+    if (want && !*want)
+        want = NULL;
+    if (want && 0 == strcmp(want, "scalar")) {
+        *name = "scalar";
+        return swab_scalar;
+    }
+#if defined(SWAB_X86)
+    __builtin_cpu_init();
+    if ((!want || 0 == strcmp(want, "avx2")) && __builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return swab_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return swab_sse2;
+    }
+#endif
+#if defined(SWAB_NEON)
+    *name = "neon";
+    return swab_neon;
+#endif
+    *name = "scalar";
+    return swab_scalar;
+}
+
+/**
+ * @brief Return the kernel, selecting it on the first call
+ * @return pointer to the kernel function
+ */
+afs_swab::kernel_t afs_swab::get()
+{
+    static const kernel_t k = select(&swab_name);
+    return k;
+}
+
+/**
+ * @brief Return the name of the kernel in use
+ * @return name of the kernel
+ */
+const char* afs_swab::kernel()
+{
+    get();
+    return swab_name;
+}
+
+/**
+ * @brief Copy size bytes swapping each pair of bytes (dst[i] = src[i ^ 1])
+ * @param dst destination buffer
+ * @param src source buffer
+ * @param size number of bytes; must be even
+ */
+void afs_swab::copy(void* dst, const void* src, size_t size)
+{
+    get()(reinterpret_cast<byte *>(dst), reinterpret_cast<const byte *>(src), size & ~(size_t)1);
+}
+
+/**
+ * @brief Swap each pair of bytes in place
+ * @param data buffer
+ * @param size number of bytes; must be even
+ */
+void afs_swab::inplace(void* data, size_t size)
+{
+    get()(reinterpret_cast<byte *>(data), reinterpret_cast<const byte *>(data), size & ~(size_t)1);
+}
+
+/**
+ * @brief Copy from a word swapped buffer at an offset (dst[i] = src[(offs + i) ^ 1])
+ * @param dst destination buffer of size bytes
+ * @param src word aligned source buffer, e.g. the data of a page
+ * @param size number of bytes
+ * @param offs byte offset into src, which may be odd
+ */
+void afs_swab::copy_at(void* dst, const void* src, size_t size, size_t offs)
+{
+    byte* d = reinterpret_cast<byte *>(dst);
+    const byte* s = reinterpret_cast<const byte *>(src);
+    size_t i = 0;
+    if ((offs & 1) && size > 0) {
+        d[0] = s[offs ^ 1];
+        i = 1;
+    }
+    const size_t n = (size - i) & ~(size_t)1;
+    get()(d + i, s + offs + i, n);
+    i += n;
+    if (i < size)
+        d[i] = s[(offs + i) ^ 1];
+}
+
+/**
+ * @brief Copy to a word swapped buffer at an offset (dst[(offs + i) ^ 1] = src[i])
+ * @param dst word aligned destination buffer, e.g. the data of a page
+ * @param src source buffer of size bytes
+ * @param size number of bytes
+ * @param offs byte offset into dst, which may be odd
+ */
+void afs_swab::copy_to(void* dst, const void* src, size_t size, size_t offs)
+{
+    byte* d = reinterpret_cast<byte *>(dst);
+    const byte* s = reinterpret_cast<const byte *>(src);
+    size_t i = 0;
+    if ((offs & 1) && size > 0) {
+        d[offs ^ 1] = s[0];
+        i = 1;
+    }
+    const size_t n = (size - i) & ~(size_t)1;
+    get()(d + offs + i, s + i, n);
+    i += n;
+    if (i < size)
+        d[(offs + i) ^ 1] = s[i];
+}
@@ -0,0 +1,39 @@
+/*******************************************************************************************
+ *
+ * Byte swapping copy kernels
+ *
+ * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ *******************************************************************************************/
+#if !defined(_SWABCOPY_H_)
+#define _SWABCOPY_H_
+
+#include "afs_types.h"
+
+/**
+ * @brief Class to copy and byte swap the 16 bit words of disk image data
+ *
+ * The data of the Alto file system is stored in big endian words. On a
+ * little endian host each pair of bytes must be swapped on the way to
+ * or from the disk image pages. The kernel is chosen once at runtime
+ * from the instruction sets the CPU supports (AVX2, SSE2 or NEON), with
+ * a scalar fallback.
+ */
+class afs_swab
+{
+public:
+    static void copy(void* dst, const void* src, size_t size);
+    static void inplace(void* data, size_t size);
+    static void copy_at(void* dst, const void* src, size_t size, size_t offs);
+    static void copy_to(void* dst, const void* src, size_t size, size_t offs);
+    static const char* kernel();
+
+    //! Type of a kernel which swaps size bytes (an even number) from src to dst
+    typedef void (*kernel_t)(byte* dst, const byte* src, size_t size);
+
+private:
+    static kernel_t select(const char** name);
+    static kernel_t get();
+};
+
+#endif // !defined(_SWABCOPY_H_)